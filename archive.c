@@ -0,0 +1,368 @@
+#include "archive.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static const gchar archive_pack_magic[8] = { 'T', 'L', 'P', 'A', 'C', 'K', 0, 1 };
+static const gchar archive_index_magic[8] = { 'T', 'L', 'I', 'N', 'D', 'E', 'X', 1 };
+
+struct _Archive {
+    gchar *filename;
+    int pack_fd;
+    int index_fd;
+
+    GMutex lock;
+    guint64 pack_offset;
+    guint64 index_offset;
+    guint64 next_number;
+};
+
+struct _ArchiveReader {
+    guchar *pack;
+    gsize pack_size;
+    guchar *index;
+    gsize index_size;
+    guint64 n_entries;
+};
+
+static void archive_record_encode(guchar *record, const ArchiveEntry *entry)
+{
+    guint64 values[4] = {
+        GUINT64_TO_LE(entry->offset),
+        GUINT64_TO_LE(entry->size),
+        GUINT64_TO_LE((guint64)entry->timestamp),
+        GUINT64_TO_LE(entry->number)
+    };
+
+    memcpy(record, values, ARCHIVE_RECORD_SIZE);
+}
+
+static void archive_record_decode(const guchar *record, ArchiveEntry *entry)
+{
+    guint64 values[4];
+
+    memcpy(values, record, ARCHIVE_RECORD_SIZE);
+    entry->offset = GUINT64_FROM_LE(values[0]);
+    entry->size = GUINT64_FROM_LE(values[1]);
+    entry->timestamp = (gint64)GUINT64_FROM_LE(values[2]);
+    entry->number = GUINT64_FROM_LE(values[3]);
+}
+
+/* an entry is only valid if its data is completely in the pack */
+static gboolean archive_entry_is_valid(const ArchiveEntry *entry, guint64 pack_size)
+{
+    return entry->offset >= ARCHIVE_HEADER_SIZE &&
+        entry->offset <= pack_size &&
+        entry->size <= pack_size - entry->offset;
+}
+
+static gboolean archive_pwrite(int fd, const guchar *data, gsize size, guint64 offset)
+{
+    gssize written;
+
+    while (size > 0) {
+        written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+
+    return TRUE;
+}
+
+/* write the header to an empty file or check it */
+static gboolean archive_check_header(int fd, const gchar *magic, const gchar *filename)
+{
+    guchar header[ARCHIVE_HEADER_SIZE];
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        g_printerr("Error reading %s: %s\n", filename, strerror(errno));
+        return FALSE;
+    }
+
+    if (st.st_size == 0) {
+        memset(header, 0, ARCHIVE_HEADER_SIZE);
+        memcpy(header, magic, 8);
+        if (!archive_pwrite(fd, header, ARCHIVE_HEADER_SIZE, 0)) {
+            g_printerr("Error writing %s: %s\n", filename, strerror(errno));
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    if (pread(fd, header, ARCHIVE_HEADER_SIZE, 0) != ARCHIVE_HEADER_SIZE ||
+            memcmp(header, magic, 8) != 0) {
+        g_printerr("%s is not a frame archive\n", filename);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* find the complete entries of an existing archive and cut off whatever was
+ * written after the last of them */
+static gboolean archive_recover(Archive *archive, const gchar *index_filename)
+{
+    guchar buffer[256 * ARCHIVE_RECORD_SIZE];
+    struct stat pack_st, index_st;
+    ArchiveEntry entry;
+    guint64 end = ARCHIVE_HEADER_SIZE;
+    guint64 offset = ARCHIVE_HEADER_SIZE;
+    gssize n;
+    gsize j;
+
+    if (fstat(archive->pack_fd, &pack_st) != 0 || fstat(archive->index_fd, &index_st) != 0) {
+        g_printerr("Error reading %s: %s\n", archive->filename, strerror(errno));
+        return FALSE;
+    }
+
+    while (offset + ARCHIVE_RECORD_SIZE <= (guint64)index_st.st_size) {
+        n = pread(archive->index_fd, buffer, sizeof(buffer), offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < ARCHIVE_RECORD_SIZE)
+            break;
+
+        for (j = 0; j + ARCHIVE_RECORD_SIZE <= (gsize)n; j += ARCHIVE_RECORD_SIZE) {
+            archive_record_decode(buffer + j, &entry);
+            if (!archive_entry_is_valid(&entry, pack_st.st_size))
+                goto done;
+            end = entry.offset + entry.size;
+            if (entry.number >= archive->next_number)
+                archive->next_number = entry.number + 1;
+            offset += ARCHIVE_RECORD_SIZE;
+        }
+    }
+
+done:
+    if ((guint64)index_st.st_size != offset || (guint64)pack_st.st_size != end) {
+        g_printerr("Dropping incomplete frames at the end of %s\n", archive->filename);
+        if (ftruncate(archive->index_fd, offset) != 0 || ftruncate(archive->pack_fd, end) != 0) {
+            g_printerr("Error truncating %s: %s\n", index_filename, strerror(errno));
+            return FALSE;
+        }
+    }
+
+    archive->pack_offset = end;
+    archive->index_offset = offset;
+
+    return TRUE;
+}
+
+Archive *archive_open(const gchar *filename)
+{
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    Archive *archive = g_malloc0(sizeof(Archive));
+    gchar *index_filename = g_strconcat(filename, ARCHIVE_INDEX_SUFFIX, NULL);
+
+    archive->filename = g_strdup(filename);
+    archive->pack_fd = open(filename, O_RDWR | O_CREAT, 0644);
+    archive->index_fd = open(index_filename, O_RDWR | O_CREAT, 0644);
+    g_mutex_init(&archive->lock);
+
+    if (archive->pack_fd == -1 || archive->index_fd == -1) {
+        g_printerr("Error opening %s: %s\n",
+                archive->pack_fd == -1 ? filename : index_filename, strerror(errno));
+        goto error;
+    }
+
+    if (!archive_check_header(archive->pack_fd, archive_pack_magic, filename) ||
+            !archive_check_header(archive->index_fd, archive_index_magic, index_filename) ||
+            !archive_recover(archive, index_filename))
+        goto error;
+
+    g_free(index_filename);
+    return archive;
+
+error:
+    g_free(index_filename);
+    archive_close(archive);
+    return NULL;
+}
+
+void archive_close(Archive *archive)
+{
+    if (archive == NULL)
+        return;
+
+    if (archive->pack_fd != -1)
+        close(archive->pack_fd);
+    if (archive->index_fd != -1)
+        close(archive->index_fd);
+    g_mutex_clear(&archive->lock);
+    g_free(archive->filename);
+    g_free(archive);
+}
+
+const gchar *archive_get_filename(Archive *archive)
+{
+    g_return_val_if_fail(archive != NULL, NULL);
+
+    return archive->filename;
+}
+
+guint64 archive_reserve_number(Archive *archive)
+{
+    guint64 number;
+
+    g_return_val_if_fail(archive != NULL, 0);
+
+    g_mutex_lock(&archive->lock);
+    number = archive->next_number++;
+    g_mutex_unlock(&archive->lock);
+
+    return number;
+}
+
+gboolean archive_append(Archive *archive, guint64 number, gint64 timestamp,
+        const guchar *data, gsize size)
+{
+    g_return_val_if_fail(archive != NULL, FALSE);
+    g_return_val_if_fail(data != NULL || size == 0, FALSE);
+
+    guchar record[ARCHIVE_RECORD_SIZE];
+    ArchiveEntry entry;
+    gboolean result = FALSE;
+
+    g_mutex_lock(&archive->lock);
+
+    entry.offset = archive->pack_offset;
+    entry.size = size;
+    entry.timestamp = timestamp;
+    entry.number = number;
+    archive_record_encode(record, &entry);
+
+    /* on failure the offsets stay, the next frame overwrites the partial data */
+    if (!archive_pwrite(archive->pack_fd, data, size, archive->pack_offset) ||
+            !archive_pwrite(archive->index_fd, record, ARCHIVE_RECORD_SIZE, archive->index_offset)) {
+        g_printerr("Error writing %s: %s\n", archive->filename, strerror(errno));
+        goto done;
+    }
+
+    archive->pack_offset += size;
+    archive->index_offset += ARCHIVE_RECORD_SIZE;
+    result = TRUE;
+
+done:
+    g_mutex_unlock(&archive->lock);
+
+    return result;
+}
+
+static guchar *archive_map(const gchar *filename, const gchar *magic, gsize *size)
+{
+    struct stat st;
+    guchar *map;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        g_printerr("Error opening %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < ARCHIVE_HEADER_SIZE) {
+        g_printerr("%s is not a frame archive\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    /* the mapping stays valid after closing the descriptor */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        g_printerr("Error mapping %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    if (memcmp(map, magic, 8) != 0) {
+        g_printerr("%s is not a frame archive\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return map;
+}
+
+ArchiveReader *archive_reader_open(const gchar *filename)
+{
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    ArchiveReader *reader = g_malloc0(sizeof(ArchiveReader));
+    gchar *index_filename = g_strconcat(filename, ARCHIVE_INDEX_SUFFIX, NULL);
+    ArchiveEntry entry;
+    guint64 n;
+
+    reader->pack = archive_map(filename, archive_pack_magic, &reader->pack_size);
+    reader->index = archive_map(index_filename, archive_index_magic, &reader->index_size);
+    g_free(index_filename);
+
+    if (reader->pack == NULL || reader->index == NULL) {
+        archive_reader_close(reader);
+        return NULL;
+    }
+
+    /* the archive may still be written to, stop at the first incomplete entry */
+    n = (reader->index_size - ARCHIVE_HEADER_SIZE) / ARCHIVE_RECORD_SIZE;
+    for (reader->n_entries = 0; reader->n_entries < n; ++reader->n_entries) {
+        archive_record_decode(reader->index + ARCHIVE_HEADER_SIZE +
+                reader->n_entries * ARCHIVE_RECORD_SIZE, &entry);
+        if (!archive_entry_is_valid(&entry, reader->pack_size))
+            break;
+    }
+
+    return reader;
+}
+
+void archive_reader_close(ArchiveReader *reader)
+{
+    if (reader == NULL)
+        return;
+
+    if (reader->pack)
+        munmap(reader->pack, reader->pack_size);
+    if (reader->index)
+        munmap(reader->index, reader->index_size);
+    g_free(reader);
+}
+
+guint64 archive_reader_get_n_entries(ArchiveReader *reader)
+{
+    g_return_val_if_fail(reader != NULL, 0);
+
+    return reader->n_entries;
+}
+
+gboolean archive_reader_get_entry(ArchiveReader *reader, guint64 index, ArchiveEntry *entry)
+{
+    g_return_val_if_fail(reader != NULL, FALSE);
+    g_return_val_if_fail(entry != NULL, FALSE);
+
+    if (index >= reader->n_entries)
+        return FALSE;
+
+    archive_record_decode(reader->index + ARCHIVE_HEADER_SIZE + index * ARCHIVE_RECORD_SIZE, entry);
+
+    return TRUE;
+}
+
+const guchar *archive_reader_get_data(ArchiveReader *reader, const ArchiveEntry *entry)
+{
+    g_return_val_if_fail(reader != NULL, NULL);
+    g_return_val_if_fail(entry != NULL, NULL);
+    g_return_val_if_fail(archive_entry_is_valid(entry, reader->pack_size), NULL);
+
+    return reader->pack + entry->offset;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <glib.h>
+
+/* A pack file holds encoded frames back to back behind a 16 byte header.
+ * The sidecar index (the pack filename plus ARCHIVE_INDEX_SUFFIX) has a 16
+ * byte header and one fixed size record per frame; all integers are little
+ * endian, so both files can be mapped and read directly:
+ *
+ *   pack header:  "TLPACK\0\1", 8 bytes reserved
+ *   index header: "TLINDEX\1", 8 bytes reserved
+ *   record:       offset (u64), size (u64), capture time (i64, microseconds
+ *                 since the epoch), frame number (u64)
+ *
+ * A frame is written before its record, so after a crash the index never
+ * points at missing data; reopening an archive drops incomplete entries. */
+
+#define ARCHIVE_HEADER_SIZE 16
+#define ARCHIVE_RECORD_SIZE 32
+#define ARCHIVE_INDEX_SUFFIX ".idx"
+
+typedef struct _Archive Archive;
+typedef struct _ArchiveReader ArchiveReader;
+
+typedef struct {
+    guint64 offset;
+    guint64 size;
+    gint64 timestamp;
+    guint64 number;
+} ArchiveEntry;
+
+/* creates the archive or continues an existing one; NULL on error */
+Archive *archive_open(const gchar *filename);
+void archive_close(Archive *archive);
+const gchar *archive_get_filename(Archive *archive);
+
+/* numbers continue after the highest one already in the archive */
+guint64 archive_reserve_number(Archive *archive);
+/* thread safe */
+gboolean archive_append(Archive *archive, guint64 number, gint64 timestamp,
+        const guchar *data, gsize size);
+
+/* maps pack and index read-only; entries are in the order they were written */
+ArchiveReader *archive_reader_open(const gchar *filename);
+void archive_reader_close(ArchiveReader *reader);
+guint64 archive_reader_get_n_entries(ArchiveReader *reader);
+gboolean archive_reader_get_entry(ArchiveReader *reader, guint64 index, ArchiveEntry *entry);
+/* points into the mapping, valid until the reader is closed */
+const guchar *archive_reader_get_data(ArchiveReader *reader, const ArchiveEntry *entry);
@@ -1,9 +1,46 @@
 #include "camera.h"
+#include "change.h"
+#include "ring.h"
+#include "swizzle.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
 #include <gst/gst.h>
 #include <gst/interfaces/xoverlay.h>
 #include <gst/base/gstbasesink.h>
+#include <gst/app/gstappsink.h>
 
-#include <Imlib2.h>
+#define CAMERA_DEFAULT_ENCODER_THREADS 2
+#define CAMERA_DEFAULT_ENCODER_QUEUE 8
+/* the preview holds one frame, the rest is for the encoder queue */
+#define CAMERA_FRAME_POOL_SIZE 4
+/* in burst mode the snapshot callback gets at most one frame per interval (µs) */
+#define CAMERA_BURST_PREVIEW_INTERVAL (G_USEC_PER_SEC / 4)
+/* frames waiting to be compressed for the pre-trigger ring, more are skipped */
+#define CAMERA_RING_MAX_PENDING 2
+
+/* a frame from the tap on its way into the pre-trigger ring */
+typedef struct {
+    GstBuffer *buffer;
+    gint64 timestamp;
+    CameraCaptureMode mode;
+    JpegencOptions jpeg_options;
+} CameraRingJob;
+
+/* a snapshot waiting for frames from the tap to be stacked */
+typedef struct {
+    gchar *filename;
+    CAMERA_SNAPSHOT_TAKEN_CALLBACK cb;
+    gpointer userdata;
+    gint64 start;
+    guint frames;
+    StackMode mode;
+
+    /* streaming thread only */
+    gboolean started;
+    /* the combined frame, set once by the streaming thread */
+    Frame *frame;
+} CameraStackRequest;
 
 struct _Camera {
     gint64 window_id;
@@ -11,17 +48,102 @@ struct _Camera {
     GstElement *playsink;
     GstElement *pipeline;
     GstElement *source;
+    GstElement *tee;
+    GstElement *tap_filter;
+    GstElement *tap;
+    GstElement *preview_valve;
     GstState state;
+    CameraCaptureMode capture_mode;
+    gboolean preview;
+    gboolean preview_active;
+    gdouble preview_rate;
+    gchar *source_description;
+    gchar *device;
+
+    /* fixed caps and decoder instead of decodebin2, see camera_set_pipeline_hint */
+    gchar *hint_caps;
+    gchar *hint_decoder;
+    gboolean using_hint;
+    /* what decodebin2 found, under frame_lock */
+    gchar *found_caps;
+    gchar *found_decoder;
+
+    /* latest frame from the tap, in the snapshot format */
+    GMutex frame_lock;
+    GstBuffer *last_frame;
+    guint snapshot_width;
+    guint snapshot_height;
+
+    Encoder *encoder;
+    FramePool *frame_pool;
+    guint encoder_threads;
+    guint encoder_queue;
+    JpegencOptions jpeg_options;
+    WriterOptions writer_options;
+    Archive *archive;
+    Stats *timings;
+
+    /* frame stacking; stack is only touched by the streaming thread */
+    guint stack_frames;
+    StackMode stack_mode;
+    Stack *stack;
+    GMutex stack_lock;
+    CameraStackRequest *stack_request;
+    guint stack_done_id;
+
+    guint snapshot_preview_width;
+    guint snapshot_preview_height;
+
+    /* burst mode, see camera_set_burst; held while a frame is pushed */
+    GMutex burst_lock;
+    CAMERA_BURST_FILENAME_CALLBACK burst_name_cb;
+    CAMERA_BURST_QUEUED_CALLBACK burst_queued_cb;
+    CAMERA_SNAPSHOT_TAKEN_CALLBACK burst_cb;
+    gpointer burst_userdata;
+    gint64 burst_last_preview;
+
+    /* pre-trigger ring, fed from the streaming thread and compressed in ring_pool */
+    GMutex ring_lock;
+    Ring *ring;
+    GThreadPool *ring_pool;
+    FramePool *ring_frame_pool;
+    gint64 ring_interval;
+    gint64 ring_last;
+    gint ring_pending;
+
+    /* thumbnails of the last snapshot and of the frame last measured */
+    guchar scene_reference[CHANGE_THUMB_SIZE];
+    guchar scene_current[CHANGE_THUMB_SIZE];
+    gboolean scene_reference_valid;
+    gboolean scene_current_valid;
 
     guint32 initialized : 1;
 };
 
 void camera_setup_pipeline(Camera *camera);
+static void camera_set_last_frame(Camera *camera, GstBuffer *buffer);
+static void camera_rebuild_pipeline(Camera *camera);
+static void camera_drop_pipeline_hint(Camera *camera);
+static void camera_stack_cancel(Camera *camera);
+static void camera_bus_error(GstBus *bus, GstMessage *message, Camera *camera);
 
 Camera *camera_new()
 {
     gst_init(NULL, NULL);
-    return g_malloc0(sizeof(Camera));
+    Camera *camera = g_malloc0(sizeof(Camera));
+    g_mutex_init(&camera->frame_lock);
+    g_mutex_init(&camera->stack_lock);
+    g_mutex_init(&camera->burst_lock);
+    g_mutex_init(&camera->ring_lock);
+    camera->stack_frames = 1;
+    camera->frame_pool = frame_pool_new(CAMERA_FRAME_POOL_SIZE);
+    camera->encoder_threads = CAMERA_DEFAULT_ENCODER_THREADS;
+    camera->encoder_queue = CAMERA_DEFAULT_ENCODER_QUEUE;
+    jpegenc_options_init(&camera->jpeg_options);
+    writer_options_init(&camera->writer_options);
+    camera->preview = TRUE;
+    camera->preview_active = TRUE;
+    return camera;
 }
 
 void camera_set_window_id(Camera *camera, gint64 window_id)
@@ -31,6 +153,343 @@ void camera_set_window_id(Camera *camera, gint64 window_id)
     camera->window_id = window_id;
 }
 
+void camera_set_capture_mode(Camera *camera, CameraCaptureMode mode)
+{
+    g_return_if_fail(camera != NULL);
+
+    if (camera->capture_mode == mode)
+        return;
+
+    camera->capture_mode = mode;
+
+    /* the tap sits at a different place, build a new pipeline */
+    camera_rebuild_pipeline(camera);
+}
+
+void camera_set_preview(Camera *camera, gboolean preview)
+{
+    g_return_if_fail(camera != NULL);
+
+    if (camera->preview == preview)
+        return;
+
+    camera->preview = preview;
+    camera_rebuild_pipeline(camera);
+}
+
+void camera_set_preview_rate(Camera *camera, gdouble fps)
+{
+    g_return_if_fail(camera != NULL);
+
+    if (fps < 0)
+        fps = 0;
+    if (camera->preview_rate == fps)
+        return;
+
+    camera->preview_rate = fps;
+    if (camera->preview)
+        camera_rebuild_pipeline(camera);
+}
+
+void camera_set_preview_active(Camera *camera, gboolean active)
+{
+    g_return_if_fail(camera != NULL);
+
+    camera->preview_active = active;
+    if (camera->preview_valve)
+        g_object_set(G_OBJECT(camera->preview_valve), "drop", !active, NULL);
+}
+
+void camera_set_pipeline_hint(Camera *camera, const gchar *caps, const gchar *decoder)
+{
+    g_return_if_fail(camera != NULL);
+
+    g_free(camera->hint_caps);
+    g_free(camera->hint_decoder);
+    camera->hint_caps = caps && decoder ? g_strdup(caps) : NULL;
+    camera->hint_decoder = caps && decoder ? g_strdup(decoder) : NULL;
+}
+
+gboolean camera_get_pipeline_hint(Camera *camera, gchar **caps, gchar **decoder)
+{
+    g_return_val_if_fail(camera != NULL, FALSE);
+    g_return_val_if_fail(caps != NULL && decoder != NULL, FALSE);
+
+    *caps = NULL;
+    *decoder = NULL;
+
+    g_mutex_lock(&camera->frame_lock);
+    if (camera->found_caps) {
+        *caps = g_strdup(camera->found_caps);
+        *decoder = g_strdup(camera->found_decoder);
+    }
+    else if (camera->using_hint && camera->last_frame) {
+        *caps = g_strdup(camera->hint_caps);
+        *decoder = g_strdup(camera->hint_decoder);
+    }
+    g_mutex_unlock(&camera->frame_lock);
+
+    return *caps != NULL;
+}
+
+void camera_set_source(Camera *camera, const gchar *description)
+{
+    g_return_if_fail(camera != NULL);
+
+    if (description && description[0] == '\0')
+        description = NULL;
+    if (g_strcmp0(camera->source_description, description) == 0)
+        return;
+
+    g_free(camera->source_description);
+    camera->source_description = g_strdup(description);
+    camera_rebuild_pipeline(camera);
+}
+
+void camera_set_device(Camera *camera, const gchar *device)
+{
+    g_return_if_fail(camera != NULL);
+
+    if (device && device[0] == '\0')
+        device = NULL;
+    if (g_strcmp0(camera->device, device) == 0)
+        return;
+
+    g_free(camera->device);
+    camera->device = g_strdup(device);
+    if (camera->source_description == NULL)
+        camera_rebuild_pipeline(camera);
+}
+
+/* the signal watch holds on to the bus and its handlers, it has to go first */
+static void camera_free_pipeline(Camera *camera)
+{
+    GstBus *bus;
+
+    if (camera->pipeline == NULL)
+        return;
+
+    gst_element_set_state(camera->pipeline, GST_STATE_NULL);
+
+    bus = gst_element_get_bus(GST_ELEMENT(camera->pipeline));
+    gst_bus_remove_signal_watch(bus);
+    gst_bus_set_sync_handler(bus, NULL, NULL);
+    g_signal_handlers_disconnect_by_func(bus, G_CALLBACK(camera_bus_error), camera);
+    gst_object_unref(bus);
+
+    gst_object_unref(camera->pipeline);
+    camera->pipeline = NULL;
+}
+
+/* the hint did not work out, build the pipeline with autoplugging again */
+static void camera_drop_pipeline_hint(Camera *camera)
+{
+    g_printerr("Cached pipeline (%s ! %s) failed, autoplugging\n",
+            camera->hint_caps, camera->hint_decoder[0] ? camera->hint_decoder : "identity");
+    camera_set_pipeline_hint(camera, NULL, NULL);
+
+    camera_free_pipeline(camera);
+    camera->initialized = 0;
+    camera_set_last_frame(camera, NULL);
+    camera_stack_cancel(camera);
+    camera_setup_pipeline(camera);
+}
+
+static void camera_rebuild_pipeline(Camera *camera)
+{
+    if (camera->initialized) {
+        gboolean running = GST_STATE(camera->pipeline) == GST_STATE_PLAYING;
+
+        camera_free_pipeline(camera);
+        camera->tap_filter = NULL;
+        camera->preview_valve = NULL;
+        camera->playsink = NULL;
+        camera->vsink = NULL;
+        camera->initialized = 0;
+        camera_set_last_frame(camera, NULL);
+        camera_stack_cancel(camera);
+        camera->scene_reference_valid = FALSE;
+
+        if (running)
+            camera_start(camera);
+    }
+}
+
+CameraCaptureMode camera_capture_mode_from_string(const gchar *str)
+{
+    if (g_strcmp0(str, "yuv") == 0)
+        return CAMERA_CAPTURE_YUV;
+    if (g_strcmp0(str, "mjpeg") == 0)
+        return CAMERA_CAPTURE_MJPEG;
+    return CAMERA_CAPTURE_RGB;
+}
+
+const gchar *camera_capture_mode_to_string(CameraCaptureMode mode)
+{
+    switch (mode) {
+        case CAMERA_CAPTURE_YUV:
+            return "yuv";
+        case CAMERA_CAPTURE_MJPEG:
+            return "mjpeg";
+        case CAMERA_CAPTURE_RGB:
+        default:
+            return "rgb";
+    }
+}
+
+/* the streaming thread pushes burst frames to camera->encoder under
+ * burst_lock, so it must not be swapped without it; the old encoder is
+ * finished outside of the lock, a burst simply skips frames meanwhile */
+static void camera_drop_encoder(Camera *camera)
+{
+    Encoder *encoder;
+
+    g_mutex_lock(&camera->burst_lock);
+    encoder = camera->encoder;
+    camera->encoder = NULL;
+    g_mutex_unlock(&camera->burst_lock);
+
+    encoder_destroy(encoder);
+}
+
+void camera_set_encoder_threads(Camera *camera, guint n_threads, guint queue_size)
+{
+    g_return_if_fail(camera != NULL);
+
+    camera->encoder_threads = n_threads;
+    camera->encoder_queue = queue_size;
+
+    /* recreated with the new settings on the next snapshot */
+    camera_drop_encoder(camera);
+}
+
+void camera_set_jpeg_options(Camera *camera, const JpegencOptions *options)
+{
+    g_return_if_fail(camera != NULL);
+    g_return_if_fail(options != NULL);
+
+    camera->jpeg_options = *options;
+    if (camera->encoder)
+        encoder_set_jpeg_options(camera->encoder, options);
+}
+
+void camera_set_writer_options(Camera *camera, const WriterOptions *options)
+{
+    g_return_if_fail(camera != NULL);
+    g_return_if_fail(options != NULL);
+
+    camera->writer_options = *options;
+    if (camera->encoder)
+        encoder_set_writer_options(camera->encoder, options);
+}
+
+gboolean camera_set_archive(Camera *camera, const gchar *filename)
+{
+    g_return_val_if_fail(camera != NULL, FALSE);
+
+    if (camera->archive && filename &&
+            g_strcmp0(archive_get_filename(camera->archive), filename) == 0)
+        return TRUE;
+
+    /* let the encoder finish everything queued for the old output first */
+    camera_drop_encoder(camera);
+    archive_close(camera->archive);
+    camera->archive = NULL;
+
+    if (filename)
+        camera->archive = archive_open(filename);
+
+    return filename == NULL || camera->archive != NULL;
+}
+
+void camera_set_timings(Camera *camera, Stats *timings)
+{
+    g_return_if_fail(camera != NULL);
+
+    camera->timings = timings;
+    if (camera->encoder)
+        encoder_set_timings(camera->encoder, timings);
+}
+
+void camera_set_stacking(Camera *camera, guint frames, StackMode mode)
+{
+    g_return_if_fail(camera != NULL);
+
+    /* the same limits as stack_new, so the stack can be kept */
+    camera->stack_frames = CLAMP(frames, 1,
+            mode == STACK_MEDIAN ? STACK_MAX_MEDIAN_FRAMES : STACK_MAX_FRAMES);
+    camera->stack_mode = mode;
+}
+
+gdouble camera_get_scene_change(Camera *camera)
+{
+    g_return_val_if_fail(camera != NULL, -1.0);
+
+    GstBuffer *buffer = NULL;
+    GstCaps *caps;
+    GstStructure *s;
+    gint w = 0, h = 0;
+
+    camera->scene_current_valid = FALSE;
+    if (camera->capture_mode == CAMERA_CAPTURE_MJPEG)
+        return -1.0;
+
+    g_mutex_lock(&camera->frame_lock);
+    if (camera->last_frame)
+        buffer = gst_buffer_ref(camera->last_frame);
+    g_mutex_unlock(&camera->frame_lock);
+
+    if (buffer == NULL)
+        return -1.0;
+
+    if ((caps = gst_buffer_get_caps(buffer)) != NULL) {
+        s = gst_caps_get_structure(caps, 0);
+        gst_structure_get_int(s, "width", &w);
+        gst_structure_get_int(s, "height", &h);
+        gst_caps_unref(caps);
+    }
+
+    if (w > 0 && h > 0) {
+        /* for I420 the luma plane comes first, with rows rounded up to 4 bytes */
+        if (camera->capture_mode == CAMERA_CAPTURE_RGB)
+            change_thumbnail_rgba(camera->scene_current, GST_BUFFER_DATA(buffer), w, h, w * 4);
+        else
+            change_thumbnail_luma(camera->scene_current, GST_BUFFER_DATA(buffer), w, h,
+                    GST_ROUND_UP_4(w));
+        camera->scene_current_valid = TRUE;
+    }
+    gst_buffer_unref(buffer);
+
+    if (!camera->scene_current_valid || !camera->scene_reference_valid)
+        return -1.0;
+
+    return change_difference(camera->scene_reference, camera->scene_current);
+}
+
+void camera_set_snapshot_preview_size(Camera *camera, guint width, guint height)
+{
+    g_return_if_fail(camera != NULL);
+
+    camera->snapshot_preview_width = width;
+    camera->snapshot_preview_height = height;
+    if (camera->encoder)
+        encoder_set_preview_size(camera->encoder, width, height);
+}
+
+void camera_get_encoder_stats(Camera *camera, EncoderStats *stats)
+{
+    g_return_if_fail(camera != NULL);
+    g_return_if_fail(stats != NULL);
+
+    if (camera->encoder) {
+        encoder_get_stats(camera->encoder, stats);
+    }
+    else {
+        memset(stats, 0, sizeof(EncoderStats));
+        stats->queue_size = camera->encoder_queue;
+    }
+}
+
 void camera_start(Camera *camera)
 {
     g_return_if_fail(camera != NULL);
@@ -39,16 +498,50 @@ void camera_start(Camera *camera)
         camera_setup_pipeline(camera);
 
     GstStateChangeReturn ret = gst_element_set_state(GST_ELEMENT(camera->pipeline), GST_STATE_PLAYING);
+    if (ret == GST_STATE_CHANGE_FAILURE && camera->using_hint) {
+        camera_drop_pipeline_hint(camera);
+        ret = gst_element_set_state(GST_ELEMENT(camera->pipeline), GST_STATE_PLAYING);
+    }
     if (ret == GST_STATE_CHANGE_FAILURE) {
         g_printerr("State change failure at camera_start()\n");
     }
 }
 
+static void camera_set_last_frame(Camera *camera, GstBuffer *buffer)
+{
+    GstBuffer *old;
+
+    g_mutex_lock(&camera->frame_lock);
+    old = camera->last_frame;
+    camera->last_frame = buffer;
+    g_mutex_unlock(&camera->frame_lock);
+
+    if (old)
+        gst_buffer_unref(old);
+}
+
+gboolean camera_has_frame(Camera *camera)
+{
+    gboolean result;
+
+    g_return_val_if_fail(camera != NULL, FALSE);
+
+    g_mutex_lock(&camera->frame_lock);
+    result = camera->last_frame != NULL;
+    g_mutex_unlock(&camera->frame_lock);
+
+    return result;
+}
+
 void camera_stop(Camera *camera)
 {
     g_return_if_fail(camera != NULL);
 
-    gst_element_set_state(camera->pipeline, GST_STATE_READY);
+    /* not built yet, or freed for a rebuild */
+    if (camera->pipeline)
+        gst_element_set_state(camera->pipeline, GST_STATE_READY);
+    camera_set_last_frame(camera, NULL);
+    camera_stack_cancel(camera);
 }
 
 void camera_destroy(Camera *camera)
@@ -56,16 +549,35 @@ void camera_destroy(Camera *camera)
     if (camera == NULL)
         return;
 
-    if (camera->pipeline) {
-        gst_element_set_state(camera->pipeline, GST_STATE_NULL);
-        gst_object_unref(camera->pipeline);
-    }
+    camera_free_pipeline(camera);
+
+    camera_set_last_frame(camera, NULL);
+    camera_stack_cancel(camera);
+    g_mutex_clear(&camera->frame_lock);
+    stack_destroy(camera->stack);
+    g_mutex_clear(&camera->stack_lock);
+    g_mutex_clear(&camera->burst_lock);
+    camera_set_pretrigger(camera, 0, 0, 0);
+    g_mutex_clear(&camera->ring_lock);
+    g_free(camera->source_description);
+    g_free(camera->device);
+    g_free(camera->hint_caps);
+    g_free(camera->hint_decoder);
+    g_free(camera->found_caps);
+    g_free(camera->found_decoder);
+    encoder_destroy(camera->encoder);
+    archive_close(camera->archive);
+    frame_pool_destroy(camera->frame_pool);
 
     g_free(camera);
 }
 
 static GstBusSyncReply camera_bus_sync_handler(GstBus *bus, GstMessage *message, Camera *camera)
 {
+    /* every message passes here, on the thread that posted it */
+    if (trace_enabled())
+        trace_instant("bus", GST_MESSAGE_TYPE_NAME(message));
+
     if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_ELEMENT)
         return GST_BUS_PASS;
     if (!gst_structure_has_name(message->structure, "prepare-xwindow-id"))
@@ -87,6 +599,7 @@ static void camera_bus_error(GstBus *bus, GstMessage *message, Camera *camera)
 {
     GError *err;
     gchar *debug_info;
+    gint64 start = TRACE_BEGIN();
 
     gst_message_parse_error(message, &err, &debug_info);
     g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME(message->src), err->message);
@@ -94,7 +607,575 @@ static void camera_bus_error(GstBus *bus, GstMessage *message, Camera *camera)
     g_clear_error(&err);
     g_free(debug_info);
 
+    /* typically not-negotiated, the camera no longer offers the cached mode */
+    if (camera->using_hint && !camera_has_frame(camera)) {
+        camera_drop_pipeline_hint(camera);
+        camera_start(camera);
+        TRACE_END("bus", "error", start);
+        return;
+    }
+
     gst_element_set_state(camera->pipeline, GST_STATE_READY);
+    camera_set_last_frame(camera, NULL);
+    camera_stack_cancel(camera);
+
+    TRACE_END("bus", "error", start);
+}
+
+static void camera_stack_request_free(CameraStackRequest *request)
+{
+    if (request == NULL)
+        return;
+
+    if (request->frame)
+        frame_unref(request->frame);
+    g_free(request->filename);
+    g_free(request);
+}
+
+/* only while the streaming thread is stopped */
+static void camera_stack_cancel(Camera *camera)
+{
+    CameraStackRequest *request;
+
+    g_mutex_lock(&camera->stack_lock);
+    request = camera->stack_request;
+    camera->stack_request = NULL;
+    if (camera->stack_done_id) {
+        g_source_remove(camera->stack_done_id);
+        camera->stack_done_id = 0;
+    }
+    g_mutex_unlock(&camera->stack_lock);
+
+    camera_stack_request_free(request);
+}
+
+static Encoder *camera_get_encoder(Camera *camera)
+{
+    Encoder *encoder;
+
+    if (camera->encoder == NULL) {
+        encoder = encoder_new(camera->encoder_threads, camera->encoder_queue);
+        if (encoder == NULL)
+            return NULL;
+        encoder_set_jpeg_options(encoder, &camera->jpeg_options);
+        encoder_set_writer_options(encoder, &camera->writer_options);
+        encoder_set_archive(encoder, camera->archive);
+        encoder_set_timings(encoder, camera->timings);
+        encoder_set_preview_size(encoder, camera->snapshot_preview_width,
+                camera->snapshot_preview_height);
+
+        /* published complete, see camera_drop_encoder */
+        g_mutex_lock(&camera->burst_lock);
+        camera->encoder = encoder;
+        g_mutex_unlock(&camera->burst_lock);
+    }
+
+    return camera->encoder;
+}
+
+gboolean camera_prepare_encoder(Camera *camera)
+{
+    g_return_val_if_fail(camera != NULL, FALSE);
+
+    return camera_get_encoder(camera) != NULL;
+}
+
+/* back in the main loop with the combined frame */
+static gboolean camera_stack_done(Camera *camera)
+{
+    CameraStackRequest *request;
+    Encoder *encoder;
+    Frame *frame;
+
+    g_mutex_lock(&camera->stack_lock);
+    request = camera->stack_request;
+    camera->stack_request = NULL;
+    camera->stack_done_id = 0;
+    g_mutex_unlock(&camera->stack_lock);
+
+    frame = request->frame;
+    request->frame = NULL;
+    if ((encoder = camera_get_encoder(camera)) == NULL) {
+        frame_unref(frame);
+    }
+    else if (frame->format == FRAME_FORMAT_ARGB32) {
+        /* still in the byte order of the camera, converted in place */
+        encoder_push(encoder, request->filename, frame, frame->data, NULL, NULL,
+                (ENCODER_DONE_CALLBACK)request->cb, request->userdata);
+    }
+    else {
+        encoder_push(encoder, request->filename, frame, NULL, NULL, NULL,
+                (ENCODER_DONE_CALLBACK)request->cb, request->userdata);
+    }
+
+    stats_record(camera->timings, STATS_STAGE_GRAB, g_get_monotonic_time() - request->start);
+    TRACE_END("camera", "stack", request->start);
+    camera_stack_request_free(request);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* runs in the streaming thread; the tap queue drops frames while we are busy,
+ * so the preview does not stall */
+static void camera_stack_buffer(Camera *camera, GstBuffer *buffer)
+{
+    CameraStackRequest *request;
+    GstCaps *caps;
+    GstStructure *s;
+    Frame *frame;
+    guchar *data;
+    gint w = 0, h = 0;
+    gsize size = GST_BUFFER_SIZE(buffer);
+
+    g_mutex_lock(&camera->stack_lock);
+    request = camera->stack_request;
+    g_mutex_unlock(&camera->stack_lock);
+
+    if (request == NULL || request->frame)
+        return;
+
+    if (camera->stack == NULL || stack_get_size(camera->stack) != size ||
+            stack_get_depth(camera->stack) != request->frames ||
+            stack_get_mode(camera->stack) != request->mode) {
+        /* first frame or the size changed */
+        stack_destroy(camera->stack);
+        camera->stack = stack_new(request->mode, request->frames, size);
+    }
+    else if (!request->started) {
+        stack_reset(camera->stack);
+    }
+    request->started = TRUE;
+
+    if (stack_add(camera->stack, GST_BUFFER_DATA(buffer)) < stack_get_depth(camera->stack))
+        return;
+
+    if ((caps = gst_buffer_get_caps(buffer)) == NULL) {
+        stack_reset(camera->stack);
+        return;
+    }
+    s = gst_caps_get_structure(caps, 0);
+    gst_structure_get_int(s, "width", &w);
+    gst_structure_get_int(s, "height", &h);
+    gst_caps_unref(caps);
+
+    if (camera->capture_mode == CAMERA_CAPTURE_RGB) {
+        frame = frame_pool_acquire(camera->frame_pool, w, h);
+        stack_finish(camera->stack, frame->data);
+    }
+    else {
+        data = g_malloc(size);
+        stack_finish(camera->stack, data);
+        frame = frame_new_for_data(FRAME_FORMAT_I420, w, h, data, size, g_free, data);
+    }
+
+    g_mutex_lock(&camera->stack_lock);
+    request->frame = frame;
+    camera->stack_done_id = g_idle_add((GSourceFunc)camera_stack_done, camera);
+    g_mutex_unlock(&camera->stack_lock);
+}
+
+static gboolean camera_get_buffer_size(GstBuffer *buffer, gint *width, gint *height)
+{
+    GstCaps *caps = gst_buffer_get_caps(buffer);
+    GstStructure *s;
+
+    *width = *height = 0;
+    if (caps == NULL)
+        return FALSE;
+
+    s = gst_caps_get_structure(caps, 0);
+    gst_structure_get_int(s, "width", width);
+    gst_structure_get_int(s, "height", height);
+    gst_caps_unref(caps);
+
+    return *width > 0 && *height > 0;
+}
+
+/* takes the reference to buffer, which has to be in the snapshot format */
+static gboolean camera_push_buffer(Camera *camera, GstBuffer *buffer, const gchar *filename,
+        CAMERA_SNAPSHOT_TAKEN_CALLBACK cb, gpointer userdata)
+{
+    Frame *frame;
+    gint w, h;
+
+    if (!camera_get_buffer_size(buffer, &w, &h)) {
+        gst_buffer_unref(buffer);
+        return FALSE;
+    }
+
+    /* the encoder owns our reference from now on, the buffer itself
+     * is shared with the tap and must not be modified */
+    if (camera->capture_mode == CAMERA_CAPTURE_RGB) {
+        return encoder_push(camera->encoder, filename,
+                frame_pool_acquire(camera->frame_pool, w, h),
+                GST_BUFFER_DATA(buffer), (GDestroyNotify)gst_buffer_unref, buffer,
+                (ENCODER_DONE_CALLBACK)cb, userdata);
+    }
+
+    /* yuv and jpeg are handed to the encoder without a copy */
+    frame = frame_new_for_data(
+            camera->capture_mode == CAMERA_CAPTURE_YUV ? FRAME_FORMAT_I420 : FRAME_FORMAT_JPEG,
+            w, h, GST_BUFFER_DATA(buffer), GST_BUFFER_SIZE(buffer),
+            (GDestroyNotify)gst_buffer_unref, buffer);
+    return encoder_push(camera->encoder, filename, frame, NULL, NULL, NULL,
+            (ENCODER_DONE_CALLBACK)cb, userdata);
+}
+
+/* in the streaming thread, every frame goes straight to the encoder */
+static void camera_burst_buffer(Camera *camera, GstBuffer *buffer)
+{
+    CAMERA_SNAPSHOT_TAKEN_CALLBACK cb = NULL;
+    gchar *filename;
+    gboolean queued;
+    gint64 now;
+
+    g_mutex_lock(&camera->burst_lock);
+    if (camera->burst_name_cb && camera->encoder &&
+            (filename = camera->burst_name_cb(camera->burst_userdata)) != NULL) {
+        now = g_get_monotonic_time();
+        if (now - camera->burst_last_preview >= CAMERA_BURST_PREVIEW_INTERVAL) {
+            camera->burst_last_preview = now;
+            cb = camera->burst_cb;
+        }
+        queued = camera_push_buffer(camera, gst_buffer_ref(buffer), filename, cb,
+                camera->burst_userdata);
+        if (camera->burst_queued_cb)
+            camera->burst_queued_cb(queued, camera->burst_userdata);
+        stats_record(camera->timings, STATS_STAGE_GRAB, g_get_monotonic_time() - now);
+        g_free(filename);
+    }
+    g_mutex_unlock(&camera->burst_lock);
+}
+
+/* in ring_pool; the ring keeps JPEG only, so that a few seconds fit into memory */
+static void camera_ring_compress(CameraRingJob *job, Camera *camera)
+{
+    Frame *frame = NULL;
+    Frame *raw = NULL;
+    guchar *data = NULL;
+    gsize size = 0;
+    gint w, h;
+
+    if (!camera_get_buffer_size(job->buffer, &w, &h))
+        goto done;
+
+    switch (job->mode) {
+        case CAMERA_CAPTURE_MJPEG:
+            /* copied, the camera has only a few buffers to fill */
+            data = g_memdup(GST_BUFFER_DATA(job->buffer), GST_BUFFER_SIZE(job->buffer));
+            frame = frame_new_for_data(FRAME_FORMAT_JPEG, w, h, data,
+                    GST_BUFFER_SIZE(job->buffer), g_free, data);
+            goto done;
+        case CAMERA_CAPTURE_YUV:
+            raw = frame_new_for_data(FRAME_FORMAT_I420, w, h, GST_BUFFER_DATA(job->buffer),
+                    GST_BUFFER_SIZE(job->buffer), (GDestroyNotify)gst_buffer_unref,
+                    gst_buffer_ref(job->buffer));
+            break;
+        case CAMERA_CAPTURE_RGB:
+        default:
+            raw = frame_pool_acquire(camera->ring_frame_pool, w, h);
+            swizzle_rb((guint32 *)raw->data, (const guint32 *)GST_BUFFER_DATA(job->buffer),
+                    (gsize)w * h);
+            break;
+    }
+
+    if (jpegenc_encode_frame(raw, &job->jpeg_options, &data, &size))
+        frame = frame_new_for_data(FRAME_FORMAT_JPEG, w, h, data, size, free, data);
+
+done:
+    if (frame)
+        ring_push(camera->ring, frame, job->timestamp);
+    frame_unref(raw);
+    gst_buffer_unref(job->buffer);
+    g_slice_free(CameraRingJob, job);
+    g_atomic_int_add(&camera->ring_pending, -1);
+}
+
+/* in the streaming thread; compressing takes too long to do it here */
+static void camera_ring_buffer(Camera *camera, GstBuffer *buffer)
+{
+    CameraRingJob *job;
+    gint64 now;
+
+    g_mutex_lock(&camera->ring_lock);
+    if (camera->ring) {
+        now = g_get_monotonic_time();
+        if (now - camera->ring_last >= camera->ring_interval &&
+                g_atomic_int_get(&camera->ring_pending) < CAMERA_RING_MAX_PENDING) {
+            camera->ring_last = now;
+            job = g_slice_new(CameraRingJob);
+            job->buffer = gst_buffer_ref(buffer);
+            job->timestamp = now;
+            job->mode = camera->capture_mode;
+            job->jpeg_options = camera->jpeg_options;
+            g_atomic_int_inc(&camera->ring_pending);
+            g_thread_pool_push(camera->ring_pool, job, NULL);
+        }
+    }
+    g_mutex_unlock(&camera->ring_lock);
+}
+
+void camera_set_pretrigger(Camera *camera, gdouble seconds, guint max_mib, gdouble fps)
+{
+    g_return_if_fail(camera != NULL);
+
+    GError *err = NULL;
+
+    g_mutex_lock(&camera->ring_lock);
+    /* waits for the frames being compressed */
+    if (camera->ring_pool)
+        g_thread_pool_free(camera->ring_pool, TRUE, TRUE);
+    camera->ring_pool = NULL;
+    ring_destroy(camera->ring);
+    camera->ring = NULL;
+    frame_pool_destroy(camera->ring_frame_pool);
+    camera->ring_frame_pool = NULL;
+
+    if (seconds > 0) {
+        camera->ring_pool = g_thread_pool_new((GFunc)camera_ring_compress, camera, 1, FALSE, &err);
+        if (err) {
+            g_printerr("Could not create the pre-trigger thread: %s\n", err->message);
+            g_clear_error(&err);
+        }
+        else {
+            camera->ring = ring_new(seconds * G_USEC_PER_SEC, (gsize)max_mib << 20);
+            camera->ring_frame_pool = frame_pool_new(1);
+            camera->ring_interval = fps > 0 ? G_USEC_PER_SEC / fps : 0;
+            camera->ring_last = 0;
+        }
+    }
+    g_mutex_unlock(&camera->ring_lock);
+}
+
+GPtrArray *camera_take_pretrigger(Camera *camera)
+{
+    g_return_val_if_fail(camera != NULL, NULL);
+
+    GPtrArray *frames = NULL;
+
+    g_mutex_lock(&camera->ring_lock);
+    if (camera->ring)
+        frames = ring_take(camera->ring);
+    g_mutex_unlock(&camera->ring_lock);
+
+    return frames;
+}
+
+static GstFlowReturn camera_tap_new_buffer(GstAppSink *sink, Camera *camera)
+{
+    GstBuffer *buffer = gst_app_sink_pull_buffer(sink);
+
+    if (buffer) {
+        camera_ring_buffer(camera, buffer);
+        camera_burst_buffer(camera, buffer);
+        camera_stack_buffer(camera, buffer);
+        camera_set_last_frame(camera, buffer);
+    }
+
+    return GST_FLOW_OK;
+}
+
+void camera_set_burst(Camera *camera, CAMERA_BURST_FILENAME_CALLBACK name_cb,
+        CAMERA_BURST_QUEUED_CALLBACK queued_cb, CAMERA_SNAPSHOT_TAKEN_CALLBACK cb,
+        gpointer userdata)
+{
+    g_return_if_fail(camera != NULL);
+
+    g_mutex_lock(&camera->burst_lock);
+    camera->burst_name_cb = name_cb;
+    camera->burst_queued_cb = queued_cb;
+    camera->burst_cb = cb;
+    camera->burst_userdata = userdata;
+    camera->burst_last_preview = 0;
+    g_mutex_unlock(&camera->burst_lock);
+}
+
+/* takes the next stack_frames frames from the tap, see camera_stack_buffer */
+static gboolean camera_stack_snapshot(Camera *camera, const gchar *filename,
+        CAMERA_SNAPSHOT_TAKEN_CALLBACK cb, gpointer userdata)
+{
+    CameraStackRequest *request;
+
+    g_mutex_lock(&camera->stack_lock);
+    if (camera->stack_request) {
+        /* still collecting the previous one */
+        g_mutex_unlock(&camera->stack_lock);
+        return FALSE;
+    }
+
+    request = g_malloc0(sizeof(CameraStackRequest));
+    request->filename = g_strdup(filename);
+    request->cb = cb;
+    request->userdata = userdata;
+    request->start = g_get_monotonic_time();
+    request->frames = camera->stack_frames;
+    request->mode = camera->stack_mode;
+    camera->stack_request = request;
+    g_mutex_unlock(&camera->stack_lock);
+
+    return TRUE;
+}
+
+static GstCaps *camera_snapshot_caps(CameraCaptureMode mode, guint width, guint height)
+{
+    GstCaps *caps;
+
+    switch (mode) {
+        case CAMERA_CAPTURE_YUV:
+            caps = gst_caps_new_simple("video/x-raw-yuv",
+                    "format", GST_TYPE_FOURCC, GST_MAKE_FOURCC('I', '4', '2', '0'),
+                    "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                    NULL);
+            break;
+        case CAMERA_CAPTURE_MJPEG:
+            /* this constrains the camera itself, there is no scaler */
+            caps = gst_caps_new_simple("image/jpeg", NULL);
+            break;
+        case CAMERA_CAPTURE_RGB:
+        default:
+            /* we get the color in rgba, the encoder turns it into native argb */
+            caps = gst_caps_new_simple("video/x-raw-rgb",
+                    "bpp", G_TYPE_INT, 32,
+                    "depth", G_TYPE_INT, 32,
+                    "endianness", G_TYPE_INT, G_BIG_ENDIAN,
+                    "red_mask", G_TYPE_INT, 0xff000000,
+                    "green_mask", G_TYPE_INT, 0x00ff0000,
+                    "blue_mask", G_TYPE_INT, 0x0000ff00,
+                    "alpha_mask", G_TYPE_INT, 0x000000ff,
+                    "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                    NULL);
+            break;
+    }
+    if (width)
+        gst_caps_set_simple(caps,
+                "width", G_TYPE_INT, width,
+                NULL);
+    if (height)
+        gst_caps_set_simple(caps,
+                "height", G_TYPE_INT, height,
+                NULL);
+
+    return caps;
+}
+
+void camera_set_snapshot_size(Camera *camera, guint width, guint height)
+{
+    g_return_if_fail(camera != NULL);
+
+    if (camera->tap_filter && camera->snapshot_width == width && camera->snapshot_height == height)
+        return;
+
+    camera->snapshot_width = width;
+    camera->snapshot_height = height;
+
+    if (camera->tap_filter) {
+        GstCaps *caps = camera_snapshot_caps(camera->capture_mode, width, height);
+        g_object_set(G_OBJECT(camera->tap_filter), "caps", caps, NULL);
+        gst_caps_unref(caps);
+
+        /* do not hand out frames in the old size */
+        camera_set_last_frame(camera, NULL);
+    }
+}
+
+/* remember what decodebin2 came up with to skip autoplugging next time;
+ * chains with more than one decoder are not cached */
+static void camera_remember_decoder(Camera *camera, GstElement *decodebin)
+{
+    GstPad *pad = gst_element_get_static_pad(decodebin, "sink");
+    GstCaps *caps = gst_pad_get_negotiated_caps(pad);
+    GstIterator *it;
+    gpointer item;
+    GstElementFactory *factory;
+    gchar *decoder = NULL;
+    guint n_decoders = 0;
+    gboolean done = FALSE;
+
+    gst_object_unref(pad);
+    if (caps == NULL)
+        return;
+
+    it = gst_bin_iterate_elements(GST_BIN(decodebin));
+    while (!done) {
+        switch (gst_iterator_next(it, &item)) {
+            case GST_ITERATOR_OK:
+                factory = gst_element_get_factory(GST_ELEMENT(item));
+                if (factory && strstr(gst_element_factory_get_klass(factory), "Decoder")) {
+                    g_free(decoder);
+                    decoder = g_strdup(GST_PLUGIN_FEATURE_NAME(factory));
+                    ++n_decoders;
+                }
+                gst_object_unref(item);
+                break;
+            case GST_ITERATOR_RESYNC:
+                gst_iterator_resync(it);
+                g_free(decoder);
+                decoder = NULL;
+                n_decoders = 0;
+                break;
+            default:
+                done = TRUE;
+                break;
+        }
+    }
+    gst_iterator_free(it);
+
+    if (n_decoders <= 1) {
+        g_mutex_lock(&camera->frame_lock);
+        g_free(camera->found_caps);
+        g_free(camera->found_decoder);
+        camera->found_caps = gst_caps_to_string(caps);
+        /* raw video needs no decoder */
+        camera->found_decoder = decoder ? decoder : g_strdup("");
+        decoder = NULL;
+        g_mutex_unlock(&camera->frame_lock);
+    }
+
+    g_free(decoder);
+    gst_caps_unref(caps);
+}
+
+/* capsfilter ! decoder from an earlier run, in a bin with ghost pads to stand
+ * in for decodebin2; NULL if the caps or the decoder are not usable */
+static GstElement *camera_create_hinted_decoder(Camera *camera)
+{
+    GstCaps *caps = gst_caps_from_string(camera->hint_caps);
+    GstElement *bin, *filter, *last, *decoder = NULL;
+    GstPad *pad;
+
+    if (caps == NULL)
+        return NULL;
+    if (camera->hint_decoder[0] &&
+            (decoder = gst_element_factory_make(camera->hint_decoder, NULL)) == NULL) {
+        gst_caps_unref(caps);
+        return NULL;
+    }
+
+    bin = gst_bin_new(NULL);
+    filter = gst_element_factory_make("capsfilter", NULL);
+    g_object_set(G_OBJECT(filter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    gst_bin_add(GST_BIN(bin), filter);
+    last = filter;
+
+    if (decoder) {
+        gst_bin_add(GST_BIN(bin), decoder);
+        if (!gst_element_link(filter, decoder)) {
+            gst_object_unref(bin);
+            return NULL;
+        }
+        last = decoder;
+    }
+
+    pad = gst_element_get_static_pad(filter, "sink");
+    gst_element_add_pad(bin, gst_ghost_pad_new("sink", pad));
+    gst_object_unref(pad);
+    pad = gst_element_get_static_pad(last, "src");
+    gst_element_add_pad(bin, gst_ghost_pad_new("src", pad));
+    gst_object_unref(pad);
+
+    return bin;
 }
 
 static void camera_decoder_pad_added(GstElement *src, GstPad *new_pad, Camera *camera)
@@ -109,17 +1190,19 @@ static void camera_decoder_pad_added(GstElement *src, GstPad *new_pad, Camera *c
     new_pad_struct = gst_caps_get_structure(new_pad_caps, 0);
     new_pad_type = gst_structure_get_name(new_pad_struct);
 
-    GstElementClass *klass = GST_ELEMENT_GET_CLASS(camera->playsink);
-    GstPadTemplate *templ = NULL;
-
-    if (g_str_has_prefix(new_pad_type, "audio"))
-        templ = gst_element_class_get_pad_template(klass, "audio_sink");
-    else if (g_str_has_prefix(new_pad_type, "video"))
-        templ = gst_element_class_get_pad_template(klass, "video_sink");
-
-    if (templ) {
-        sink_pad = gst_element_request_pad(camera->playsink, templ, NULL, NULL);
+    if (g_str_has_prefix(new_pad_type, "video")) {
+        /* video goes to the tee feeding the preview and the snapshot tap */
+        sink_pad = gst_element_get_static_pad(camera->tee, "sink");
+        camera_remember_decoder(camera, src);
+    }
+    else if (g_str_has_prefix(new_pad_type, "audio") && camera->playsink) {
+        GstElementClass *klass = GST_ELEMENT_GET_CLASS(camera->playsink);
+        GstPadTemplate *templ = gst_element_class_get_pad_template(klass, "audio_sink");
+        if (templ)
+            sink_pad = gst_element_request_pad(camera->playsink, templ, NULL, NULL);
+    }
 
+    if (sink_pad) {
         if (gst_pad_is_linked(sink_pad)) {
             g_print("Already linked\n");
             goto done;
@@ -137,27 +1220,201 @@ done:
         gst_object_unref(sink_pad);
 }
 
+/* raw video at no more than the preview rate */
+static GstCaps *camera_preview_rate_caps(gdouble fps)
+{
+    GstCaps *caps;
+    gint num, denom;
+
+    gst_util_double_to_fraction(fps, &num, &denom);
+    caps = gst_caps_new_simple("video/x-raw-yuv",
+            "framerate", GST_TYPE_FRACTION, num, denom, NULL);
+    gst_caps_append(caps, gst_caps_new_simple("video/x-raw-rgb",
+            "framerate", GST_TYPE_FRACTION, num, denom, NULL));
+
+    return caps;
+}
+
+/* valve (gst-plugins-bad) to stop feeding the preview, NULL if it is missing */
+static GstElement *camera_create_preview_valve(Camera *camera)
+{
+    GstElement *valve = gst_element_factory_make("valve", NULL);
+
+    if (valve == NULL) {
+        g_printerr("No valve element, the preview cannot be paused\n");
+        return NULL;
+    }
+    g_object_set(G_OBJECT(valve), "drop", !camera->preview_active, NULL);
+
+    return valve;
+}
+
+static GstElement *camera_create_source(Camera *camera)
+{
+    GstElement *source = NULL;
+    GError *err = NULL;
+
+    if (camera->source_description) {
+        source = gst_parse_bin_from_description(camera->source_description, TRUE, &err);
+        if (err) {
+            g_printerr("Invalid source \"%s\": %s\n", camera->source_description, err->message);
+            g_clear_error(&err);
+        }
+    }
+    if (source == NULL) {
+        source = gst_element_factory_make("v4l2src", NULL);
+        if (source && camera->device)
+            g_object_set(G_OBJECT(source), "device", camera->device, NULL);
+    }
+
+    return source;
+}
+
 void camera_setup_pipeline(Camera *camera)
 {
 #if 1
     camera->pipeline = gst_pipeline_new(NULL);
-    camera->vsink = gst_element_factory_make("xvimagesink", NULL);
-    g_object_set(G_OBJECT(camera->vsink), "force-aspect-ratio", TRUE, NULL);
+    camera->preview_valve = NULL;
+
+    camera->source = camera_create_source(camera);
+
+    /* without a preview nothing has to be decoded in mjpeg mode */
+    GstElement *decoder = NULL;
+    camera->using_hint = FALSE;
+    if (camera->preview || camera->capture_mode != CAMERA_CAPTURE_MJPEG) {
+        /* autoplugging probes the device, a known good chain starts much faster */
+        if (camera->hint_caps && (decoder = camera_create_hinted_decoder(camera)) != NULL) {
+            camera->using_hint = TRUE;
+        }
+        else {
+            decoder = gst_element_factory_make("decodebin2", NULL);
+            g_signal_connect(G_OBJECT(decoder), "pad-added",
+                    G_CALLBACK(camera_decoder_pad_added), camera);
+        }
+        gst_bin_add(GST_BIN(camera->pipeline), decoder);
+    }
 
-    camera->playsink = gst_element_factory_make("playsink", NULL);
-    g_object_set(G_OBJECT(camera->playsink), "video-sink", camera->vsink, NULL);
+    camera->tee = gst_element_factory_make("tee", NULL);
 
-    camera->source = gst_element_factory_make("v4l2src", NULL);
+    /* snapshot tap: always holds the latest frame in the snapshot format */
+    GstElement *tap_queue = gst_element_factory_make("queue", NULL);
+    g_object_set(G_OBJECT(tap_queue),
+            "max-size-buffers", 1,
+            "leaky", 2, /* downstream */
+            NULL);
+    camera->tap_filter = gst_element_factory_make("capsfilter", NULL);
+    GstCaps *caps = camera_snapshot_caps(camera->capture_mode,
+            camera->snapshot_width, camera->snapshot_height);
+    g_object_set(G_OBJECT(camera->tap_filter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    camera->tap = gst_element_factory_make("appsink", NULL);
+    g_object_set(G_OBJECT(camera->tap),
+            "sync", FALSE,
+            "max-buffers", 1,
+            "drop", TRUE,
+            NULL);
+    GstAppSinkCallbacks tap_callbacks = { NULL, NULL, NULL, NULL };
+    tap_callbacks.new_buffer = (GstFlowReturn (*)(GstAppSink *, gpointer))camera_tap_new_buffer;
+    gst_app_sink_set_callbacks(GST_APP_SINK(camera->tap), &tap_callbacks, camera, NULL);
 
-    GstElement *decoder = gst_element_factory_make("decodebin2", NULL);
-    g_signal_connect(G_OBJECT(decoder), "pad-added",
-            G_CALLBACK(camera_decoder_pad_added), camera);
+    gst_bin_add_many(GST_BIN(camera->pipeline), camera->source, camera->tee,
+            tap_queue, camera->tap_filter, camera->tap, NULL);
 
-    /* FIXME: add videoscale */
+    if (camera->preview) {
+        camera->vsink = gst_element_factory_make("xvimagesink", NULL);
+        g_object_set(G_OBJECT(camera->vsink), "force-aspect-ratio", TRUE, NULL);
 
-    gst_bin_add_many(GST_BIN(camera->pipeline), camera->source, decoder, camera->playsink, NULL);
-    if (!gst_element_link(camera->source, decoder)) {
-        g_printerr("Elements could not be linked. (source -> playsink)\n");
+        camera->playsink = gst_element_factory_make("playsink", NULL);
+        g_object_set(G_OBJECT(camera->playsink), "video-sink", camera->vsink, NULL);
+
+        GstElement *preview_queue = gst_element_factory_make("queue", NULL);
+        gst_bin_add_many(GST_BIN(camera->pipeline), preview_queue, camera->playsink, NULL);
+        if (!gst_element_link(camera->tee, preview_queue))
+            g_printerr("Elements could not be linked. (tee -> preview)\n");
+
+        /* in mjpeg mode the valve sits in front of the decoder, see below */
+        GstElement *preview_last = preview_queue;
+        if (camera->capture_mode != CAMERA_CAPTURE_MJPEG &&
+                (camera->preview_valve = camera_create_preview_valve(camera)) != NULL) {
+            gst_bin_add(GST_BIN(camera->pipeline), camera->preview_valve);
+            if (!gst_element_link(preview_last, camera->preview_valve))
+                g_printerr("Elements could not be linked. (preview -> valve)\n");
+            preview_last = camera->preview_valve;
+        }
+
+        /* drop frames, the display does not need the full rate of the camera */
+        if (camera->preview_rate > 0) {
+            GstElement *rate = gst_element_factory_make("videorate", NULL);
+            GstElement *rate_filter = gst_element_factory_make("capsfilter", NULL);
+            GstCaps *rate_caps = camera_preview_rate_caps(camera->preview_rate);
+
+            /* never duplicate frames of a slow camera (gst-plugins-base 0.10.36) */
+            if (g_object_class_find_property(G_OBJECT_GET_CLASS(rate), "drop-only"))
+                g_object_set(G_OBJECT(rate), "drop-only", TRUE, NULL);
+            g_object_set(G_OBJECT(rate_filter), "caps", rate_caps, NULL);
+            gst_caps_unref(rate_caps);
+
+            gst_bin_add_many(GST_BIN(camera->pipeline), rate, rate_filter, NULL);
+            if (!gst_element_link_many(preview_last, rate, rate_filter, NULL))
+                g_printerr("Elements could not be linked. (preview -> videorate)\n");
+            preview_last = rate_filter;
+        }
+
+        GstPad *preview_pad = gst_element_get_request_pad(camera->playsink, "video_sink");
+        GstPad *last_pad = gst_element_get_static_pad(preview_last, "src");
+        if (GST_PAD_LINK_FAILED(gst_pad_link(last_pad, preview_pad))) {
+            g_printerr("Elements could not be linked. (preview -> playsink)\n");
+        }
+        gst_object_unref(last_pad);
+        gst_object_unref(preview_pad);
+    }
+
+    if (camera->capture_mode == CAMERA_CAPTURE_MJPEG && !camera->preview) {
+        if (!gst_element_link_many(camera->source, camera->tap_filter, tap_queue,
+                    camera->tap, NULL)) {
+            g_printerr("Elements could not be linked. (source -> appsink)\n");
+        }
+    }
+    else if (camera->capture_mode == CAMERA_CAPTURE_MJPEG) {
+        /* tap the compressed stream in front of the decoder */
+        GstElement *source_tee = gst_element_factory_make("tee", NULL);
+        GstElement *decoder_queue = gst_element_factory_make("queue", NULL);
+        gst_bin_add_many(GST_BIN(camera->pipeline), source_tee, decoder_queue, NULL);
+
+        /* only the preview is decoded, a paused preview needs no decoding at all */
+        GstElement *decoder_input = decoder_queue;
+        if ((camera->preview_valve = camera_create_preview_valve(camera)) != NULL) {
+            gst_bin_add(GST_BIN(camera->pipeline), camera->preview_valve);
+            if (!gst_element_link(decoder_queue, camera->preview_valve))
+                g_printerr("Elements could not be linked. (queue -> valve)\n");
+            decoder_input = camera->preview_valve;
+        }
+
+        if (!gst_element_link_many(camera->source, camera->tap_filter, source_tee,
+                    decoder_queue, NULL) ||
+                !gst_element_link(decoder_input, decoder)) {
+            g_printerr("Elements could not be linked. (source -> decoder)\n");
+        }
+        if (!gst_element_link_many(source_tee, tap_queue, camera->tap, NULL)) {
+            g_printerr("Elements could not be linked. (source -> appsink)\n");
+        }
+    }
+    else {
+        GstElement *colorspace = gst_element_factory_make("ffmpegcolorspace", NULL);
+        GstElement *scale = gst_element_factory_make("videoscale", NULL);
+        gst_bin_add_many(GST_BIN(camera->pipeline), colorspace, scale, NULL);
+
+        if (!gst_element_link(camera->source, decoder)) {
+            g_printerr("Elements could not be linked. (source -> decoder)\n");
+        }
+        if (!gst_element_link_many(camera->tee, tap_queue, colorspace, scale,
+                    camera->tap_filter, camera->tap, NULL)) {
+            g_printerr("Elements could not be linked. (tee -> appsink)\n");
+        }
+    }
+    if (camera->using_hint && !gst_element_link(decoder, camera->tee)) {
+        g_printerr("Elements could not be linked. (decoder -> tee)\n");
     }
 #else
     camera->pipeline = gst_parse_launch("v4l2src ! xvimagesink", NULL);
@@ -178,69 +1435,53 @@ gboolean camera_save_snapshot_to_file(Camera *camera, const gchar *filename, gui
 {
     g_return_val_if_fail(camera != NULL, FALSE);
 
-    GstCaps *caps = NULL;
     GstBuffer *buffer = NULL;
-    gint w = 0, h = 0;
-    GstStructure *s;
-    Imlib_Image image = NULL;
-    gboolean result = FALSE;
+    gboolean result;
+    gint64 start = g_get_monotonic_time();
 
-    caps = gst_caps_new_simple("video/x-raw-rgb",
-            "format", G_TYPE_STRING, "ARGB",
-            "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
-            NULL);
-    if (width)
-        gst_caps_set_simple(caps,
-                "width", G_TYPE_INT, width,
-                NULL);
-    if (height)
-        gst_caps_set_simple(caps,
-                "height", G_TYPE_INT, height,
-                NULL);
+    if (camera_get_encoder(camera) == NULL)
+        return FALSE;
 
-    g_signal_emit_by_name(camera->playsink, "convert-frame", caps, &buffer);
-    gst_caps_unref(caps);
-    caps = NULL;
+    /* the measured frame is the one compared against from now on */
+    if (camera->scene_current_valid) {
+        memcpy(camera->scene_reference, camera->scene_current, CHANGE_THUMB_SIZE);
+        camera->scene_reference_valid = TRUE;
+        camera->scene_current_valid = FALSE;
+    }
 
-    if (!buffer)
-        goto done;
+    camera_set_snapshot_size(camera, width, height);
 
-    caps = gst_buffer_get_caps(buffer);
-    if (caps == NULL)
-        goto done;
+    /* compressed frames cannot be stacked */
+    if (camera->stack_frames > 1 && camera->capture_mode != CAMERA_CAPTURE_MJPEG)
+        return camera_stack_snapshot(camera, filename, cb, userdata);
 
-    s = gst_caps_get_structure(caps, 0);
-    gst_structure_get_int(s, "width", &w);
-    gst_structure_get_int(s, "height", &h);
+    g_mutex_lock(&camera->frame_lock);
+    if (camera->last_frame)
+        buffer = gst_buffer_ref(camera->last_frame);
+    g_mutex_unlock(&camera->frame_lock);
 
-    /* we get the color in rgba*/
-#define SWAP_BYTES24(c) (c)=(((c) & 0xff00ff00) | (((c) >> 16)&0xff) | (((c) <<16)&0xff0000))
-    gsize j;
-    guint32 *cur;
-    for (j=0, cur = (guint32 *)buffer->data; j < w*h; ++j, ++cur)
-        SWAP_BYTES24(*cur);
-#undef SWAP_BYTES24
-
-    /* save buffer to file */
-    image = imlib_create_image_using_data(w, h, (DATA32 *)buffer->data);
-    imlib_context_set_image(image);
-/*    imlib_image_set_format("jpeg");*/
-    Imlib_Load_Error err = 0;
-    imlib_save_image_with_error_return(filename, &err);
-    if (err)
-        g_print("Error loading image: %d\n", err);
-    imlib_free_image();
-
-    if (cb)
-        cb(w, h, buffer->data, userdata);
-
-    result = TRUE;
+    if (!buffer)
+        return FALSE;
+
+    result = camera_push_buffer(camera, buffer, filename, cb, userdata);
+
+    stats_record(camera->timings, STATS_STAGE_GRAB, g_get_monotonic_time() - start);
+    TRACE_END("camera", "grab", start);
 
-done:
-    if (caps)
-        gst_caps_unref(caps);
-    if (buffer)
-        gst_buffer_unref(buffer);
     return result;
 }
 
+gboolean camera_save_frame_to_file(Camera *camera, const gchar *filename, Frame *frame,
+        CAMERA_SNAPSHOT_TAKEN_CALLBACK cb, gpointer userdata)
+{
+    g_return_val_if_fail(camera != NULL, FALSE);
+    g_return_val_if_fail(frame != NULL, FALSE);
+
+    if (camera_get_encoder(camera) == NULL) {
+        frame_unref(frame);
+        return FALSE;
+    }
+
+    return encoder_push(camera->encoder, filename, frame, NULL, NULL, NULL,
+            (ENCODER_DONE_CALLBACK)cb, userdata);
+}
@@ -1,16 +1,105 @@
 #pragma once
 
 #include <glib.h>
+#include "encoder.h"
+#include "stack.h"
 
 typedef struct _Camera Camera;
 
+typedef enum {
+    CAMERA_CAPTURE_RGB = 0, /* convert every snapshot to rgb */
+    CAMERA_CAPTURE_YUV,     /* keep I420, JPEG files are encoded from it directly */
+    CAMERA_CAPTURE_MJPEG    /* request MJPEG from the camera and store it as it is */
+} CameraCaptureMode;
+
 Camera *camera_new();
 void camera_set_window_id(Camera *camera, gint64 window_id);
+/* size of the frames kept for snapshots, 0 keeps the size of the source */
+void camera_set_snapshot_size(Camera *camera, guint width, guint height);
+/* rebuilds the pipeline if it was already set up */
+void camera_set_capture_mode(Camera *camera, CameraCaptureMode mode);
+CameraCaptureMode camera_capture_mode_from_string(const gchar *str);
+const gchar *camera_capture_mode_to_string(CameraCaptureMode mode);
+/* without preview there is no video sink and no window is needed;
+ * rebuilds the pipeline if it was already set up */
+void camera_set_preview(Camera *camera, gboolean preview);
+/* limit the preview to fps frames per second (0: rate of the camera), snapshots
+ * are not affected; rebuilds the pipeline if it was already set up */
+void camera_set_preview_rate(Camera *camera, gdouble fps);
+/* stop feeding (and in mjpeg mode decoding) the preview while it is not visible */
+void camera_set_preview_active(Camera *camera, gboolean active);
+/* a gst-launch style description of the source (e.g. "videotestsrc is-live=true"),
+ * NULL for the default v4l2src; rebuilds the pipeline if it was already set up */
+void camera_set_source(Camera *camera, const gchar *description);
+/* device node of the default v4l2src (e.g. /dev/video1), NULL for the first
+ * camera; ignored with a source description; rebuilds the pipeline if needed */
+void camera_set_device(Camera *camera, const gchar *device);
+/* caps of the source and the decoder factory ("" for raw video) to link directly
+ * instead of autoplugging with decodebin2, from camera_get_pipeline_hint of an
+ * earlier run; used the next time the pipeline is built, NULL clears it;
+ * if the pipeline does not come up with it the hint is dropped */
+void camera_set_pipeline_hint(Camera *camera, const gchar *caps, const gchar *decoder);
+/* FALSE until a working pipeline delivered its first frame; free with g_free */
+gboolean camera_get_pipeline_hint(Camera *camera, gchar **caps, gchar **decoder);
 void camera_start(Camera *camera);
+/* TRUE once the first frame in the snapshot format has arrived */
+gboolean camera_has_frame(Camera *camera);
 void camera_stop(Camera *camera);
 void camera_destroy(Camera *camera);
 
-/* width, height, data, userdata*/
-typedef void (*CAMERA_SNAPSHOT_TAKEN_CALLBACK)(guint, guint, guchar *, gpointer);
+void camera_set_encoder_threads(Camera *camera, guint n_threads, guint queue_size);
+void camera_get_encoder_stats(Camera *camera, EncoderStats *stats);
+/* stage timings of snapshots and the encoder, NULL to stop; must outlive the camera */
+void camera_set_timings(Camera *camera, Stats *timings);
+/* the previews passed to the snapshot callback fit into width x height (0: default) */
+void camera_set_snapshot_preview_size(Camera *camera, guint width, guint height);
+/* each snapshot combines that many consecutive frames of the stream (1: off);
+ * ignored in mjpeg mode; the snapshot is queued once all frames are in */
+void camera_set_stacking(Camera *camera, guint frames, StackMode mode);
+/* mean absolute luma difference (0-255) of the current frame to the last
+ * snapshot, on thumbnails; -1 if there is nothing to compare (no snapshot
+ * yet, no frame, mjpeg); the next snapshot becomes the new reference */
+gdouble camera_get_scene_change(Camera *camera);
+void camera_set_jpeg_options(Camera *camera, const JpegencOptions *options);
+/* how the snapshot files are written and synced, see writer.h */
+void camera_set_writer_options(Camera *camera, const WriterOptions *options);
+/* append snapshots to a frame archive instead of writing one file each,
+ * NULL switches back to files; returns FALSE if the archive cannot be opened */
+gboolean camera_set_archive(Camera *camera, const gchar *filename);
+
+/* creates the encoder now, its callbacks go to the thread default main context
+ * of the caller; call it from the main loop before snapshots are taken from
+ * another thread; FALSE if the encoder cannot be created */
+gboolean camera_prepare_encoder(Camera *camera);
+
+/* filename, frame, userdata
+ * called from the main loop once the snapshot has been written;
+ * take a reference to keep the frame */
+typedef void (*CAMERA_SNAPSHOT_TAKEN_CALLBACK)(const gchar *, Frame *, gpointer);
+/* userdata; name of the file for the next frame, NULL to skip it;
+ * called from the streaming thread */
+typedef gchar *(*CAMERA_BURST_FILENAME_CALLBACK)(gpointer);
+/* queued, userdata; right after each filename that was handed out, whether
+ * the frame got into the encoder queue */
+typedef void (*CAMERA_BURST_QUEUED_CALLBACK)(gboolean, gpointer);
+/* queue every frame of the stream for saving (in the snapshot format) as it
+ * arrives, frames are dropped if the encoder queue is full; cb only gets
+ * some of them, a preview of each would not keep up; NULL name_cb stops and
+ * waits for a frame that is being queued */
+void camera_set_burst(Camera *camera, CAMERA_BURST_FILENAME_CALLBACK name_cb,
+        CAMERA_BURST_QUEUED_CALLBACK queued_cb, CAMERA_SNAPSHOT_TAKEN_CALLBACK cb,
+        gpointer userdata);
+/* keep the frames of the last seconds (at most max_mib MiB of them) as JPEG,
+ * taking at most fps frames per second (0: all of them); 0 seconds turns it off */
+void camera_set_pretrigger(Camera *camera, gdouble seconds, guint max_mib, gdouble fps);
+/* removes the frames kept so far and returns them oldest first (JPEG), NULL
+ * without pre-trigger; free with g_ptr_array_unref */
+GPtrArray *camera_take_pretrigger(Camera *camera);
+/* queues frame for saving like a snapshot, takes the reference to it */
+gboolean camera_save_frame_to_file(Camera *camera, const gchar *filename, Frame *frame,
+        CAMERA_SNAPSHOT_TAKEN_CALLBACK cb, gpointer userdata);
+/* grabs the current frame and queues it for saving; returns FALSE if the
+ * frame could not be grabbed or the encoder queue is full; may be called from
+ * a capture thread while the main loop only reads the camera */
 gboolean camera_save_snapshot_to_file(Camera *camera, const gchar *filename, guint width, guint height,
         CAMERA_SNAPSHOT_TAKEN_CALLBACK cb, gpointer userdata);
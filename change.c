@@ -0,0 +1,88 @@
+#include "change.h"
+
+#if defined(__SSE2__)
+#define CHANGE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CHANGE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* each thumbnail pixel averages a grid of samples x samples from its cell,
+ * single pixels would make sensor noise look like a change */
+#define CHANGE_SAMPLES 4
+
+static void change_thumbnail(guchar *thumb, const guchar *data, guint width, guint height,
+        guint stride, guint bpp)
+{
+    guint offsets[CHANGE_THUMB_WIDTH * CHANGE_SAMPLES];
+    guint x, y, sx, sy, sum;
+    const guchar *row, *p;
+
+    for (x = 0; x < CHANGE_THUMB_WIDTH * CHANGE_SAMPLES; ++x)
+        offsets[x] = ((guint64)x * width / (CHANGE_THUMB_WIDTH * CHANGE_SAMPLES)) * bpp;
+
+    for (y = 0; y < CHANGE_THUMB_HEIGHT; ++y) {
+        for (x = 0; x < CHANGE_THUMB_WIDTH; ++x) {
+            sum = 0;
+            for (sy = 0; sy < CHANGE_SAMPLES; ++sy) {
+                row = data + (gsize)((guint64)(y * CHANGE_SAMPLES + sy) * height /
+                        (CHANGE_THUMB_HEIGHT * CHANGE_SAMPLES)) * stride;
+                for (sx = 0; sx < CHANGE_SAMPLES; ++sx) {
+                    p = row + offsets[x * CHANGE_SAMPLES + sx];
+                    sum += bpp == 4 ? (p[0] + 2 * p[1] + p[2]) >> 2 : p[0];
+                }
+            }
+            thumb[y * CHANGE_THUMB_WIDTH + x] = sum / (CHANGE_SAMPLES * CHANGE_SAMPLES);
+        }
+    }
+}
+
+void change_thumbnail_rgba(guchar *thumb, const guchar *data, guint width, guint height,
+        guint stride)
+{
+    g_return_if_fail(thumb != NULL);
+    g_return_if_fail(data != NULL);
+
+    change_thumbnail(thumb, data, width, height, stride, 4);
+}
+
+void change_thumbnail_luma(guchar *thumb, const guchar *data, guint width, guint height,
+        guint stride)
+{
+    g_return_if_fail(thumb != NULL);
+    g_return_if_fail(data != NULL);
+
+    change_thumbnail(thumb, data, width, height, stride, 1);
+}
+
+gdouble change_difference(const guchar *a, const guchar *b)
+{
+    g_return_val_if_fail(a != NULL && b != NULL, 0.0);
+
+    guint64 sum = 0;
+    gsize j = 0;
+
+#if defined(CHANGE_SSE2)
+    __m128i acc = _mm_setzero_si128();
+
+    for ( ; j + 16 <= CHANGE_THUMB_SIZE; j += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + j)),
+                    _mm_loadu_si128((const __m128i *)(b + j))));
+    sum = (guint64)_mm_cvtsi128_si32(acc) + (guint64)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(CHANGE_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    for ( ; j + 16 <= CHANGE_THUMB_SIZE; j += 16)
+        acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + j), vld1q_u8(b + j))));
+    sum = (guint64)vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+        vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+    for ( ; j < CHANGE_THUMB_SIZE; ++j)
+        sum += a[j] > b[j] ? a[j] - b[j] : b[j] - a[j];
+
+    return (gdouble)sum / CHANGE_THUMB_SIZE;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <glib.h>
+
+/* scene changes are measured on small luma images of the frames */
+#define CHANGE_THUMB_WIDTH 64
+#define CHANGE_THUMB_HEIGHT 48
+#define CHANGE_THUMB_SIZE (CHANGE_THUMB_WIDTH * CHANGE_THUMB_HEIGHT)
+
+/* thumb, data, width, height, stride
+ * from 32 bit pixels with green in the second byte (RGBA as delivered by the
+ * camera, or BGRA); red and blue are weighted alike so their order does not matter */
+void change_thumbnail_rgba(guchar *thumb, const guchar *data, guint width, guint height,
+        guint stride);
+/* from an 8 bit luma plane, e.g. the first plane of I420 */
+void change_thumbnail_luma(guchar *thumb, const guchar *data, guint width, guint height,
+        guint stride);
+
+/* mean absolute difference of two thumbnails, 0 (equal) to 255 */
+gdouble change_difference(const guchar *a, const guchar *b);
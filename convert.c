@@ -0,0 +1,245 @@
+#include "convert.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} ConvertErrorMgr;
+
+static void convert_jpeg_error_exit(j_common_ptr cinfo)
+{
+    ConvertErrorMgr *err = (ConvertErrorMgr *)cinfo->err;
+    gchar buffer[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, buffer);
+    g_printerr("JPEG decoder: %s\n", buffer);
+
+    longjmp(err->jump, 1);
+}
+
+static guint convert_get_step(guint width, guint max_width)
+{
+    if (max_width == 0 || width <= max_width)
+        return 1;
+    return (width + max_width - 1) / max_width;
+}
+
+static inline guchar convert_clamp(gint v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* BT.601, limited range */
+static inline guint32 convert_yuv_pixel(gint y, gint u, gint v)
+{
+    gint c = 298 * (y - 16) + 128;
+    gint d = u - 128;
+    gint e = v - 128;
+
+    return 0xff000000 |
+        (convert_clamp((c + 409 * e) >> 8) << 16) |
+        (convert_clamp((c - 100 * d - 208 * e) >> 8) << 8) |
+        convert_clamp((c + 516 * d) >> 8);
+}
+
+static Frame *convert_i420(Frame *frame, guint step, FramePool *pool)
+{
+    Frame *out = frame_pool_acquire(pool, frame->width / step, frame->height / step);
+    guint x, y, sx, sy;
+
+    for (y = 0; y < out->height; ++y) {
+        sy = y * step;
+        const guchar *yrow = frame->data + (gsize)sy * frame->stride;
+        const guchar *urow = frame->u + (gsize)(sy / 2) * frame->chroma_stride;
+        const guchar *vrow = frame->v + (gsize)(sy / 2) * frame->chroma_stride;
+        guint32 *dst = (guint32 *)(out->data + (gsize)y * out->stride);
+        for (x = 0; x < out->width; ++x) {
+            sx = x * step;
+            dst[x] = convert_yuv_pixel(yrow[sx], urow[sx / 2], vrow[sx / 2]);
+        }
+    }
+
+    return out;
+}
+
+static Frame *convert_argb(Frame *frame, guint step, FramePool *pool)
+{
+    Frame *out = frame_pool_acquire(pool, frame->width / step, frame->height / step);
+    guint x, y;
+
+    for (y = 0; y < out->height; ++y) {
+        const guint32 *src = (const guint32 *)(frame->data + (gsize)y * step * frame->stride);
+        guint32 *dst = (guint32 *)(out->data + (gsize)y * out->stride);
+        for (x = 0; x < out->width; ++x)
+            dst[x] = src[x * step];
+    }
+
+    return out;
+}
+
+static Frame *convert_jpeg(Frame *frame, guint max_width, FramePool *pool)
+{
+    struct jpeg_decompress_struct cinfo;
+    ConvertErrorMgr jerr;
+    /* volatile, we may come back here with longjmp */
+    Frame * volatile out = NULL;
+    guchar * volatile row = NULL;
+    JSAMPROW rows[1];
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = convert_jpeg_error_exit;
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        g_free(row);
+        frame_unref(out);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, frame->data, frame->size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    /* let the decoder do the scaling, it skips most of the work */
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    while (cinfo.scale_denom < 8 && max_width &&
+            cinfo.image_width / cinfo.scale_denom > max_width)
+        cinfo.scale_denom <<= 1;
+    cinfo.dct_method = JDCT_IFAST;
+#ifdef JCS_EXTENSIONS
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    cinfo.out_color_space = JCS_EXT_BGRX;
+#else
+    cinfo.out_color_space = JCS_EXT_XRGB;
+#endif
+#else
+    cinfo.out_color_space = JCS_RGB;
+#endif
+
+    jpeg_start_decompress(&cinfo);
+
+    out = frame_pool_acquire(pool, cinfo.output_width, cinfo.output_height);
+    if (cinfo.output_components != 4)
+        row = g_malloc(cinfo.output_width * cinfo.output_components);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        guint32 *dst = (guint32 *)(out->data + (gsize)cinfo.output_scanline * out->stride);
+        rows[0] = row ? row : (guchar *)dst;
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        if (row) {
+            guint x;
+            for (x = 0; x < cinfo.output_width; ++x)
+                dst[x] = 0xff000000 | (row[3 * x] << 16) | (row[3 * x + 1] << 8) | row[3 * x + 2];
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    g_free(row);
+
+    return out;
+}
+
+Frame *convert_frame_to_argb(Frame *frame, guint max_width, FramePool *pool)
+{
+    g_return_val_if_fail(frame != NULL, NULL);
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    guint step = convert_get_step(frame->width, max_width);
+
+    switch (frame->format) {
+        case FRAME_FORMAT_ARGB32:
+            if (step == 1)
+                return frame_ref(frame);
+            return convert_argb(frame, step, pool);
+        case FRAME_FORMAT_I420:
+            return convert_i420(frame, step, pool);
+        case FRAME_FORMAT_JPEG:
+            return convert_jpeg(frame, max_width, pool);
+        default:
+            return NULL;
+    }
+}
+
+void convert_fit_size(guint width, guint height, guint max_width, guint max_height,
+        guint *fit_width, guint *fit_height)
+{
+    g_return_if_fail(fit_width != NULL);
+    g_return_if_fail(fit_height != NULL);
+
+    *fit_width = width;
+    *fit_height = height;
+    if (width == 0 || height == 0)
+        return;
+
+    if (max_width && *fit_width > max_width) {
+        *fit_width = max_width;
+        *fit_height = ((guint64)height * max_width + width / 2) / width;
+    }
+    if (max_height && *fit_height > max_height) {
+        *fit_height = max_height;
+        *fit_width = ((guint64)width * max_height + height / 2) / height;
+    }
+    if (*fit_width == 0)
+        *fit_width = 1;
+    if (*fit_height == 0)
+        *fit_height = 1;
+}
+
+Frame *convert_scale_argb(Frame *frame, guint width, guint height, FramePool *pool)
+{
+    g_return_val_if_fail(frame != NULL, NULL);
+    g_return_val_if_fail(frame->format == FRAME_FORMAT_ARGB32, NULL);
+    g_return_val_if_fail(width > 0 && height > 0, NULL);
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    Frame *out;
+    guint *x0;
+    guint x, y, sx, sy, y0, y1, n;
+    guint32 sum[4];
+
+    if (frame->width == width && frame->height == height)
+        return frame_ref(frame);
+
+    out = frame_pool_acquire(pool, width, height);
+
+    /* first source column of each output column, x0[width] ends the last one */
+    x0 = g_malloc(sizeof(guint) * (width + 1));
+    for (x = 0; x <= width; ++x)
+        x0[x] = (guint64)x * frame->width / width;
+
+    for (y = 0; y < height; ++y) {
+        y0 = (guint64)y * frame->height / height;
+        y1 = (guint64)(y + 1) * frame->height / height;
+        if (y1 <= y0)
+            y1 = y0 + 1;
+        guint32 *dst = (guint32 *)(out->data + (gsize)y * out->stride);
+
+        for (x = 0; x < width; ++x) {
+            guint x1 = x0[x + 1] > x0[x] ? x0[x + 1] : x0[x] + 1;
+
+            memset(sum, 0, sizeof(sum));
+            for (sy = y0; sy < y1; ++sy) {
+                const guint32 *src = (const guint32 *)(frame->data + (gsize)sy * frame->stride);
+                for (sx = x0[x]; sx < x1; ++sx) {
+                    sum[0] += src[sx] >> 24;
+                    sum[1] += (src[sx] >> 16) & 0xff;
+                    sum[2] += (src[sx] >> 8) & 0xff;
+                    sum[3] += src[sx] & 0xff;
+                }
+            }
+
+            n = (y1 - y0) * (x1 - x0[x]);
+            dst[x] = ((sum[0] + n / 2) / n) << 24 | ((sum[1] + n / 2) / n) << 16 |
+                ((sum[2] + n / 2) / n) << 8 | ((sum[3] + n / 2) / n);
+        }
+    }
+
+    g_free(x0);
+
+    return out;
+}
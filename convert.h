@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+#include "frame.h"
+
+/* turn any frame into an ARGB32 frame from pool that is at most max_width
+ * pixels wide (0: full size); ARGB32 frames of a fitting size are just
+ * referenced, the others are subsampled while converting */
+Frame *convert_frame_to_argb(Frame *frame, guint max_width, FramePool *pool);
+
+/* largest size with the aspect ratio of width x height that fits into
+ * max_width x max_height, never larger than the original */
+void convert_fit_size(guint width, guint height, guint max_width, guint max_height,
+        guint *fit_width, guint *fit_height);
+/* ARGB32 frame scaled to width x height from pool, each output pixel is the
+ * average of the pixels it covers */
+Frame *convert_scale_argb(Frame *frame, guint width, guint height, FramePool *pool);
@@ -0,0 +1,518 @@
+#include "encoder.h"
+#include "swizzle.h"
+#include "convert.h"
+#include "archive.h"
+#include "writer.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <Imlib2.h>
+
+/* default size the previews are scaled to fit in */
+#define ENCODER_PREVIEW_WIDTH 640
+#define ENCODER_PREVIEW_HEIGHT 480
+
+struct _Encoder {
+    GThreadPool *pool;
+    FramePool *preview_pool;
+    FramePool *scale_pool;
+    GMainContext *context;
+    gint refcount;
+
+    GMutex lock;
+    GQueue done;         /* finished jobs waiting for done_source */
+    GSource *done_source;
+    EncoderStats stats;
+    JpegencOptions jpeg_options;
+    Archive *archive;
+    Writer *writer;
+    Stats *timings;
+    guint preview_width;
+    guint preview_height;
+};
+
+typedef struct {
+    Encoder *encoder;
+    gchar *filename;
+    Frame *frame;
+    Frame *preview;
+    const guchar *data;
+    GDestroyNotify free_func;
+    gpointer free_data;
+    gboolean success;
+    gint parts; /* the worker and the file, both have to be done */
+    JpegencOptions jpeg_options;
+    Stats *timings;
+    gint64 queued_time;
+    guint preview_width;
+    guint preview_height;
+
+    /* archive output */
+    Archive *archive;
+    guint64 number;
+    gint64 timestamp;
+
+    ENCODER_DONE_CALLBACK callback;
+    gpointer userdata;
+} EncoderJob;
+
+/* Imlib2 keeps its state in a global context */
+G_LOCK_DEFINE_STATIC(imlib);
+
+static Encoder *encoder_ref(Encoder *encoder)
+{
+    g_atomic_int_inc(&encoder->refcount);
+    return encoder;
+}
+
+static void encoder_unref(Encoder *encoder)
+{
+    if (!g_atomic_int_dec_and_test(&encoder->refcount))
+        return;
+
+    g_mutex_clear(&encoder->lock);
+    writer_destroy(encoder->writer);
+    frame_pool_destroy(encoder->preview_pool);
+    frame_pool_destroy(encoder->scale_pool);
+    g_main_context_unref(encoder->context);
+    g_free(encoder);
+}
+
+static void encoder_job_free(EncoderJob *job)
+{
+    Encoder *encoder = job->encoder;
+
+    g_mutex_lock(&encoder->lock);
+    --encoder->stats.pending;
+    if (job->success)
+        ++encoder->stats.written;
+    else
+        ++encoder->stats.failed;
+    g_mutex_unlock(&encoder->lock);
+
+    if (job->free_func)
+        job->free_func(job->free_data);
+    frame_unref(job->frame);
+    frame_unref(job->preview);
+    g_free(job->filename);
+    g_free(job);
+
+    encoder_unref(encoder);
+}
+
+static gboolean encoder_job_done(EncoderJob *job)
+{
+    if (job->success && job->callback && job->preview)
+        job->callback(job->filename, job->preview, job->userdata);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* time since start, recorded for stage; returns the current time */
+static gint64 encoder_record(Stats *timings, StatsStage stage, gint64 start)
+{
+    gint64 now = g_get_monotonic_time();
+
+    stats_record(timings, stage, now - start);
+    /* queue and total began on the thread that pushed the job */
+    if (trace_enabled() && stage != STATS_STAGE_QUEUE && stage != STATS_STAGE_TOTAL)
+        trace_span("encoder", stats_stage_to_string(stage), start, now);
+
+    return now;
+}
+
+/* in the context of the encoder, for every job finished since the last time */
+static gboolean encoder_dispatch_done(Encoder *encoder)
+{
+    GQueue done;
+    EncoderJob *job;
+
+    g_mutex_lock(&encoder->lock);
+    done = encoder->done;
+    g_queue_init(&encoder->done);
+    if (encoder->done_source) {
+        g_source_unref(encoder->done_source);
+        encoder->done_source = NULL;
+    }
+    g_mutex_unlock(&encoder->lock);
+
+    /* the last job may take the encoder with it */
+    while ((job = g_queue_pop_head(&done)) != NULL) {
+        encoder_job_done(job);
+        encoder_job_free(job);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* kept in the encoder rather than in a source of their own, so that
+ * encoder_destroy can free what the context will no longer dispatch */
+static void encoder_job_release(EncoderJob *job)
+{
+    Encoder *encoder = job->encoder;
+
+    if (!g_atomic_int_dec_and_test(&job->parts))
+        return;
+
+    g_mutex_lock(&encoder->lock);
+    g_queue_push_tail(&encoder->done, job);
+    if (encoder->done_source == NULL) {
+        encoder->done_source = g_idle_source_new();
+        g_source_set_priority(encoder->done_source, G_PRIORITY_DEFAULT);
+        g_source_set_callback(encoder->done_source, (GSourceFunc)encoder_dispatch_done,
+                encoder, NULL);
+        g_source_attach(encoder->done_source, encoder->context);
+    }
+    g_mutex_unlock(&encoder->lock);
+}
+
+/* the file is on disk under its name, or not; from any thread, with io_uring
+ * or a batched sync policy long after the worker is done with the job */
+static void encoder_job_written(const gchar *filename, gboolean success, EncoderJob *job)
+{
+    job->success = success;
+    if (success)
+        encoder_record(job->timings, STATS_STAGE_TOTAL, job->queued_time);
+    encoder_job_release(job);
+}
+
+/* Imlib2 also goes through the writer, the format is taken from the real name */
+static void encoder_save_imlib(EncoderJob *job, Frame *frame)
+{
+    Imlib_Image image;
+    Imlib_Load_Error err = 0;
+    const gchar *ext = strrchr(job->filename, '.');
+    gchar *tmpname = writer_get_temp_filename(job->filename);
+
+    G_LOCK(imlib);
+
+    image = imlib_create_image_using_data(frame->width, frame->height, (DATA32 *)frame->data);
+    imlib_context_set_image(image);
+    if (ext)
+        imlib_image_set_format(ext + 1);
+    imlib_save_image_with_error_return(tmpname, &err);
+    if (err)
+        g_printerr("Error saving image %s: %d\n", job->filename, err);
+    imlib_free_image();
+
+    G_UNLOCK(imlib);
+
+    if (err) {
+        unlink(tmpname);
+        g_free(tmpname);
+        encoder_job_written(job->filename, FALSE, job);
+        return;
+    }
+
+    writer_commit_file(job->encoder->writer, tmpname, job->filename, job->timings,
+            (WRITER_DONE_CALLBACK)encoder_job_written, job);
+    g_free(tmpname);
+}
+
+/* takes ownership of data like writer_write_file */
+static void encoder_write(EncoderJob *job, const guchar *data, gsize size,
+        GDestroyNotify free_func, gpointer free_data)
+{
+    gint64 start;
+    gboolean result;
+
+    /* the writer records the time itself, it may finish after we return */
+    if (job->archive == NULL) {
+        writer_write_file(job->encoder->writer, job->filename, data, size,
+                free_func, free_data, job->timings,
+                (WRITER_DONE_CALLBACK)encoder_job_written, job);
+        return;
+    }
+
+    start = g_get_monotonic_time();
+    result = archive_append(job->archive, job->number, job->timestamp, data, size);
+    encoder_record(job->timings, STATS_STAGE_WRITE, start);
+    if (free_func)
+        free_func(free_data);
+
+    encoder_job_written(job->filename, result, job);
+}
+
+static void encoder_save_jpeg(EncoderJob *job)
+{
+    guchar *data = NULL;
+    gsize size = 0;
+    gint64 start = g_get_monotonic_time();
+
+    if (!jpegenc_encode_frame(job->frame, &job->jpeg_options, &data, &size)) {
+        encoder_job_written(job->filename, FALSE, job);
+        return;
+    }
+    encoder_record(job->timings, STATS_STAGE_ENCODE, start);
+
+    encoder_write(job, data, size, free, data);
+}
+
+/* archives always hold JPEG, whatever the filename says; ends with
+ * encoder_job_written, now or once the file is done */
+static void encoder_save(EncoderJob *job)
+{
+    Frame *frame = job->frame;
+    FramePool *pool;
+    Frame *argb;
+    gint64 start;
+
+    /* libjpeg needs no global lock, everything else goes through Imlib2 */
+    if (job->archive || jpegenc_handles_filename(job->filename)) {
+        if (frame->format == FRAME_FORMAT_JPEG)
+            encoder_write(job, frame->data, frame->size,
+                    (GDestroyNotify)frame_unref, frame_ref(frame));
+        else
+            encoder_save_jpeg(job);
+        return;
+    }
+
+    start = g_get_monotonic_time();
+    if (frame->format == FRAME_FORMAT_ARGB32) {
+        encoder_save_imlib(job, frame);
+        encoder_record(job->timings, STATS_STAGE_ENCODE, start);
+        return;
+    }
+
+    /* other formats need a full size rgb copy, this is the slow path */
+    pool = frame_pool_new(0);
+    argb = convert_frame_to_argb(frame, 0, pool);
+    frame_pool_destroy(pool);
+    if (argb == NULL) {
+        encoder_job_written(job->filename, FALSE, job);
+        return;
+    }
+    start = encoder_record(job->timings, STATS_STAGE_CONVERT, start);
+    encoder_save_imlib(job, argb);
+    encoder_record(job->timings, STATS_STAGE_ENCODE, start);
+    frame_unref(argb);
+}
+
+/* small enough that drawing it is a plain copy, the ui keeps no full size frames */
+static Frame *encoder_make_preview(EncoderJob *job, Encoder *encoder)
+{
+    Frame *argb, *preview;
+    guint width, height;
+
+    /* averaging the whole frame looks best, the others are subsampled (or decoded
+     * at a lower scale) to twice the size first, which costs far less */
+    if (job->frame->format == FRAME_FORMAT_ARGB32) {
+        argb = frame_ref(job->frame);
+    }
+    else {
+        convert_fit_size(job->frame->width, job->frame->height,
+                job->preview_width, job->preview_height, &width, &height);
+        argb = convert_frame_to_argb(job->frame, 2 * width, encoder->scale_pool);
+        if (argb == NULL)
+            return NULL;
+    }
+
+    convert_fit_size(argb->width, argb->height, job->preview_width, job->preview_height,
+            &width, &height);
+    preview = convert_scale_argb(argb, width, height, encoder->preview_pool);
+    frame_unref(argb);
+
+    return preview;
+}
+
+static void encoder_worker(EncoderJob *job, Encoder *encoder)
+{
+    gint64 start = encoder_record(job->timings, STATS_STAGE_QUEUE, job->queued_time);
+
+    /* we get the color in rgba, convert while copying out of the shared buffer */
+    if (job->data) {
+        swizzle_rb((guint32 *)job->frame->data, (const guint32 *)job->data,
+                (gsize)job->frame->width * job->frame->height);
+        encoder_record(job->timings, STATS_STAGE_SWIZZLE, start);
+    }
+
+    g_atomic_int_set(&job->parts, 2);
+    encoder_save(job);
+
+    /* only the preview needs rgb, and only if somebody looks at it; made while
+     * the file may still be on its way to the disk */
+    if (job->callback) {
+        start = g_get_monotonic_time();
+        job->preview = encoder_make_preview(job, encoder);
+        encoder_record(job->timings, STATS_STAGE_PREVIEW, start);
+    }
+
+    encoder_job_release(job);
+}
+
+Encoder *encoder_new(guint n_threads, guint queue_size)
+{
+    Encoder *encoder = g_malloc0(sizeof(Encoder));
+    GError *err = NULL;
+
+    if (n_threads == 0)
+        n_threads = 1;
+    if (queue_size == 0)
+        queue_size = 1;
+
+    encoder->refcount = 1;
+    encoder->context = g_main_context_ref_thread_default();
+    encoder->stats.queue_size = queue_size;
+    jpegenc_options_init(&encoder->jpeg_options);
+    encoder->preview_pool = frame_pool_new(2);
+    encoder->scale_pool = frame_pool_new(1);
+    encoder->preview_width = ENCODER_PREVIEW_WIDTH;
+    encoder->preview_height = ENCODER_PREVIEW_HEIGHT;
+    g_mutex_init(&encoder->lock);
+    g_queue_init(&encoder->done);
+    encoder->writer = writer_new(NULL);
+
+    encoder->pool = g_thread_pool_new((GFunc)encoder_worker, encoder, n_threads, FALSE, &err);
+    if (err) {
+        g_printerr("Could not create encoder threads: %s\n", err->message);
+        g_clear_error(&err);
+        encoder_unref(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+void encoder_destroy(Encoder *encoder)
+{
+    if (encoder == NULL)
+        return;
+
+    GQueue done;
+    EncoderJob *job;
+
+    /* finish everything that is already queued, then whatever waits for a sync */
+    g_thread_pool_free(encoder->pool, FALSE, TRUE);
+    encoder->pool = NULL;
+    writer_destroy(encoder->writer);
+    encoder->writer = NULL;
+
+    /* every job is done now; the loop may have quit already, so the
+     * callbacks still waiting for it are dropped */
+    g_mutex_lock(&encoder->lock);
+    done = encoder->done;
+    g_queue_init(&encoder->done);
+    if (encoder->done_source) {
+        g_source_destroy(encoder->done_source);
+        g_source_unref(encoder->done_source);
+        encoder->done_source = NULL;
+    }
+    g_mutex_unlock(&encoder->lock);
+
+    while ((job = g_queue_pop_head(&done)) != NULL)
+        encoder_job_free(job);
+
+    encoder_unref(encoder);
+}
+
+gboolean encoder_push(Encoder *encoder, const gchar *filename, Frame *frame,
+        const guchar *data, GDestroyNotify free_func, gpointer free_data,
+        ENCODER_DONE_CALLBACK cb, gpointer userdata)
+{
+    g_return_val_if_fail(encoder != NULL, FALSE);
+    g_return_val_if_fail(filename != NULL, FALSE);
+    g_return_val_if_fail(frame != NULL, FALSE);
+
+    g_mutex_lock(&encoder->lock);
+    if (encoder->stats.pending >= encoder->stats.queue_size) {
+        ++encoder->stats.dropped;
+        g_mutex_unlock(&encoder->lock);
+
+        if (free_func)
+            free_func(free_data);
+        frame_unref(frame);
+        return FALSE;
+    }
+    ++encoder->stats.queued;
+    if (++encoder->stats.pending > encoder->stats.max_pending)
+        encoder->stats.max_pending = encoder->stats.pending;
+
+    EncoderJob *job = g_malloc0(sizeof(EncoderJob));
+    job->jpeg_options = encoder->jpeg_options;
+    job->archive = encoder->archive;
+    job->timings = encoder->timings;
+    job->preview_width = encoder->preview_width;
+    job->preview_height = encoder->preview_height;
+    g_mutex_unlock(&encoder->lock);
+
+    job->queued_time = g_get_monotonic_time();
+
+    if (job->archive) {
+        job->number = archive_reserve_number(job->archive);
+        job->timestamp = g_get_real_time();
+    }
+
+    job->encoder = encoder_ref(encoder);
+    job->filename = g_strdup(filename);
+    job->frame = frame;
+    job->data = data;
+    job->free_func = free_func;
+    job->free_data = free_data;
+    job->callback = cb;
+    job->userdata = userdata;
+
+    g_thread_pool_push(encoder->pool, job, NULL);
+
+    return TRUE;
+}
+
+void encoder_set_jpeg_options(Encoder *encoder, const JpegencOptions *options)
+{
+    g_return_if_fail(encoder != NULL);
+    g_return_if_fail(options != NULL);
+
+    g_mutex_lock(&encoder->lock);
+    encoder->jpeg_options = *options;
+    g_mutex_unlock(&encoder->lock);
+}
+
+void encoder_set_archive(Encoder *encoder, Archive *archive)
+{
+    g_return_if_fail(encoder != NULL);
+
+    g_mutex_lock(&encoder->lock);
+    encoder->archive = archive;
+    g_mutex_unlock(&encoder->lock);
+}
+
+void encoder_set_writer_options(Encoder *encoder, const WriterOptions *options)
+{
+    g_return_if_fail(encoder != NULL);
+    g_return_if_fail(options != NULL);
+
+    writer_set_options(encoder->writer, options);
+}
+
+void encoder_set_timings(Encoder *encoder, Stats *timings)
+{
+    g_return_if_fail(encoder != NULL);
+
+    g_mutex_lock(&encoder->lock);
+    encoder->timings = timings;
+    g_mutex_unlock(&encoder->lock);
+}
+
+void encoder_set_preview_size(Encoder *encoder, guint width, guint height)
+{
+    g_return_if_fail(encoder != NULL);
+
+    g_mutex_lock(&encoder->lock);
+    encoder->preview_width = width ? width : ENCODER_PREVIEW_WIDTH;
+    encoder->preview_height = height ? height : ENCODER_PREVIEW_HEIGHT;
+    g_mutex_unlock(&encoder->lock);
+}
+
+void encoder_get_stats(Encoder *encoder, EncoderStats *stats)
+{
+    g_return_if_fail(encoder != NULL);
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(&encoder->lock);
+    *stats = encoder->stats;
+    g_mutex_unlock(&encoder->lock);
+
+    if (encoder->writer)
+        writer_get_stats(encoder->writer, &stats->writer);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glib.h>
+#include "frame.h"
+#include "jpegenc.h"
+#include "archive.h"
+#include "stats.h"
+#include "writer.h"
+
+typedef struct _Encoder Encoder;
+
+typedef struct {
+    guint64 queued;
+    guint64 written;
+    guint64 failed;
+    guint64 dropped;   /* rejected because the queue was full */
+    guint pending;     /* queued or in progress */
+    guint max_pending; /* high-water mark of pending */
+    guint queue_size;
+    WriterStats writer; /* files, not the archive */
+} EncoderStats;
+
+/* filename, preview (ARGB32), userdata
+ * called in the context the encoder was created in, once the file has its name
+ * (after its batch was synced with the batched sync policies);
+ * the preview is scaled down to the preview size, take a reference to keep it;
+ * without a callback no preview is made */
+typedef void (*ENCODER_DONE_CALLBACK)(const gchar *, Frame *, gpointer);
+
+Encoder *encoder_new(guint n_threads, guint queue_size);
+/* waits until everything queued is written; callbacks that have not been
+ * called by then are not called at all */
+void encoder_destroy(Encoder *encoder);
+
+/* takes ownership of data, which is released with free_func(free_data) when done,
+ * and of the reference to frame; if data is given it is in the byte order delivered
+ * by the camera and is only read, the worker converts it into frame which must be
+ * ARGB32 of the same size; without data, frame is saved as it is */
+gboolean encoder_push(Encoder *encoder, const gchar *filename, Frame *frame,
+        const guchar *data, GDestroyNotify free_func, gpointer free_data,
+        ENCODER_DONE_CALLBACK cb, gpointer userdata);
+
+/* used for files ending in .jpg/.jpeg, everything else is saved with Imlib2 */
+void encoder_set_jpeg_options(Encoder *encoder, const JpegencOptions *options);
+
+/* append frames to archive (as JPEG) instead of writing files, NULL to go back
+ * to files; the archive must stay open until everything queued is written */
+void encoder_set_archive(Encoder *encoder, Archive *archive);
+
+/* sync policy and hints for the files, see writer.h; the archive is not affected */
+void encoder_set_writer_options(Encoder *encoder, const WriterOptions *options);
+
+/* record the time spent in each stage, NULL to stop; timings must outlive
+ * everything queued while it is set */
+void encoder_set_timings(Encoder *encoder, Stats *timings);
+
+/* previews fit into width x height (0: default), used for frames pushed afterwards */
+void encoder_set_preview_size(Encoder *encoder, guint width, guint height);
+
+void encoder_get_stats(Encoder *encoder, EncoderStats *stats);
@@ -0,0 +1,77 @@
+#include "filename.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+gboolean filename_matches_pattern(gchar *name1, gchar *name2)
+{
+    if (!name1 || !name2)
+        return FALSE;
+    gssize j = strlen(name1);
+    if (strlen(name2) != j) {
+        return FALSE;
+    }
+    for ( ; j >= 0; --j) {
+        if (!g_ascii_isdigit(name1[j])) {
+            if (name1[j] != name2[j]) {
+                return FALSE;
+            }
+        }
+        else {
+            break;
+        }
+    }
+    for ( ; j >= 0; --j) {
+        if (g_ascii_isdigit(name1[j]) && g_ascii_isdigit(name2[j])) {
+            continue;
+        }
+        break;
+    }
+    for ( ; j >= 0; --j) {
+        if (name1[j] != name2[j]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+gchar *filename_generate(const gchar *base, guint64 offset)
+{
+    if (base == NULL || base[0] == '\0')
+        return NULL;
+    /* only use the basename and not the directory part */
+    gchar *dirsep = strrchr(base, '/');
+    if (dirsep)
+        ++dirsep;
+    else
+        dirsep = (gchar *)base;
+
+    /* get suffix */
+    /* we only want numbers in the real filename, not the extension */
+    gchar *suff = strrchr(base, '.');
+    if (!suff)
+        suff = (gchar *)base + strlen(base);
+
+    /* get last number */
+    for ( ; suff >= dirsep; --suff)
+        if (g_ascii_isdigit(*suff))
+            break;
+    if (suff < dirsep)
+        return g_strdup(base);
+
+    gchar *num = suff++;
+    for ( ; num >= dirsep; --num)
+        if (!g_ascii_isdigit(*num))
+            break;
+    ++num;
+    
+    gchar format[32];
+    sprintf(format, "%%0%u" G_GUINT64_FORMAT, suff-num);
+    unsigned long long int n = strtoull(num, NULL, 10);
+    GString *str = g_string_new_len(base, num-base);
+    g_string_append_printf(str, format, n + offset);
+    g_string_append(str, suff);
+
+    return g_string_free(str, FALSE);
+}
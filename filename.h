@@ -0,0 +1,9 @@
+#pragma once
+
+#include <glib.h>
+
+/* TRUE if both names only differ in the last number before the extension */
+gboolean filename_matches_pattern(gchar *name1, gchar *name2);
+/* replace the last number in the basename of base (e.g. frame0000.jpeg) by
+ * its value plus offset, keeping the width */
+gchar *filename_generate(const gchar *base, guint64 offset);
@@ -0,0 +1,151 @@
+#include "frame.h"
+
+struct _FramePool {
+    gint refcount;
+    guint max_free;
+
+    GMutex lock;
+    /* unused pixel buffers, all of the size last acquired */
+    GQueue free_buffers;
+    gsize size;
+};
+
+static FramePool *frame_pool_ref(FramePool *pool)
+{
+    g_atomic_int_inc(&pool->refcount);
+    return pool;
+}
+
+static void frame_pool_flush(FramePool *pool)
+{
+    gpointer data;
+
+    while ((data = g_queue_pop_head(&pool->free_buffers)) != NULL)
+        g_free(data);
+}
+
+static void frame_pool_unref(FramePool *pool)
+{
+    if (!g_atomic_int_dec_and_test(&pool->refcount))
+        return;
+
+    frame_pool_flush(pool);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+FramePool *frame_pool_new(guint max_free)
+{
+    FramePool *pool = g_malloc0(sizeof(FramePool));
+
+    pool->refcount = 1;
+    pool->max_free = max_free;
+    g_mutex_init(&pool->lock);
+    g_queue_init(&pool->free_buffers);
+
+    return pool;
+}
+
+void frame_pool_destroy(FramePool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    frame_pool_unref(pool);
+}
+
+Frame *frame_pool_acquire(FramePool *pool, guint width, guint height)
+{
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    Frame *frame = g_slice_new0(Frame);
+    frame->width = width;
+    frame->height = height;
+    frame->stride = width * 4;
+    frame->size = (gsize)frame->stride * height;
+    frame->refcount = 1;
+    frame->pool = frame_pool_ref(pool);
+
+    g_mutex_lock(&pool->lock);
+    if (pool->size != frame->size) {
+        /* size changed, the old buffers are useless now */
+        frame_pool_flush(pool);
+        pool->size = frame->size;
+    }
+    frame->data = g_queue_pop_head(&pool->free_buffers);
+    g_mutex_unlock(&pool->lock);
+
+    if (frame->data == NULL)
+        frame->data = g_malloc(frame->size);
+
+    return frame;
+}
+
+Frame *frame_new_for_data(FrameFormat format, guint width, guint height,
+        guchar *data, gsize size, GDestroyNotify free_func, gpointer free_data)
+{
+    g_return_val_if_fail(data != NULL, NULL);
+
+    Frame *frame = g_slice_new0(Frame);
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    frame->data = data;
+    frame->size = size;
+    frame->refcount = 1;
+    frame->free_func = free_func;
+    frame->free_data = free_data;
+
+    switch (format) {
+        case FRAME_FORMAT_ARGB32:
+            frame->stride = width * 4;
+            break;
+        case FRAME_FORMAT_I420:
+            /* see gst_video_format_get_row_stride() */
+            frame->stride = (width + 3) & ~3;
+            frame->chroma_stride = (((width + 1) / 2) + 3) & ~3;
+            frame->u = data + (gsize)frame->stride * ((height + 1) & ~1);
+            frame->v = frame->u + (gsize)frame->chroma_stride * ((height + 1) / 2);
+            break;
+        case FRAME_FORMAT_JPEG:
+        default:
+            break;
+    }
+
+    return frame;
+}
+
+Frame *frame_ref(Frame *frame)
+{
+    g_return_val_if_fail(frame != NULL, NULL);
+
+    g_atomic_int_inc(&frame->refcount);
+    return frame;
+}
+
+void frame_unref(Frame *frame)
+{
+    if (frame == NULL || !g_atomic_int_dec_and_test(&frame->refcount))
+        return;
+
+    FramePool *pool = frame->pool;
+
+    if (pool == NULL) {
+        if (frame->free_func)
+            frame->free_func(frame->free_data);
+        g_slice_free(Frame, frame);
+        return;
+    }
+
+    g_mutex_lock(&pool->lock);
+    if (pool->size == frame->size && g_queue_get_length(&pool->free_buffers) < pool->max_free) {
+        g_queue_push_head(&pool->free_buffers, frame->data);
+        frame->data = NULL;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    g_free(frame->data);
+    g_slice_free(Frame, frame);
+
+    frame_pool_unref(pool);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+
+typedef struct _FramePool FramePool;
+
+typedef enum {
+    FRAME_FORMAT_ARGB32 = 0, /* native endian, as used by cairo and Imlib2 */
+    FRAME_FORMAT_I420,       /* planar YUV 4:2:0 */
+    FRAME_FORMAT_JPEG        /* compressed, size bytes at data */
+} FrameFormat;
+
+/* a refcounted image, shared between encoder and preview; the pixel buffer
+ * goes back to its pool (or is released) when the last reference is dropped */
+typedef struct {
+    FrameFormat format;
+    guint width;
+    guint height;
+    guint stride;
+    guchar *data;
+    gsize size;
+
+    /* I420 only */
+    guint chroma_stride;
+    guchar *u;
+    guchar *v;
+
+    /* private */
+    gint refcount;
+    FramePool *pool;
+    GDestroyNotify free_func;
+    gpointer free_data;
+} Frame;
+
+/* keeps up to max_free unused buffers for reuse */
+FramePool *frame_pool_new(guint max_free);
+/* the pool stays alive until all of its frames are released */
+void frame_pool_destroy(FramePool *pool);
+/* an ARGB32 frame */
+Frame *frame_pool_acquire(FramePool *pool, guint width, guint height);
+
+/* wrap memory owned by someone else, free_func(free_data) is called on release;
+ * for I420 the planes are laid out as in GStreamer buffers */
+Frame *frame_new_for_data(FrameFormat format, guint width, guint height,
+        guchar *data, gsize size, GDestroyNotify free_func, gpointer free_data);
+
+Frame *frame_ref(Frame *frame);
+void frame_unref(Frame *frame);
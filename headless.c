@@ -0,0 +1,239 @@
+#include "headless.h"
+#include "timelapse.h"
+#include "trace.h"
+
+#include <string.h>
+#include <signal.h>
+#include <glib-unix.h>
+
+typedef struct {
+    gchar *name; /* NULL: the camera of [Status] */
+    TimelapseConfig config;
+    Timelapse *timelapse;
+} HeadlessCamera;
+
+static GMainLoop *loop;
+static GPtrArray *cameras;
+static guint cameras_running;
+
+static void headless_frame_saved(Timelapse *timelapse, const gchar *filename, Frame *frame,
+        HeadlessCamera *cam)
+{
+    if (cam->name)
+        g_print("%s: %s\n", cam->name, filename);
+    else
+        g_print("%s\n", filename);
+}
+
+/* the others keep going until they are done as well */
+static void headless_finished(Timelapse *timelapse, HeadlessCamera *cam)
+{
+    if (--cameras_running == 0)
+        g_main_loop_quit(loop);
+}
+
+static gboolean headless_signal(gpointer userdata)
+{
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* SIGUSR1 writes the pre-trigger frames of all cameras */
+static gboolean headless_trigger(gpointer userdata)
+{
+    HeadlessCamera *cam;
+    guint j;
+
+    for (j = 0; j < cameras->len; ++j) {
+        cam = g_ptr_array_index(cameras, j);
+        if (!timelapse_trigger(cam->timelapse))
+            g_printerr("%s%sNo pre-trigger frames to write\n",
+                    cam->name ? cam->name : "", cam->name ? ": " : "");
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean headless_report(gpointer userdata)
+{
+    HeadlessCamera *cam;
+    gchar *status;
+    guint j;
+
+    for (j = 0; j < cameras->len; ++j) {
+        cam = g_ptr_array_index(cameras, j);
+        if (!timelapse_is_running(cam->timelapse))
+            continue;
+        status = timelapse_format_status(cam->timelapse);
+        g_print("%s: %s\n", cam->name, status);
+        g_free(status);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static HeadlessCamera *headless_camera_new(const gchar *name, GKeyFile *kf)
+{
+    HeadlessCamera *cam = g_malloc0(sizeof(HeadlessCamera));
+    gchar *group;
+
+    cam->name = g_strdup(name);
+    timelapse_config_init(&cam->config);
+    timelapse_config_load(&cam->config, kf, "Status");
+    if (name) {
+        group = g_strconcat(TIMELAPSE_CAMERA_GROUP, name, NULL);
+        timelapse_config_load(&cam->config, kf, group);
+        g_free(group);
+    }
+
+    return cam;
+}
+
+static void headless_camera_free(HeadlessCamera *cam)
+{
+    EncoderStats stats;
+    gchar *jitter;
+
+    if (cam == NULL)
+        return;
+
+    if (cam->timelapse) {
+        camera_get_encoder_stats(timelapse_get_camera(cam->timelapse), &stats);
+        if (cam->name)
+            g_print("%s: ", cam->name);
+        g_print("%" G_GUINT64_FORMAT " written, %u pending, %" G_GUINT64_FORMAT " dropped, "
+                    "%" G_GUINT64_FORMAT " failed\n",
+                stats.written, stats.pending, stats.dropped, stats.failed);
+        if ((jitter = timelapse_format_jitter(cam->timelapse)) != NULL) {
+            if (cam->name)
+                g_print("%s: ", cam->name);
+            g_print("Capture jitter:\n%s", jitter);
+            g_free(jitter);
+        }
+
+        /* waits for the encoder to finish */
+        timelapse_destroy(cam->timelapse);
+    }
+    timelapse_config_clear(&cam->config);
+    g_free(cam->name);
+    g_free(cam);
+}
+
+/* one camera with the keys of [Status], or one per [Camera <name>] group */
+static gboolean headless_read_config(const gchar *path)
+{
+    GKeyFile *kf = g_key_file_new();
+    GError *err = NULL;
+    gchar **names;
+    guint j;
+
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, &err)) {
+        g_printerr("Could not read %s: %s\n", path, err->message);
+        g_clear_error(&err);
+        g_key_file_free(kf);
+        return FALSE;
+    }
+
+    names = timelapse_config_get_camera_groups(kf);
+    if (names[0] == NULL)
+        g_ptr_array_add(cameras, headless_camera_new(NULL, kf));
+    for (j = 0; names[j]; ++j)
+        g_ptr_array_add(cameras, headless_camera_new(names[j], kf));
+
+    g_strfreev(names);
+    g_key_file_free(kf);
+
+    return TRUE;
+}
+
+int headless_main(int argc, char **argv)
+{
+    TimelapseCallbacks callbacks = {
+        NULL,
+        (TIMELAPSE_FRAME_SAVED_CALLBACK)headless_frame_saved,
+        (TIMELAPSE_FINISHED_CALLBACK)headless_finished
+    };
+    HeadlessCamera *cam;
+    Camera *camera;
+    guint report_interval = 0;
+    guint report_id = 0;
+    gchar *path;
+    int result = 0;
+    guint j;
+
+    if (argc > 1 && strcmp(argv[1], "--headless") == 0) {
+        --argc;
+        ++argv;
+    }
+    if (argc > 2) {
+        g_printerr("usage: %s [--headless] [config file]\n", argv[0]);
+        return 2;
+    }
+
+    cameras = g_ptr_array_new_with_free_func((GDestroyNotify)headless_camera_free);
+
+    path = argc > 1 ? g_strdup(argv[1]) : timelapse_config_get_default_path();
+    if (!headless_read_config(path)) {
+        g_free(path);
+        g_ptr_array_unref(cameras);
+        return 1;
+    }
+    g_free(path);
+
+    trace_init();
+
+    loop = g_main_loop_new(NULL, FALSE);
+
+    /* every camera has its own pipeline and encoder threads,
+     * the main loop only schedules the snapshots */
+    for (j = 0; j < cameras->len; ++j) {
+        cam = g_ptr_array_index(cameras, j);
+
+        camera = camera_new();
+        camera_set_preview(camera, FALSE);
+
+        cam->timelapse = timelapse_new(camera);
+        timelapse_set_callbacks(cam->timelapse, &callbacks, cam);
+        timelapse_apply_config(cam->timelapse, &cam->config);
+
+        camera_start(camera);
+        if (timelapse_start(cam->timelapse, &cam->config)) {
+            ++cameras_running;
+            if (cam->config.stats_interval &&
+                    (report_interval == 0 || cam->config.stats_interval < report_interval))
+                report_interval = cam->config.stats_interval;
+        }
+        else {
+            g_printerr("Could not start capturing%s%s\n",
+                    cam->name ? " with " : "", cam->name ? cam->name : "");
+            result = 1;
+        }
+    }
+
+    if (cameras_running) {
+        /* with several cameras a stall of one should be visible */
+        if (cameras->len > 1 && report_interval)
+            report_id = g_timeout_add_seconds(report_interval, headless_report, NULL);
+        g_unix_signal_add(SIGINT, headless_signal, NULL);
+        g_unix_signal_add(SIGTERM, headless_signal, NULL);
+        g_unix_signal_add(SIGUSR1, headless_trigger, NULL);
+        g_main_loop_run(loop);
+    }
+
+    if (report_id)
+        g_source_remove(report_id);
+
+    for (j = 0; j < cameras->len; ++j) {
+        cam = g_ptr_array_index(cameras, j);
+        timelapse_stop(cam->timelapse);
+        camera_stop(timelapse_get_camera(cam->timelapse));
+    }
+
+    g_ptr_array_unref(cameras);
+    cameras = NULL;
+    g_main_loop_unref(loop);
+    loop = NULL;
+    trace_close();
+
+    return result;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+/* run the capture engine without gtk and without preview;
+ * usage: [--headless] [config file], the default is timelapse-status.conf */
+int headless_main(int argc, char **argv);
@@ -0,0 +1,225 @@
+#include "jpegenc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} JpegencErrorMgr;
+
+static void jpegenc_error_exit(j_common_ptr cinfo)
+{
+    JpegencErrorMgr *err = (JpegencErrorMgr *)cinfo->err;
+    gchar buffer[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, buffer);
+    g_printerr("JPEG encoder: %s\n", buffer);
+
+    longjmp(err->jump, 1);
+}
+
+void jpegenc_options_init(JpegencOptions *options)
+{
+    g_return_if_fail(options != NULL);
+
+    options->quality = 75;
+    options->subsampling = JPEGENC_SUBSAMPLING_420;
+    options->fast_dct = FALSE;
+}
+
+gboolean jpegenc_handles_filename(const gchar *filename)
+{
+    const gchar *suff;
+
+    if (filename == NULL || (suff = strrchr(filename, '.')) == NULL)
+        return FALSE;
+
+    return g_ascii_strcasecmp(suff, ".jpg") == 0 ||
+        g_ascii_strcasecmp(suff, ".jpeg") == 0;
+}
+
+static void jpegenc_set_subsampling(struct jpeg_compress_struct *cinfo, JpegencSubsampling subsampling)
+{
+    /* chroma components stay at 1x1, luma carries the factor */
+    switch (subsampling) {
+        case JPEGENC_SUBSAMPLING_444:
+            cinfo->comp_info[0].h_samp_factor = 1;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            break;
+        case JPEGENC_SUBSAMPLING_422:
+            cinfo->comp_info[0].h_samp_factor = 2;
+            cinfo->comp_info[0].v_samp_factor = 1;
+            break;
+        case JPEGENC_SUBSAMPLING_420:
+        default:
+            cinfo->comp_info[0].h_samp_factor = 2;
+            cinfo->comp_info[0].v_samp_factor = 2;
+            break;
+    }
+}
+
+static void jpegenc_write_argb(struct jpeg_compress_struct *cinfo, Frame *frame, guchar *row)
+{
+    JSAMPROW rows[1];
+    guint y;
+
+    for (y = 0; y < frame->height; ++y) {
+        guchar *line = frame->data + (gsize)y * frame->stride;
+        if (row) {
+            const guint32 *px = (const guint32 *)line;
+            guint x;
+            for (x = 0; x < frame->width; ++x) {
+                row[3 * x] = (px[x] >> 16) & 0xff;
+                row[3 * x + 1] = (px[x] >> 8) & 0xff;
+                row[3 * x + 2] = px[x] & 0xff;
+            }
+            line = row;
+        }
+        rows[0] = line;
+        jpeg_write_scanlines(cinfo, rows, 1);
+    }
+}
+
+/* copy rows [y, y + n) of a plane into scratch, replicating the last row and
+ * column up to the padded size libjpeg reads in raw mode */
+static void jpegenc_fill_rows(JSAMPROW *rows, guchar *scratch, guint padded_width,
+        const guchar *plane, guint stride, guint width, guint height, guint y, guint n)
+{
+    guint j;
+
+    for (j = 0; j < n; ++j) {
+        const guchar *src = plane + (gsize)MIN(y + j, height - 1) * stride;
+        guchar *dst = scratch + (gsize)j * padded_width;
+        memcpy(dst, src, width);
+        memset(dst + width, src[width - 1], padded_width - width);
+        rows[j] = dst;
+    }
+}
+
+static void jpegenc_write_i420(struct jpeg_compress_struct *cinfo, Frame *frame, guchar *scratch)
+{
+    JSAMPROW y_rows[16], u_rows[8], v_rows[8];
+    JSAMPARRAY planes[3] = { y_rows, u_rows, v_rows };
+    guint chroma_width = (frame->width + 1) / 2;
+    guint chroma_height = (frame->height + 1) / 2;
+    guint y_padded = (frame->width + 15) & ~15;
+    guint c_padded = y_padded / 2;
+    guchar *y_scratch = scratch;
+    guchar *u_scratch = y_scratch + 16 * y_padded;
+    guchar *v_scratch = u_scratch + 8 * c_padded;
+    guint y;
+
+    for (y = 0; y < frame->height; y += 16) {
+        jpegenc_fill_rows(y_rows, y_scratch, y_padded, frame->data, frame->stride,
+                frame->width, frame->height, y, 16);
+        jpegenc_fill_rows(u_rows, u_scratch, c_padded, frame->u, frame->chroma_stride,
+                chroma_width, chroma_height, y / 2, 8);
+        jpegenc_fill_rows(v_rows, v_scratch, c_padded, frame->v, frame->chroma_stride,
+                chroma_width, chroma_height, y / 2, 8);
+        jpeg_write_raw_data(cinfo, planes, 16);
+    }
+}
+
+gboolean jpegenc_encode_frame(Frame *frame, const JpegencOptions *options,
+        guchar **out, gsize *out_size)
+{
+    g_return_val_if_fail(frame != NULL, FALSE);
+    g_return_val_if_fail(frame->format == FRAME_FORMAT_ARGB32 ||
+            frame->format == FRAME_FORMAT_I420, FALSE);
+    g_return_val_if_fail(options != NULL, FALSE);
+    g_return_val_if_fail(out != NULL && out_size != NULL, FALSE);
+
+    struct jpeg_compress_struct cinfo;
+    JpegencErrorMgr jerr;
+    unsigned char *buffer = NULL;
+    unsigned long size = 0;
+    /* volatile, we may come back here with longjmp */
+    guchar * volatile scratch = NULL;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpegenc_error_exit;
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        g_free(scratch);
+        return FALSE;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+
+    cinfo.image_width = frame->width;
+    cinfo.image_height = frame->height;
+
+    if (frame->format == FRAME_FORMAT_I420) {
+        /* hand the planes to libjpeg as they are, no colorspace conversion */
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_YCbCr;
+        jpeg_set_defaults(&cinfo);
+        cinfo.raw_data_in = TRUE;
+        jpegenc_set_subsampling(&cinfo, JPEGENC_SUBSAMPLING_420);
+        scratch = g_malloc(32 * ((frame->width + 15) & ~15));
+    }
+    else {
+        cinfo.input_components = 4;
+#ifdef JCS_EXTENSIONS
+        /* libjpeg-turbo reads native argb32 directly */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        cinfo.in_color_space = JCS_EXT_BGRX;
+#else
+        cinfo.in_color_space = JCS_EXT_XRGB;
+#endif
+#else
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        scratch = g_malloc(frame->width * 3);
+#endif
+        jpeg_set_defaults(&cinfo);
+        jpegenc_set_subsampling(&cinfo, options->subsampling);
+    }
+
+    jpeg_set_quality(&cinfo, CLAMP(options->quality, 1, 100), TRUE);
+    cinfo.dct_method = options->fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    if (frame->format == FRAME_FORMAT_I420)
+        jpegenc_write_i420(&cinfo, frame, scratch);
+    else
+        jpegenc_write_argb(&cinfo, frame, scratch);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    g_free(scratch);
+
+    *out = buffer;
+    *out_size = size;
+
+    return TRUE;
+}
+
+JpegencSubsampling jpegenc_subsampling_from_string(const gchar *str)
+{
+    if (g_strcmp0(str, "444") == 0)
+        return JPEGENC_SUBSAMPLING_444;
+    if (g_strcmp0(str, "422") == 0)
+        return JPEGENC_SUBSAMPLING_422;
+    return JPEGENC_SUBSAMPLING_420;
+}
+
+const gchar *jpegenc_subsampling_to_string(JpegencSubsampling subsampling)
+{
+    switch (subsampling) {
+        case JPEGENC_SUBSAMPLING_444:
+            return "444";
+        case JPEGENC_SUBSAMPLING_422:
+            return "422";
+        case JPEGENC_SUBSAMPLING_420:
+        default:
+            return "420";
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <glib.h>
+#include "frame.h"
+
+typedef enum {
+    JPEGENC_SUBSAMPLING_420 = 0,
+    JPEGENC_SUBSAMPLING_422,
+    JPEGENC_SUBSAMPLING_444
+} JpegencSubsampling;
+
+typedef struct {
+    gint quality; /* 1-100 */
+    JpegencSubsampling subsampling;
+    gboolean fast_dct;
+} JpegencOptions;
+
+/* the defaults match what Imlib2 produced before */
+void jpegenc_options_init(JpegencOptions *options);
+
+/* TRUE if filename has an extension we encode with libjpeg */
+gboolean jpegenc_handles_filename(const gchar *filename);
+
+/* encode an ARGB32 or I420 frame into a buffer allocated by libjpeg (release with
+ * free()); I420 is written as raw YCbCr and always uses 4:2:0 subsampling */
+gboolean jpegenc_encode_frame(Frame *frame, const JpegencOptions *options,
+        guchar **out, gsize *out_size);
+
+JpegencSubsampling jpegenc_subsampling_from_string(const gchar *str);
+const gchar *jpegenc_subsampling_to_string(JpegencSubsampling subsampling);
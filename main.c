@@ -9,12 +9,17 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <glib/gi18n.h>
+#include <glib-unix.h>
+#include <signal.h>
 
 #include <locale.h>
 #include <libintl.h>
 
 #include <gdk/gdkx.h>
-#include "camera.h"
+#include "timelapse.h"
+#include "headless.h"
+#include "render.h"
+#include "trace.h"
 
 enum ENTRIES {
     ENTRY_DIRECTORY,
@@ -30,6 +35,10 @@ enum STATUS_LABELS {
     LABEL_RUNNING_TIME,
     LABEL_TIMESTAMP_LAST,
     LABEL_TIMESTAMP_NEXT,
+    LABEL_ENCODER_QUEUE,
+    LABEL_STAGE_TIMINGS,
+    LABEL_SCENE_CHANGES,
+    LABEL_CAMERAS,
     N_STATUS_LABELS
 };
 
@@ -38,6 +47,10 @@ struct {
     GtkWidget *entries[N_ENTRIES];
     GtkWidget *start_button;
     GtkWidget *stop_button;
+    GtkWidget *trigger_button;
+    GtkWidget *render_button;
+    GtkWidget *render_dialog;
+    GtkWidget *render_progress;
     GtkWidget *live_view;
     GtkWidget *last_view;
     GtkWidget *running_area;
@@ -47,6 +60,7 @@ struct {
 } widgets;
 
 gboolean is_running;
+gboolean is_iconified;
 
 time_t start_time;
 guint64 running_time;
@@ -55,76 +69,108 @@ time_t next_time;
 
 guint clock_timer_id;
 
-typedef struct {
-    guint camera_timer_id;
-    Camera *camera;
-    gint64 next_event;
-    gint64 interval;
-    guint64 image_number;
-    guint64 count;
-    guint64 frames_done;
-} TimelapseStatus;
-
+Timelapse *timelapse = NULL;
 Camera *camera_live_view = NULL;
+Render *render = NULL;
 
+TimelapseConfig current_config;
+
+/* [Camera <name>] groups, captured without preview along with the main camera */
 typedef struct {
-    gchar *filename;
-    guint width;
-    guint height;
-    guint count;
-    guint interval;
-    gboolean valid;
-} TimelapseConfig;
+    gchar *name;
+    TimelapseConfig config;
+    Timelapse *timelapse;
+} MainCamera;
 
-TimelapseConfig current_config;
-TimelapseStatus current_status;
+GPtrArray *other_cameras = NULL;
 
 void main_child_stop(void);
 
+static MainCamera *main_camera_new(const gchar *name, GKeyFile *kf)
+{
+    MainCamera *cam = g_malloc0(sizeof(MainCamera));
+    gchar *group = g_strconcat(TIMELAPSE_CAMERA_GROUP, name, NULL);
+
+    cam->name = g_strdup(name);
+    timelapse_config_init(&cam->config);
+    timelapse_config_load(&cam->config, kf, "Status");
+    timelapse_config_load(&cam->config, kf, group);
+    g_free(group);
+
+    return cam;
+}
+
+static void main_camera_free(MainCamera *cam)
+{
+    if (cam == NULL)
+        return;
+
+    timelapse_destroy(cam->timelapse);
+    timelapse_config_clear(&cam->config);
+    g_free(cam->name);
+    g_free(cam);
+}
+
 void main_read_config(void)
 {
-    gchar *status_file_path = g_build_filename(
-            g_get_user_config_dir(),
-            "timelapse-status.conf",
-            NULL);
+    gchar *status_file_path = timelapse_config_get_default_path();
     GKeyFile *kf = g_key_file_new();
-
-    if (!g_key_file_load_from_file(kf, status_file_path, G_KEY_FILE_NONE, NULL)) {
-        current_config.filename = g_strdup("frame0000.jpeg");
-        current_config.width = 640;
-        current_config.height = 480;
-        current_config.count = 100;
-        current_config.interval = 2;
-    }
-    else {
-        current_config.filename = g_key_file_get_string(kf, "Status", "filename", NULL);
-        current_config.width = g_key_file_get_integer(kf, "Status", "width", NULL);
-        current_config.height = g_key_file_get_integer(kf, "Status", "height", NULL);
-        current_config.count = g_key_file_get_integer(kf, "Status", "count", NULL);
-        current_config.interval = g_key_file_get_integer(kf, "Status", "interval", NULL);
+    gchar **names;
+    guint j;
+
+    timelapse_config_init(&current_config);
+    other_cameras = g_ptr_array_new_with_free_func((GDestroyNotify)main_camera_free);
+    if (g_key_file_load_from_file(kf, status_file_path, G_KEY_FILE_NONE, NULL)) {
+        timelapse_config_load(&current_config, kf, "Status");
+
+        names = timelapse_config_get_camera_groups(kf);
+        for (j = 0; names[j]; ++j)
+            g_ptr_array_add(other_cameras, main_camera_new(names[j], kf));
+        g_strfreev(names);
     }
 
     g_free(status_file_path);
     g_key_file_free(kf);
 }
 
+/* the camera groups as they are on disk now, they are only edited by hand */
+static void main_copy_camera_groups(GKeyFile *kf, GKeyFile *old)
+{
+    gchar **names = timelapse_config_get_camera_groups(old);
+    gchar **keys;
+    gchar *group, *value;
+    guint j, k;
+
+    for (j = 0; names[j]; ++j) {
+        group = g_strconcat(TIMELAPSE_CAMERA_GROUP, names[j], NULL);
+        keys = g_key_file_get_keys(old, group, NULL, NULL);
+        for (k = 0; keys && keys[k]; ++k) {
+            value = g_key_file_get_value(old, group, keys[k], NULL);
+            g_key_file_set_value(kf, group, keys[k], value);
+            g_free(value);
+        }
+        g_strfreev(keys);
+        g_free(group);
+    }
+    g_strfreev(names);
+}
+
 void main_write_config(void)
 {
-    gchar *status_file_path = g_build_filename(
-            g_get_user_config_dir(),
-            "timelapse-status.conf",
-            NULL);
+    gchar *status_file_path = timelapse_config_get_default_path();
     GKeyFile *kf = g_key_file_new();
+    GKeyFile *old = g_key_file_new();
 
-    g_key_file_set_string(kf, "Status", "filename", current_config.filename);
-    g_key_file_set_integer(kf, "Status", "width", current_config.width);
-    g_key_file_set_integer(kf, "Status", "height", current_config.height);
-    g_key_file_set_integer(kf, "Status", "count", current_config.count);
-    g_key_file_set_integer(kf, "Status", "interval", current_config.interval);
+    /* written from scratch, so keys no longer set (e.g. stats-file) and
+     * groups no longer used do not stay behind */
+    timelapse_config_save(&current_config, kf, "Status");
+    if (g_key_file_load_from_file(old, status_file_path, G_KEY_FILE_NONE, NULL))
+        main_copy_camera_groups(kf, old);
 
     g_key_file_save_to_file(kf, status_file_path, NULL);
 
     g_free(status_file_path);
+    g_key_file_free(old);
     g_key_file_free(kf);
 }
 
@@ -134,10 +180,16 @@ void main_cleanup(void)
 {
     main_child_stop();
 
+    render_destroy(render);
+    render = NULL;
+
     if (widgets.last_image_surface)
         cairo_surface_destroy(widgets.last_image_surface);
 
-    camera_destroy(camera_live_view);
+    timelapse_destroy(timelapse);
+    timelapse_config_clear(&current_config);
+    g_ptr_array_unref(other_cameras);
+    other_cameras = NULL;
 }
 
 const gchar *seconds_to_string(guint32 seconds)
@@ -147,6 +199,67 @@ const gchar *seconds_to_string(guint32 seconds)
     return buffer;
 }
 
+void main_update_stage_timings(void)
+{
+    gchar *timings = stats_format(timelapse_get_timings(timelapse));
+    gchar *markup = g_markup_printf_escaped("<tt>%s</tt>", timings);
+
+    gtk_label_set_markup(GTK_LABEL(widgets.labels[LABEL_STAGE_TIMINGS]), markup);
+
+    g_free(markup);
+    g_free(timings);
+}
+
+void main_update_scene_changes(void)
+{
+    TimelapseStatus status;
+    gchar *text;
+
+    if (current_config.change_threshold <= 0) {
+        gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_SCENE_CHANGES]), _("off"));
+        return;
+    }
+
+    timelapse_get_status(timelapse, &status);
+    /* xgettext does not expand G_GUINT64_FORMAT, so plain %llu */
+    if (status.last_change >= 0)
+        text = g_strdup_printf(_("%llu kept, %llu skipped (last difference %.2f)"),
+                (unsigned long long)(status.frames_done - status.frames_skipped),
+                (unsigned long long)status.frames_skipped, status.last_change);
+    else
+        text = g_strdup_printf(_("%llu kept, %llu skipped"),
+                (unsigned long long)(status.frames_done - status.frames_skipped),
+                (unsigned long long)status.frames_skipped);
+    gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_SCENE_CHANGES]), text);
+    g_free(text);
+}
+
+/* one line per camera, so a stall on one of them shows up */
+void main_update_cameras(void)
+{
+    GString *text = g_string_new(NULL);
+    MainCamera *cam;
+    gchar *status;
+    guint j;
+
+    status = timelapse_format_status(timelapse);
+    g_string_append_printf(text, "%s: %s", _("main"), status);
+    g_free(status);
+
+    for (j = 0; j < other_cameras->len; ++j) {
+        cam = g_ptr_array_index(other_cameras, j);
+        if (!timelapse_is_running(cam->timelapse))
+            status = g_strdup(_("stopped"));
+        else
+            status = timelapse_format_status(cam->timelapse);
+        g_string_append_printf(text, "\n%s: %s", cam->name, status);
+        g_free(status);
+    }
+
+    gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_CAMERAS]), text->str);
+    g_string_free(text, TRUE);
+}
+
 static gboolean update_running_time(gpointer userdata)
 {
     static time_t cur_time;
@@ -157,6 +270,10 @@ static gboolean update_running_time(gpointer userdata)
     gchar *text = g_strdup_printf(_("%s (until next image: %s)"), rt, nt);
 
     gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_RUNNING_TIME]), text);
+    main_update_stage_timings();
+    main_update_scene_changes();
+    if (other_cameras->len)
+        main_update_cameras();
 
     g_free(rt);
     g_free(nt);
@@ -165,93 +282,18 @@ static gboolean update_running_time(gpointer userdata)
     return G_SOURCE_CONTINUE;
 }
 
-gboolean main_filename_matches_pattern(gchar *name1, gchar *name2)
-{
-    if (!name1 || !name2)
-        return FALSE;
-    gssize j = strlen(name1);
-    if (strlen(name2) != j) {
-        return FALSE;
-    }
-    for ( ; j >= 0; --j) {
-        if (!g_ascii_isdigit(name1[j])) {
-            if (name1[j] != name2[j]) {
-                return FALSE;
-            }
-        }
-        else {
-            break;
-        }
-    }
-    for ( ; j >= 0; --j) {
-        if (g_ascii_isdigit(name1[j]) && g_ascii_isdigit(name2[j])) {
-            continue;
-        }
-        break;
-    }
-    for ( ; j >= 0; --j) {
-        if (name1[j] != name2[j]) {
-            return FALSE;
-        }
-    }
-    return TRUE;
-}
-
-gchar *main_generate_filename(const gchar *base, guint64 offset)
-{
-    if (base == NULL || base[0] == '\0')
-        return NULL;
-    /* only use the basename and not the directory part */
-    gchar *dirsep = strrchr(base, '/');
-    if (dirsep)
-        ++dirsep;
-    else
-        dirsep = (gchar *)base;
-
-    /* get suffix */
-    /* we only want numbers in the real filename, not the extension */
-    gchar *suff = strrchr(base, '.');
-    if (!suff)
-        suff = (gchar *)base + strlen(base);
-
-    /* get last number */
-    for ( ; suff >= dirsep; --suff)
-        if (g_ascii_isdigit(*suff))
-            break;
-    if (suff < dirsep)
-        return g_strdup(base);
-
-    gchar *num = suff++;
-    for ( ; num >= dirsep; --num)
-        if (!g_ascii_isdigit(*num))
-            break;
-    ++num;
-    
-    gchar format[32];
-    sprintf(format, "%%0%u" G_GUINT64_FORMAT, suff-num);
-    unsigned long long int n = strtoull(num, NULL, 10);
-    GString *str = g_string_new_len(base, num-base);
-    g_string_append_printf(str, format, n + offset);
-    g_string_append(str, suff);
-
-    return g_string_free(str, FALSE);
-}
+static cairo_user_data_key_t main_frame_key;
 
-void main_last_image_changed(guint width, guint height, guchar *data, gpointer userdata)
+void main_last_image_changed(Frame *frame)
 {
-    if (widgets.last_image_surface && 
-            (cairo_image_surface_get_width(widgets.last_image_surface) != width ||
-             cairo_image_surface_get_height(widgets.last_image_surface) != height)) {
+    if (widgets.last_image_surface)
         cairo_surface_destroy(widgets.last_image_surface);
-        widgets.last_image_surface = NULL;
-    }
 
-    if (!widgets.last_image_surface)
-        widgets.last_image_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                                                width, height);
-    guchar *surf_data = cairo_image_surface_get_data(widgets.last_image_surface);
-    memcpy(surf_data, data, width * height * 4);
-    cairo_surface_mark_dirty(widgets.last_image_surface);
+    /* share the pixels with the encoder, the frame is released with the surface */
+    widgets.last_image_surface = cairo_image_surface_create_for_data(frame->data,
+            CAIRO_FORMAT_ARGB32, frame->width, frame->height, frame->stride);
+    cairo_surface_set_user_data(widgets.last_image_surface, &main_frame_key,
+            frame_ref(frame), (cairo_destroy_func_t)frame_unref);
 
     gtk_widget_queue_draw(widgets.last_view);
 }
@@ -262,29 +304,65 @@ void main_update_timestamps(const gchar *last_filename)
     struct tm *tm;
     gchar tbuf[256];
     gchar *text;
-    if (stat(last_filename, &st) == 0) {
-        last_time = st.st_mtim.tv_sec;
-        tm = localtime(&last_time);
-        strftime(tbuf, 255, "%x %T", tm);
-        text = g_strdup_printf("%s (%s)", tbuf, last_filename);
-        gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_TIMESTAMP_LAST]), text);
-        g_free(text);
-
-        next_time = last_time + current_config.interval;
-        tm = localtime(&next_time);
-        strftime(tbuf, 255, "%x %T", tm);
-        gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_TIMESTAMP_NEXT]), tbuf);
-    }
+    gint64 last_ms;
+    /* archived frames have no file of their own */
+    if (current_config.archive)
+        last_ms = g_get_real_time() / 1000;
+    else if (stat(last_filename, &st) == 0)
+        last_ms = (gint64)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+    else
+        return;
+    last_time = last_ms / 1000;
+
+    tm = localtime(&last_time);
+    strftime(tbuf, 255, "%x %T", tm);
+    text = g_strdup_printf("%s (%s)", tbuf, last_filename);
+    gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_TIMESTAMP_LAST]), text);
+    g_free(text);
+
+    /* in milliseconds, the interval need not be whole seconds */
+    next_time = (last_ms + current_config.interval) / 1000;
+    tm = localtime(&next_time);
+    strftime(tbuf, 255, "%x %T", tm);
+    gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_TIMESTAMP_NEXT]), tbuf);
 }
 
-void main_camera_make_snapshot(guint64 number)
+void main_update_encoder_stats(void)
 {
-    gchar *filename = main_generate_filename(current_config.filename, number);
-    if (filename && camera_save_snapshot_to_file(camera_live_view, filename,
-                current_config.width, current_config.height,
-                (CAMERA_SNAPSHOT_TAKEN_CALLBACK)main_last_image_changed, NULL))
-        main_update_timestamps(filename);
-    g_free(filename);
+    EncoderStats stats;
+    gchar *text;
+
+    camera_get_encoder_stats(camera_live_view, &stats);
+    text = g_strdup_printf("%u/%u (max. %u), %u writing (max. %u), "
+                "%" G_GUINT64_FORMAT " written, %" G_GUINT64_FORMAT " dropped, "
+                "%" G_GUINT64_FORMAT " failed",
+            stats.pending, stats.queue_size, stats.max_pending,
+            stats.writer.in_flight, stats.writer.max_in_flight,
+            stats.written, stats.dropped, stats.failed + stats.writer.failed);
+    gtk_label_set_text(GTK_LABEL(widgets.labels[LABEL_ENCODER_QUEUE]), text);
+    g_free(text);
+}
+
+void main_snapshot_saved(Timelapse *timelapse, const gchar *filename, Frame *frame, gpointer userdata)
+{
+    gint64 start = g_get_monotonic_time();
+
+    main_last_image_changed(frame);
+    main_update_timestamps(filename);
+    main_update_encoder_stats();
+
+    stats_record(timelapse_get_timings(timelapse), STATS_STAGE_UI, g_get_monotonic_time() - start);
+    TRACE_END("ui", "snapshot-saved", start);
+}
+
+void main_snapshot_queued(Timelapse *timelapse, guint64 number, gpointer userdata)
+{
+    main_update_encoder_stats();
+}
+
+void main_timelapse_finished(Timelapse *timelapse, gpointer userdata)
+{
+    main_child_stop();
 }
 
 static void main_live_view_realize(GtkWidget *widget, gpointer userdata)
@@ -293,6 +371,27 @@ static void main_live_view_realize(GtkWidget *widget, gpointer userdata)
     camera_start(camera_live_view);
 }
 
+/* nobody looks at a hidden live view, do not feed it */
+static void main_update_live_view_active(void)
+{
+    camera_set_preview_active(camera_live_view,
+            gtk_widget_get_mapped(widgets.live_view) && !is_iconified);
+}
+
+static void main_live_view_map_changed(GtkWidget *widget, gpointer userdata)
+{
+    main_update_live_view_active();
+}
+
+static gboolean main_window_state_event(GtkWidget *widget, GdkEventWindowState *event,
+        gpointer userdata)
+{
+    is_iconified = (event->new_window_state & GDK_WINDOW_STATE_ICONIFIED) != 0;
+    main_update_live_view_active();
+
+    return FALSE;
+}
+
 static gboolean main_running_area_draw(GtkWidget *widget, cairo_t *cr, gpointer userdata)
 {
     GtkAllocation alloc;
@@ -336,6 +435,15 @@ static gboolean main_last_view_draw(GtkWidget *widget, cairo_t *cr, gpointer use
         w = cairo_image_surface_get_width(widgets.last_image_surface);
         h = cairo_image_surface_get_height(widgets.last_image_surface);
 
+        /* the encoder already fitted the preview to our allocation */
+        if (w <= alloc.width && h <= alloc.height && (w == alloc.width || h == alloc.height)) {
+            cairo_set_source_surface(cr, widgets.last_image_surface,
+                    (alloc.width - w) / 2, (alloc.height - h) / 2);
+            cairo_paint(cr);
+            return TRUE;
+        }
+
+        /* resized since the last frame or a small frame, the next one fits again */
         scale = ((double)alloc.width)/((double)w);
         tmp = ((double)alloc.height)/((double)h);
         if (tmp < scale)
@@ -355,51 +463,55 @@ static gboolean main_last_view_draw(GtkWidget *widget, cairo_t *cr, gpointer use
     return TRUE;
 }
 
-static gboolean main_camera_idle(TimelapseStatus *status)
+static void main_last_view_size_allocate(GtkWidget *widget, GtkAllocation *alloc, gpointer userdata)
 {
-    gint64 now = g_get_monotonic_time();
-
-    if (now <= status->next_event)
-        return TRUE;
-
-    status->next_event += status->interval;
-
-    main_camera_make_snapshot(status->image_number++);
+    camera_set_snapshot_preview_size(camera_live_view, alloc->width, alloc->height);
+}
 
-    ++status->frames_done;
+/* the other cameras only start with the main one */
+gboolean main_child_start(const TimelapseConfig *config)
+{
+    MainCamera *cam;
+    Camera *camera;
+    guint j;
 
-    if (status->count && status->frames_done >= status->count) {
-        status->camera_timer_id = 0;
-        main_child_stop();
+    if (!timelapse_start(timelapse, config))
         return FALSE;
-    }
 
-    return TRUE;
-}
+    for (j = 0; j < other_cameras->len; ++j) {
+        cam = g_ptr_array_index(other_cameras, j);
+        if (cam->timelapse == NULL) {
+            camera = camera_new();
+            camera_set_preview(camera, FALSE);
+            cam->timelapse = timelapse_new(camera);
+            timelapse_apply_config(cam->timelapse, &cam->config);
+        }
+        camera_start(timelapse_get_camera(cam->timelapse));
+        if (!timelapse_start(cam->timelapse, &cam->config))
+            g_printerr("Could not start capturing with %s\n", cam->name);
+    }
 
-gboolean main_child_start(const TimelapseConfig *config)
-{
-    current_status.camera = camera_live_view;
-    current_status.interval = config->interval * 1e6;
-    current_status.image_number = 0;
-    current_status.next_event = g_get_monotonic_time();
-    current_status.frames_done = 0;
-    current_status.count = config->count;
-    current_status.camera_timer_id = g_idle_add((GSourceFunc)main_camera_idle, &current_status);
-    
     return TRUE;
 }
 
 void main_child_stop(void)
 {
+    MainCamera *cam;
+    guint j;
+
     if (clock_timer_id) {
         g_source_remove(clock_timer_id);
         clock_timer_id = 0;
     }
 
-    if (current_status.camera_timer_id) {
-        g_source_remove(current_status.camera_timer_id);
-        current_status.camera_timer_id = 0;
+    timelapse_stop(timelapse);
+
+    for (j = 0; j < other_cameras->len; ++j) {
+        cam = g_ptr_array_index(other_cameras, j);
+        if (cam->timelapse == NULL)
+            continue;
+        timelapse_stop(cam->timelapse);
+        camera_stop(timelapse_get_camera(cam->timelapse));
     }
 
     current_config.valid = FALSE;
@@ -409,37 +521,69 @@ void main_child_stop(void)
         gtk_widget_set_sensitive(widgets.start_button, TRUE);
     if (GTK_IS_WIDGET(widgets.stop_button))
         gtk_widget_set_sensitive(widgets.stop_button, FALSE);
+    if (GTK_IS_WIDGET(widgets.trigger_button))
+        gtk_widget_set_sensitive(widgets.trigger_button, FALSE);
+    if (GTK_IS_WIDGET(widgets.render_button))
+        gtk_widget_set_sensitive(widgets.render_button, TRUE);
     if (GTK_IS_WIDGET(widgets.running_area))
         gtk_widget_queue_draw(widgets.running_area);
 }
 
-static void main_start_button_clicked(GtkButton *button, gpointer userdata)
+/* name of the sequence as set in the window */
+static gchar *main_get_filename(void)
 {
-    gchar *directory, *tmp;
-    const gchar *filename, *width, *height, *count, *interval;
+    gchar *directory, *tmp, *filename;
+    const gchar *basename;
 
     directory = gtk_file_chooser_get_uri(GTK_FILE_CHOOSER(widgets.entries[ENTRY_DIRECTORY]));
-    filename = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_BASENAME]));
-    width = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_WIDTH]));
-    height = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_HEIGHT]));
-    count = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_N_SNAPSHOTS]));
-    interval = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_INTERVAL]));
-
-    current_config.valid = FALSE;
-    g_free(current_config.filename);
-    current_config.filename = NULL;
+    basename = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_BASENAME]));
 
     if (directory) {
         tmp = g_build_filename(
                 directory,
-                filename,
+                basename,
                 NULL);
-        current_config.filename = g_filename_from_uri(tmp, NULL, NULL);
+        filename = g_filename_from_uri(tmp, NULL, NULL);
         g_free(tmp);
     }
     else {
-        current_config.filename = g_strdup(filename);
+        filename = g_strdup(basename);
     }
+    g_free(directory);
+
+    return filename;
+}
+
+/* whether any camera keeps frames for main_trigger */
+static gboolean main_has_pretrigger(void)
+{
+    MainCamera *cam;
+    guint j;
+
+    if (current_config.pretrigger > 0)
+        return TRUE;
+    for (j = 0; j < other_cameras->len; ++j) {
+        cam = g_ptr_array_index(other_cameras, j);
+        if (cam->config.pretrigger > 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void main_start_button_clicked(GtkButton *button, gpointer userdata)
+{
+    const gchar *width, *height, *count, *interval;
+
+    width = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_WIDTH]));
+    height = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_HEIGHT]));
+    count = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_N_SNAPSHOTS]));
+    interval = gtk_entry_get_text(GTK_ENTRY(widgets.entries[ENTRY_INTERVAL]));
+
+    current_config.valid = FALSE;
+    g_free(current_config.filename);
+    current_config.filename = main_get_filename();
+
     gchar *endptr;
     GString *error_msg = g_string_new(NULL);
 
@@ -455,9 +599,16 @@ static void main_start_button_clicked(GtkButton *button, gpointer userdata)
     if (*endptr || endptr == count)
         g_string_append(error_msg, _("Count must be a number.\n"));
 
-    current_config.interval = (guint)strtoul(interval, &endptr, 10);
-    if (*endptr || endptr == interval)
+    /* seconds with a fraction, at least a millisecond unless in burst mode */
+    gdouble seconds = g_ascii_strtod(interval, &endptr);
+    /* the conversion is undefined for negative, too large and NaN values */
+    if (*endptr || endptr == interval || !(seconds >= 0 && seconds * 1e3 + 0.5 < G_MAXUINT))
         g_string_append(error_msg, _("Interval must be a number.\n"));
+    else {
+        current_config.interval = (guint)(seconds * 1e3 + 0.5);
+        if (current_config.interval == 0 && !current_config.burst)
+            g_string_append(error_msg, _("Interval must be a number.\n"));
+    }
 
     gchar *msg = g_string_free(error_msg, FALSE);
     GtkWidget *dialog;
@@ -490,13 +641,36 @@ static void main_start_button_clicked(GtkButton *button, gpointer userdata)
 
     gtk_widget_set_sensitive(widgets.start_button, FALSE);
     gtk_widget_set_sensitive(widgets.stop_button, TRUE);
+    gtk_widget_set_sensitive(widgets.trigger_button, main_has_pretrigger());
+    gtk_widget_set_sensitive(widgets.render_button, FALSE);
 
     is_running = TRUE;
     gtk_widget_queue_draw(widgets.running_area);
 
 done:
     g_free(msg);
-    g_free(directory);
+}
+
+/* write the pre-trigger frames of all cameras */
+static void main_trigger(void)
+{
+    MainCamera *cam;
+    guint j;
+
+    if (!timelapse_trigger(timelapse))
+        g_printerr("No pre-trigger frames to write\n");
+
+    for (j = 0; j < other_cameras->len; ++j) {
+        cam = g_ptr_array_index(other_cameras, j);
+        if (cam->timelapse)
+            timelapse_trigger(cam->timelapse);
+    }
+}
+
+static gboolean main_trigger_signal(gpointer userdata)
+{
+    main_trigger();
+    return G_SOURCE_CONTINUE;
 }
 
 static void main_stop_button_clicked(GtkButton *button, gpointer userdata)
@@ -507,6 +681,125 @@ static void main_stop_button_clicked(GtkButton *button, gpointer userdata)
     main_child_stop();
 }
 
+static void main_render_progress(Render *r, guint64 done, guint64 total, gpointer userdata)
+{
+    gchar buf[64];
+
+    if (!GTK_IS_WIDGET(widgets.render_progress))
+        return;
+
+    snprintf(buf, 64, "%" G_GUINT64_FORMAT " / %" G_GUINT64_FORMAT, done, total);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(widgets.render_progress), buf);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(widgets.render_progress),
+            total ? (gdouble)done / total : 0.0);
+}
+
+static void main_render_stop(void)
+{
+    render_destroy(render);
+    render = NULL;
+
+    if (GTK_IS_WIDGET(widgets.render_dialog))
+        gtk_widget_destroy(widgets.render_dialog);
+    widgets.render_dialog = NULL;
+    widgets.render_progress = NULL;
+
+    gtk_widget_set_sensitive(widgets.start_button, TRUE);
+    gtk_widget_set_sensitive(widgets.render_button, TRUE);
+}
+
+static void main_render_finished(Render *r, gboolean success, gpointer userdata)
+{
+    GtkWidget *dialog;
+
+    main_render_stop();
+
+    dialog = gtk_message_dialog_new(
+            GTK_WINDOW(widgets.main_window),
+            GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+            success ? GTK_MESSAGE_INFO : GTK_MESSAGE_ERROR,
+            GTK_BUTTONS_OK,
+            success ? _("The video has been rendered.") : _("The video could not be rendered."));
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+}
+
+/* cancel, or the dialog was closed */
+static void main_render_dialog_response(GtkDialog *dialog, gint response, gpointer userdata)
+{
+    main_render_stop();
+}
+
+static void main_render_button_clicked(GtkButton *button, gpointer userdata)
+{
+    RenderCallbacks callbacks = {
+        main_render_progress,
+        main_render_finished
+    };
+    GtkWidget *dialog;
+    gchar *filename, *directory, *output;
+
+    if (render)
+        return;
+
+    filename = main_get_filename();
+    directory = g_path_get_dirname(filename);
+
+    dialog = gtk_file_chooser_dialog_new(_("Render video"),
+            GTK_WINDOW(widgets.main_window),
+            GTK_FILE_CHOOSER_ACTION_SAVE,
+            _("_Cancel"), GTK_RESPONSE_CANCEL,
+            _("_Save"), GTK_RESPONSE_ACCEPT,
+            NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+    gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog), directory);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "timelapse.mkv");
+    g_free(directory);
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) != GTK_RESPONSE_ACCEPT) {
+        gtk_widget_destroy(dialog);
+        g_free(filename);
+        return;
+    }
+    output = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+    gtk_widget_destroy(dialog);
+
+    render = render_start(filename, output, &current_config.render, &callbacks, NULL);
+    g_free(filename);
+    g_free(output);
+
+    if (render == NULL) {
+        dialog = gtk_message_dialog_new(
+                GTK_WINDOW(widgets.main_window),
+                GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                GTK_MESSAGE_ERROR,
+                GTK_BUTTONS_OK,
+                _("The video could not be rendered."));
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+        return;
+    }
+
+    gtk_widget_set_sensitive(widgets.start_button, FALSE);
+    gtk_widget_set_sensitive(widgets.render_button, FALSE);
+
+    /* not modal, the live view goes on meanwhile */
+    widgets.render_dialog = gtk_dialog_new_with_buttons(_("Render video"),
+            GTK_WINDOW(widgets.main_window),
+            GTK_DIALOG_DESTROY_WITH_PARENT,
+            _("_Cancel"), GTK_RESPONSE_CANCEL,
+            NULL);
+    widgets.render_progress = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(widgets.render_progress), TRUE);
+    gtk_widget_set_size_request(widgets.render_progress, 300, -1);
+    gtk_container_set_border_width(GTK_CONTAINER(widgets.render_dialog), 6);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(widgets.render_dialog))),
+            widgets.render_progress, TRUE, TRUE, 3);
+    g_signal_connect(G_OBJECT(widgets.render_dialog), "response",
+            G_CALLBACK(main_render_dialog_response), NULL);
+    gtk_widget_show_all(widgets.render_dialog);
+}
+
 static void main_show_dialog_about(void)
 {
     gchar *authors[] = { "Holger Langenau", NULL };
@@ -523,6 +816,8 @@ void main_create_window(void)
     widgets.main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     g_signal_connect(G_OBJECT(widgets.main_window), "destroy",
             G_CALLBACK(gtk_main_quit), NULL);
+    g_signal_connect(G_OBJECT(widgets.main_window), "window-state-event",
+            G_CALLBACK(main_window_state_event), NULL);
 
     GtkWidget *grid = gtk_grid_new();
     GtkWidget *label;
@@ -551,12 +846,18 @@ void main_create_window(void)
             G_CALLBACK(main_live_view_draw), NULL);
     g_signal_connect(G_OBJECT(widgets.live_view), "realize",
             G_CALLBACK(main_live_view_realize), NULL);
+    g_signal_connect_after(G_OBJECT(widgets.live_view), "map",
+            G_CALLBACK(main_live_view_map_changed), NULL);
+    g_signal_connect_after(G_OBJECT(widgets.live_view), "unmap",
+            G_CALLBACK(main_live_view_map_changed), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), widgets.live_view, TRUE, TRUE, 3);
 
     widgets.last_view = gtk_drawing_area_new();
     gtk_widget_set_size_request(widgets.last_view, 320, 240);
     g_signal_connect(G_OBJECT(widgets.last_view), "draw",
             G_CALLBACK(main_last_view_draw), NULL);
+    g_signal_connect(G_OBJECT(widgets.last_view), "size-allocate",
+            G_CALLBACK(main_last_view_size_allocate), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), widgets.last_view, TRUE, TRUE, 3);
 
     gtk_grid_attach(GTK_GRID(grid), hbox, 0, 0, 3, 1);
@@ -588,6 +889,32 @@ void main_create_window(void)
     gtk_widget_set_halign(widgets.labels[LABEL_TIMESTAMP_NEXT], GTK_ALIGN_START);
     gtk_grid_attach(GTK_GRID(label_grid), widgets.labels[LABEL_TIMESTAMP_NEXT], 1, 2, 1, 1);
 
+    label = gtk_label_new(_("Encoder queue:"));
+    gtk_widget_set_halign(label, GTK_ALIGN_END);
+    gtk_grid_attach(GTK_GRID(label_grid), label, 0, 3, 1, 1);
+    widgets.labels[LABEL_ENCODER_QUEUE] = gtk_label_new(NULL);
+    gtk_widget_set_halign(widgets.labels[LABEL_ENCODER_QUEUE], GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(label_grid), widgets.labels[LABEL_ENCODER_QUEUE], 1, 3, 1, 1);
+
+    label = gtk_label_new(_("Unchanged frames:"));
+    gtk_widget_set_halign(label, GTK_ALIGN_END);
+    gtk_grid_attach(GTK_GRID(label_grid), label, 0, 4, 1, 1);
+    widgets.labels[LABEL_SCENE_CHANGES] = gtk_label_new(NULL);
+    gtk_widget_set_halign(widgets.labels[LABEL_SCENE_CHANGES], GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(label_grid), widgets.labels[LABEL_SCENE_CHANGES], 1, 4, 1, 1);
+
+    widgets.labels[LABEL_CAMERAS] = gtk_label_new(NULL);
+    gtk_widget_set_halign(widgets.labels[LABEL_CAMERAS], GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(label_grid), widgets.labels[LABEL_CAMERAS], 0, 5, 3, 1);
+
+    label = gtk_label_new(_("Stage timing (ms, min/mean/p99):"));
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(label_grid), label, 2, 0, 1, 1);
+    widgets.labels[LABEL_STAGE_TIMINGS] = gtk_label_new(NULL);
+    gtk_widget_set_halign(widgets.labels[LABEL_STAGE_TIMINGS], GTK_ALIGN_START);
+    gtk_widget_set_valign(widgets.labels[LABEL_STAGE_TIMINGS], GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(label_grid), widgets.labels[LABEL_STAGE_TIMINGS], 2, 1, 1, 3);
+
     gtk_grid_attach(GTK_GRID(grid), label_grid, 0, 1, 3, 1);
 
     /* Settings */
@@ -642,7 +969,7 @@ void main_create_window(void)
     gtk_widget_set_halign(label, GTK_ALIGN_END);
     gtk_grid_attach(GTK_GRID(grid), label, 0, 6, 1, 1);
     widgets.entries[ENTRY_INTERVAL] = gtk_entry_new();
-    snprintf(nbuf, 255, "%u", current_config.interval);
+    g_ascii_formatd(nbuf, 255, "%g", current_config.interval / 1e3);
     gtk_entry_set_text(GTK_ENTRY(widgets.entries[ENTRY_INTERVAL]), nbuf);
     gtk_grid_attach(GTK_GRID(grid), widgets.entries[ENTRY_INTERVAL], 1, 6, 1, 1);
 
@@ -657,6 +984,18 @@ void main_create_window(void)
             G_CALLBACK(main_stop_button_clicked), NULL);
     gtk_widget_set_sensitive(widgets.stop_button, FALSE);
     gtk_box_pack_start(GTK_BOX(hbox), widgets.stop_button, FALSE, FALSE, 3);
+
+    /* only sensitive while capturing with pretrigger set */
+    widgets.trigger_button = gtk_button_new_with_label(_("Save last seconds"));
+    g_signal_connect_swapped(G_OBJECT(widgets.trigger_button), "clicked",
+            G_CALLBACK(main_trigger), NULL);
+    gtk_widget_set_sensitive(widgets.trigger_button, FALSE);
+    gtk_box_pack_start(GTK_BOX(hbox), widgets.trigger_button, FALSE, FALSE, 3);
+
+    widgets.render_button = gtk_button_new_with_label(_("Render video"));
+    g_signal_connect(G_OBJECT(widgets.render_button), "clicked",
+            G_CALLBACK(main_render_button_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), widgets.render_button, FALSE, FALSE, 3);
     
     button = gtk_button_new();
     gtk_button_set_image(GTK_BUTTON(button),
@@ -681,6 +1020,18 @@ void main_create_window(void)
 
 int main(int argc, char **argv)
 {
+    TimelapseCallbacks callbacks = {
+        main_snapshot_queued,
+        main_snapshot_saved,
+        main_timelapse_finished
+    };
+
+    /* no display needed, do not even initialize gtk */
+    if (argc > 1 && strcmp(argv[1], "--headless") == 0)
+        return headless_main(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--render") == 0)
+        return render_main(argc, argv);
+
     gtk_init(&argc, &argv);
     setlocale(LC_ALL, "");
     setlocale(LC_NUMERIC, "C");
@@ -694,15 +1045,22 @@ int main(int argc, char **argv)
     last_time = start_time;
     running_time = 0;
 
+    trace_init();
     main_read_config();
     
     camera_live_view = camera_new();
+    timelapse = timelapse_new(camera_live_view);
+    timelapse_set_callbacks(timelapse, &callbacks, NULL);
+    timelapse_apply_config(timelapse, &current_config);
     main_create_window();
+    main_update_encoder_stats();
+    g_unix_signal_add(SIGUSR1, main_trigger_signal, NULL);
 
     gtk_main();
 
     main_write_config();
     main_cleanup();
+    trace_close();
 
     return 0;
 }
@@ -0,0 +1,527 @@
+#include "render.h"
+#include "timelapse.h"
+#include "convert.h"
+#include "filename.h"
+#include "jpegenc.h"
+#include "sequence.h"
+#include "writer.h"
+#include "trace.h"
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+
+/* frames decoded ahead of the encoder, per thread */
+#define RENDER_READ_AHEAD 2
+/* frames waiting in the appsrc before pushing blocks */
+#define RENDER_QUEUE_FRAMES 4
+
+typedef struct {
+    guint64 number;
+    Frame *frame; /* NULL: missing or broken */
+    gboolean done;
+} RenderSlot;
+
+struct _Render {
+    gchar *pattern;
+    gchar *output;
+    gchar *tmpname; /* written by the filesink, renamed to output when done */
+    RenderOptions options;
+    gint fps_n;
+    gint fps_d;
+
+    GstElement *pipeline;
+    GstElement *src;
+    guint bus_watch_id;
+
+    /* frame number % n_slots is decoded into slots[] by the pool, the render
+     * thread hands them to the appsrc in order */
+    GThreadPool *pool;
+    FramePool *frame_pool;
+    FramePool *scale_pool;
+    RenderSlot *slots;
+    guint n_slots;
+    GThread *thread;
+
+    GMutex lock;
+    GCond cond;
+    gboolean cancelled;
+    guint64 total;
+    guint64 done;
+    guint notify_id;
+    gboolean finished;
+
+    RenderCallbacks callbacks;
+    gpointer userdata;
+};
+
+void render_options_init(RenderOptions *options)
+{
+    g_return_if_fail(options != NULL);
+
+    memset(options, 0, sizeof(RenderOptions));
+    options->fps = 25;
+}
+
+const gchar *render_get_muxer(const gchar *output)
+{
+    const gchar *ext = output ? strrchr(output, '.') : NULL;
+
+    if (ext == NULL)
+        return "matroskamux";
+    if (g_ascii_strcasecmp(ext, ".mp4") == 0)
+        return "mp4mux";
+    if (g_ascii_strcasecmp(ext, ".mov") == 0)
+        return "qtmux";
+    if (g_ascii_strcasecmp(ext, ".avi") == 0)
+        return "avimux";
+    return "matroskamux";
+}
+
+/* in the main loop, with the last progress of the render thread */
+static gboolean render_notify(Render *render)
+{
+    guint64 done;
+
+    g_mutex_lock(&render->lock);
+    render->notify_id = 0;
+    done = render->done;
+    g_mutex_unlock(&render->lock);
+
+    if (render->callbacks.progress)
+        render->callbacks.progress(render, done, render->total, render->userdata);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void render_set_done(Render *render, guint64 done)
+{
+    g_mutex_lock(&render->lock);
+    render->done = done;
+    if (render->notify_id == 0)
+        render->notify_id = g_idle_add((GSourceFunc)render_notify, render);
+    g_mutex_unlock(&render->lock);
+}
+
+/* in the pool; reads and decodes one file, gaps in the sequence are expected */
+static void render_decode(RenderSlot *slot, Render *render)
+{
+    gchar *filename = filename_generate(render->pattern, slot->number);
+    Frame *jpeg, *frame = NULL;
+    GError *err = NULL;
+    gchar *data;
+    gsize size;
+    gint64 start = TRACE_BEGIN();
+
+    if (g_file_get_contents(filename, &data, &size, &err)) {
+        jpeg = frame_new_for_data(FRAME_FORMAT_JPEG, 0, 0, (guchar *)data, size, g_free, data);
+        if ((frame = convert_frame_to_argb(jpeg, 0, render->frame_pool)) == NULL)
+            g_printerr("Could not decode %s\n", filename);
+        frame_unref(jpeg);
+    }
+    else {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_printerr("Could not read %s: %s\n", filename, err->message);
+        g_clear_error(&err);
+    }
+    g_free(filename);
+
+    TRACE_END("render", "decode", start);
+
+    g_mutex_lock(&render->lock);
+    slot->frame = frame;
+    slot->done = TRUE;
+    g_cond_broadcast(&render->cond);
+    g_mutex_unlock(&render->lock);
+}
+
+/* the size of the first frame is the size of the video */
+static void render_set_caps(Render *render, guint width, guint height)
+{
+    GstCaps *caps = gst_caps_new_simple("video/x-raw-rgb",
+            "bpp", G_TYPE_INT, 32,
+            "depth", G_TYPE_INT, 24,
+            "endianness", G_TYPE_INT, G_BIG_ENDIAN,
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+            /* native ARGB32 is BGRx in memory */
+            "red_mask", G_TYPE_INT, 0x0000ff00,
+            "green_mask", G_TYPE_INT, 0x00ff0000,
+            "blue_mask", G_TYPE_INT, 0xff000000,
+#else
+            "red_mask", G_TYPE_INT, 0x00ff0000,
+            "green_mask", G_TYPE_INT, 0x0000ff00,
+            "blue_mask", G_TYPE_INT, 0x000000ff,
+#endif
+            "width", G_TYPE_INT, width,
+            "height", G_TYPE_INT, height,
+            "framerate", GST_TYPE_FRACTION, render->fps_n, render->fps_d,
+            NULL);
+
+    gst_app_src_set_caps(GST_APP_SRC(render->src), caps);
+    gst_caps_unref(caps);
+
+    gst_app_src_set_max_bytes(GST_APP_SRC(render->src),
+            (guint64)RENDER_QUEUE_FRAMES * width * height * 4);
+}
+
+/* the frames from the pool in order, into the appsrc; pushing blocks while
+ * the encoder is behind, and the pool is only given new frames after that */
+static gpointer render_thread(Render *render)
+{
+    RenderSlot *slot;
+    Frame *frame, *scaled;
+    GstBuffer *buffer;
+    GstClockTime timestamp;
+    guint64 number, next = 0, pushed = 0;
+    guint width = 0, height = 0;
+    GError *err;
+
+    for (number = 0; number < render->total; ++number) {
+        g_mutex_lock(&render->lock);
+        while (next < render->total && next < number + render->n_slots) {
+            slot = &render->slots[next % render->n_slots];
+            slot->number = next++;
+            slot->frame = NULL;
+            slot->done = FALSE;
+            g_thread_pool_push(render->pool, slot, NULL);
+        }
+
+        slot = &render->slots[number % render->n_slots];
+        while (!slot->done && !render->cancelled)
+            g_cond_wait(&render->cond, &render->lock);
+        if (render->cancelled) {
+            g_mutex_unlock(&render->lock);
+            return NULL;
+        }
+        frame = slot->frame;
+        slot->frame = NULL;
+        g_mutex_unlock(&render->lock);
+
+        if (frame == NULL) {
+            render_set_done(render, number + 1);
+            continue;
+        }
+
+        if (width == 0) {
+            width = frame->width;
+            height = frame->height;
+            render_set_caps(render, width, height);
+        }
+        else if (frame->width != width || frame->height != height) {
+            scaled = convert_scale_argb(frame, width, height, render->scale_pool);
+            frame_unref(frame);
+            frame = scaled;
+        }
+
+        buffer = gst_buffer_new_and_alloc(frame->size);
+        memcpy(GST_BUFFER_DATA(buffer), frame->data, frame->size);
+        frame_unref(frame);
+
+        timestamp = gst_util_uint64_scale(pushed, GST_SECOND * render->fps_d, render->fps_n);
+        GST_BUFFER_TIMESTAMP(buffer) = timestamp;
+        GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale(pushed + 1,
+                GST_SECOND * render->fps_d, render->fps_n) - timestamp;
+        GST_BUFFER_OFFSET(buffer) = pushed++;
+
+        /* not ok once the pipeline is stopped */
+        if (gst_app_src_push_buffer(GST_APP_SRC(render->src), buffer) != GST_FLOW_OK)
+            return NULL;
+
+        render_set_done(render, number + 1);
+    }
+
+    if (pushed == 0) {
+        err = g_error_new(GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_NOT_FOUND,
+                "No frames of %s could be read", render->pattern);
+        gst_element_post_message(render->src,
+                gst_message_new_error(GST_OBJECT(render->src), err, NULL));
+        g_error_free(err);
+        return NULL;
+    }
+
+    gst_app_src_end_of_stream(GST_APP_SRC(render->src));
+
+    return NULL;
+}
+
+/* stopping the pipeline also wakes the render thread if it waits in the appsrc */
+static void render_stop_thread(Render *render)
+{
+    g_mutex_lock(&render->lock);
+    render->cancelled = TRUE;
+    g_cond_broadcast(&render->cond);
+    g_mutex_unlock(&render->lock);
+
+    if (render->pipeline)
+        gst_element_set_state(render->pipeline, GST_STATE_NULL);
+
+    if (render->thread) {
+        g_thread_join(render->thread);
+        render->thread = NULL;
+    }
+}
+
+static void render_finish(Render *render, gboolean success)
+{
+    render_stop_thread(render);
+
+    g_mutex_lock(&render->lock);
+    if (render->notify_id) {
+        g_source_remove(render->notify_id);
+        render->notify_id = 0;
+    }
+    g_mutex_unlock(&render->lock);
+
+    render->finished = TRUE;
+    if (success && g_rename(render->tmpname, render->output) != 0) {
+        g_printerr("Could not rename %s to %s: %s\n", render->tmpname, render->output,
+                g_strerror(errno));
+        success = FALSE;
+    }
+    if (!success)
+        g_unlink(render->tmpname);
+
+    if (success && render->callbacks.progress)
+        render->callbacks.progress(render, render->total, render->total, render->userdata);
+    if (render->callbacks.finished)
+        render->callbacks.finished(render, success, render->userdata);
+}
+
+static gboolean render_bus_watch(GstBus *bus, GstMessage *message, Render *render)
+{
+    GError *err;
+    gchar *debug_info;
+
+    switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_EOS:
+            render->bus_watch_id = 0;
+            render_finish(render, TRUE);
+            return G_SOURCE_REMOVE;
+        case GST_MESSAGE_ERROR:
+            gst_message_parse_error(message, &err, &debug_info);
+            g_printerr("Error received from element %s: %s\n",
+                    GST_OBJECT_NAME(message->src), err->message);
+            g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
+            g_clear_error(&err);
+            g_free(debug_info);
+
+            render->bus_watch_id = 0;
+            render_finish(render, FALSE);
+            return G_SOURCE_REMOVE;
+        default:
+            return G_SOURCE_CONTINUE;
+    }
+}
+
+Render *render_start(const gchar *pattern, const gchar *output, const RenderOptions *options,
+        const RenderCallbacks *callbacks, gpointer userdata)
+{
+    g_return_val_if_fail(pattern != NULL, NULL);
+    g_return_val_if_fail(output != NULL, NULL);
+
+    Render *render;
+    GstElement *sink;
+    GstBus *bus;
+    GError *err = NULL;
+    gchar *description;
+    guint threads;
+
+    if (!jpegenc_handles_filename(pattern)) {
+        g_printerr("Only JPEG frames can be rendered, not %s\n", pattern);
+        return NULL;
+    }
+
+    gst_init(NULL, NULL);
+
+    render = g_malloc0(sizeof(Render));
+    render->pattern = g_strdup(pattern);
+    render->output = g_strdup(output);
+    render->tmpname = writer_get_temp_filename(output);
+    render_options_init(&render->options);
+    if (options) {
+        render->options = *options;
+        if (render->options.fps <= 0)
+            render->options.fps = 25;
+    }
+    render->options.encoder = g_strdup(options && options->encoder ? options->encoder : "x264enc");
+    gst_util_double_to_fraction(render->options.fps, &render->fps_n, &render->fps_d);
+    if (callbacks)
+        render->callbacks = *callbacks;
+    render->userdata = userdata;
+    g_mutex_init(&render->lock);
+    g_cond_init(&render->cond);
+
+    description = g_strdup_printf("appsrc name=src ! ffmpegcolorspace ! %s ! %s ! "
+            "filesink name=sink", render->options.encoder, render_get_muxer(output));
+    render->pipeline = gst_parse_launch(description, &err);
+    g_free(description);
+    if (err) {
+        g_printerr("Could not create the encoder %s: %s\n", render->options.encoder,
+                err->message);
+        g_clear_error(&err);
+        render_destroy(render);
+        return NULL;
+    }
+
+    render->src = gst_bin_get_by_name(GST_BIN(render->pipeline), "src");
+    g_object_set(G_OBJECT(render->src), "format", GST_FORMAT_TIME, "block", TRUE, NULL);
+    sink = gst_bin_get_by_name(GST_BIN(render->pipeline), "sink");
+    g_object_set(G_OBJECT(sink), "location", render->tmpname, NULL);
+    gst_object_unref(sink);
+
+    bus = gst_element_get_bus(render->pipeline);
+    render->bus_watch_id = gst_bus_add_watch(bus, (GstBusFunc)render_bus_watch, render);
+    gst_object_unref(bus);
+
+    threads = render->options.threads ? render->options.threads : g_get_num_processors();
+    render->n_slots = threads * RENDER_READ_AHEAD;
+    render->slots = g_new0(RenderSlot, render->n_slots);
+    render->frame_pool = frame_pool_new(render->n_slots);
+    render->scale_pool = frame_pool_new(1);
+    render->pool = g_thread_pool_new((GFunc)render_decode, render, threads, FALSE, &err);
+    if (err) {
+        g_printerr("Could not create decoding threads: %s\n", err->message);
+        g_clear_error(&err);
+        render_destroy(render);
+        return NULL;
+    }
+
+    /* with an index this does not read the whole directory */
+    render->total = sequence_find_next(pattern);
+
+    if (gst_element_set_state(render->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Could not start rendering to %s\n", output);
+        render_destroy(render);
+        return NULL;
+    }
+
+    render->thread = g_thread_new("render", (GThreadFunc)render_thread, render);
+
+    return render;
+}
+
+void render_destroy(Render *render)
+{
+    guint j;
+
+    if (render == NULL)
+        return;
+
+    if (render->bus_watch_id)
+        g_source_remove(render->bus_watch_id);
+    render_stop_thread(render);
+
+    /* drops the frames not started yet */
+    if (render->pool)
+        g_thread_pool_free(render->pool, TRUE, TRUE);
+    if (render->notify_id)
+        g_source_remove(render->notify_id);
+
+    for (j = 0; j < render->n_slots; ++j)
+        frame_unref(render->slots[j].frame);
+    g_free(render->slots);
+    frame_pool_destroy(render->frame_pool);
+    frame_pool_destroy(render->scale_pool);
+
+    if (!render->finished)
+        g_unlink(render->tmpname);
+
+    if (render->src)
+        gst_object_unref(render->src);
+    if (render->pipeline)
+        gst_object_unref(render->pipeline);
+
+    g_mutex_clear(&render->lock);
+    g_cond_clear(&render->cond);
+    g_free(render->options.encoder);
+    g_free(render->pattern);
+    g_free(render->output);
+    g_free(render->tmpname);
+    g_free(render);
+}
+
+static GMainLoop *render_loop;
+static gboolean render_success;
+
+static void render_main_progress(Render *render, guint64 done, guint64 total, gpointer userdata)
+{
+    g_printerr("\r%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " frames", done, total);
+}
+
+static void render_main_finished(Render *render, gboolean success, gpointer userdata)
+{
+    g_printerr("\n");
+    render_success = success;
+    g_main_loop_quit(render_loop);
+}
+
+static gboolean render_main_signal(gpointer userdata)
+{
+    g_main_loop_quit(render_loop);
+    return G_SOURCE_REMOVE;
+}
+
+int render_main(int argc, char **argv)
+{
+    RenderCallbacks callbacks = {
+        render_main_progress,
+        render_main_finished
+    };
+    TimelapseConfig config;
+    GKeyFile *kf;
+    GError *err = NULL;
+    Render *render;
+    gchar *path;
+
+    if (argc > 1 && strcmp(argv[1], "--render") == 0) {
+        --argc;
+        ++argv;
+    }
+    if (argc < 2 || argc > 3) {
+        g_printerr("usage: %s [--render] output [config file]\n", argv[0]);
+        return 2;
+    }
+
+    path = argc > 2 ? g_strdup(argv[2]) : timelapse_config_get_default_path();
+    kf = g_key_file_new();
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, &err)) {
+        g_printerr("Could not read %s: %s\n", path, err->message);
+        g_clear_error(&err);
+        g_key_file_free(kf);
+        g_free(path);
+        return 1;
+    }
+    g_free(path);
+
+    timelapse_config_init(&config);
+    timelapse_config_load(&config, kf, "Status");
+    g_key_file_free(kf);
+
+    if (config.archive) {
+        g_printerr("The frames are in an archive, extract them with timelapse-extract first\n");
+        timelapse_config_clear(&config);
+        return 1;
+    }
+
+    trace_init();
+
+    render_loop = g_main_loop_new(NULL, FALSE);
+    render = render_start(config.filename, argv[1], &config.render, &callbacks, NULL);
+    if (render) {
+        g_unix_signal_add(SIGINT, render_main_signal, NULL);
+        g_unix_signal_add(SIGTERM, render_main_signal, NULL);
+        g_main_loop_run(render_loop);
+        /* removes the partial video if interrupted */
+        render_destroy(render);
+    }
+    g_main_loop_unref(render_loop);
+
+    timelapse_config_clear(&config);
+    trace_close();
+
+    return render_success ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <glib.h>
+
+/* Turns a captured sequence (frame0000.jpeg, frame0001.jpeg, ...) into a
+ * video. The frames are read and decoded by a pool of threads a few frames
+ * ahead of the encoder, so only that many are in memory at any time; missing
+ * numbers are skipped. */
+
+typedef struct {
+    gdouble fps;          /* frames per second of the video */
+    gchar *encoder;       /* gst-launch description, NULL: x264enc */
+    guint threads;        /* decoding threads, 0: one per processor */
+} RenderOptions;
+
+typedef struct _Render Render;
+
+/* render, frames done, frames in the sequence, userdata */
+typedef void (*RENDER_PROGRESS_CALLBACK)(Render *, guint64, guint64, gpointer);
+/* render, success, userdata; the video is complete, or has been removed on failure */
+typedef void (*RENDER_FINISHED_CALLBACK)(Render *, gboolean, gpointer);
+
+typedef struct {
+    RENDER_PROGRESS_CALLBACK progress;
+    RENDER_FINISHED_CALLBACK finished;
+} RenderCallbacks;
+
+void render_options_init(RenderOptions *options);
+
+/* muxer for the extension of output: matroskamux (.mkv and everything else),
+ * mp4mux (.mp4), qtmux (.mov) or avimux (.avi) */
+const gchar *render_get_muxer(const gchar *output);
+
+/* renders the JPEG files of pattern (a name of the sequence, as filename in
+ * the config) to output in the background, the callbacks are called from the
+ * main loop; NULL if the pipeline could not be built */
+Render *render_start(const gchar *pattern, const gchar *output, const RenderOptions *options,
+        const RenderCallbacks *callbacks, gpointer userdata);
+/* stops, removes the partial video and frees render; no callback is called
+ * afterwards, also to be used once finished was called (even from within it) */
+void render_destroy(Render *render);
+
+/* usage: --render output [config file]; renders the sequence of filename
+ * from the [Status] group, with render-fps and render-encoder */
+int render_main(int argc, char **argv);
@@ -0,0 +1,122 @@
+#include "ring.h"
+
+typedef struct {
+    Frame *frame;
+    gint64 timestamp;
+} RingEntry;
+
+struct _Ring {
+    GMutex lock;
+    GQueue entries;
+    gsize bytes;
+    gint64 max_age;
+    gsize max_bytes;
+};
+
+Ring *ring_new(gint64 max_age, gsize max_bytes)
+{
+    Ring *ring = g_malloc0(sizeof(Ring));
+
+    g_mutex_init(&ring->lock);
+    g_queue_init(&ring->entries);
+    ring->max_age = max_age;
+    ring->max_bytes = max_bytes;
+
+    return ring;
+}
+
+static void ring_entry_free(RingEntry *entry)
+{
+    frame_unref(entry->frame);
+    g_slice_free(RingEntry, entry);
+}
+
+/* called with the lock held */
+static void ring_drop_oldest(Ring *ring)
+{
+    RingEntry *entry = g_queue_pop_head(&ring->entries);
+
+    ring->bytes -= entry->frame->size;
+    ring_entry_free(entry);
+}
+
+void ring_destroy(Ring *ring)
+{
+    if (ring == NULL)
+        return;
+
+    while (ring->entries.length)
+        ring_drop_oldest(ring);
+    g_mutex_clear(&ring->lock);
+    g_free(ring);
+}
+
+void ring_push(Ring *ring, Frame *frame, gint64 timestamp)
+{
+    g_return_if_fail(ring != NULL);
+    g_return_if_fail(frame != NULL);
+
+    RingEntry *entry = g_slice_new(RingEntry);
+    RingEntry *oldest;
+
+    entry->frame = frame;
+    entry->timestamp = timestamp;
+
+    g_mutex_lock(&ring->lock);
+    g_queue_push_tail(&ring->entries, entry);
+    ring->bytes += frame->size;
+
+    /* the newest frame always stays, even if it alone exceeds max_bytes */
+    while (ring->entries.length > 1) {
+        oldest = g_queue_peek_head(&ring->entries);
+        if (ring->bytes <= ring->max_bytes && timestamp - oldest->timestamp <= ring->max_age)
+            break;
+        ring_drop_oldest(ring);
+    }
+    g_mutex_unlock(&ring->lock);
+}
+
+GPtrArray *ring_take(Ring *ring)
+{
+    g_return_val_if_fail(ring != NULL, NULL);
+
+    GPtrArray *frames;
+    RingEntry *entry;
+
+    g_mutex_lock(&ring->lock);
+    frames = g_ptr_array_new_full(ring->entries.length, (GDestroyNotify)frame_unref);
+    while ((entry = g_queue_pop_head(&ring->entries)) != NULL) {
+        g_ptr_array_add(frames, entry->frame);
+        g_slice_free(RingEntry, entry);
+    }
+    ring->bytes = 0;
+    g_mutex_unlock(&ring->lock);
+
+    return frames;
+}
+
+guint ring_get_length(Ring *ring)
+{
+    g_return_val_if_fail(ring != NULL, 0);
+
+    guint length;
+
+    g_mutex_lock(&ring->lock);
+    length = ring->entries.length;
+    g_mutex_unlock(&ring->lock);
+
+    return length;
+}
+
+gsize ring_get_bytes(Ring *ring)
+{
+    g_return_val_if_fail(ring != NULL, 0);
+
+    gsize bytes;
+
+    g_mutex_lock(&ring->lock);
+    bytes = ring->bytes;
+    g_mutex_unlock(&ring->lock);
+
+    return bytes;
+}
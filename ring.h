@@ -0,0 +1,19 @@
+#pragma once
+
+#include <glib.h>
+#include "frame.h"
+
+typedef struct _Ring Ring;
+
+/* the compressed frames of the last max_age µs, but no more than max_bytes;
+ * the oldest frames are dropped first; all functions are thread safe */
+Ring *ring_new(gint64 max_age, gsize max_bytes);
+void ring_destroy(Ring *ring);
+
+/* takes the reference to frame, timestamp is the monotonic time in µs */
+void ring_push(Ring *ring, Frame *frame, gint64 timestamp);
+/* removes all frames and returns them oldest first, free with g_ptr_array_unref */
+GPtrArray *ring_take(Ring *ring);
+
+guint ring_get_length(Ring *ring);
+gsize ring_get_bytes(Ring *ring);
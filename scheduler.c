@@ -0,0 +1,198 @@
+#include "scheduler.h"
+#include <string.h>
+
+struct _Scheduler {
+    GSource *source;
+    gint64 interval;
+    gint64 next_deadline;
+    SchedulerCatchupPolicy policy;
+
+    SCHEDULER_TICK_CALLBACK callback;
+    gpointer userdata;
+
+    guint64 missed;
+    guint64 jitter[SCHEDULER_JITTER_BUCKETS];
+};
+
+typedef struct {
+    GSource source;
+    Scheduler *scheduler;
+} SchedulerSource;
+
+static void scheduler_record_jitter(Scheduler *scheduler, gint64 late)
+{
+    guint bucket = 0;
+    gint64 limit = 1000;
+
+    while (bucket < SCHEDULER_JITTER_BUCKETS - 1 && late >= limit) {
+        ++bucket;
+        limit <<= 1;
+    }
+
+    ++scheduler->jitter[bucket];
+}
+
+static gboolean scheduler_source_dispatch(GSource *source, GSourceFunc callback, gpointer userdata)
+{
+    Scheduler *scheduler = ((SchedulerSource *)source)->scheduler;
+    gint64 now = g_get_monotonic_time();
+    gint64 deadline = scheduler->next_deadline;
+    gint64 n;
+
+    scheduler_record_jitter(scheduler, now - deadline);
+
+    scheduler->next_deadline += scheduler->interval;
+    if (scheduler->next_deadline <= now) {
+        switch (scheduler->policy) {
+            case SCHEDULER_CATCHUP_BURST:
+                /* next_deadline is already due, we get dispatched again right away */
+                break;
+            case SCHEDULER_CATCHUP_SHIFT:
+                ++scheduler->missed;
+                scheduler->next_deadline = now + scheduler->interval;
+                break;
+            case SCHEDULER_CATCHUP_SKIP:
+            default:
+                n = (now - deadline) / scheduler->interval;
+                scheduler->missed += n;
+                scheduler->next_deadline = deadline + (n + 1) * scheduler->interval;
+                break;
+        }
+    }
+
+    if (!scheduler->callback(deadline, scheduler->userdata))
+        return G_SOURCE_REMOVE;
+
+    /* the callback may have stopped us */
+    if (scheduler->source != source)
+        return G_SOURCE_REMOVE;
+
+    g_source_set_ready_time(source, scheduler->next_deadline);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs scheduler_source_funcs = {
+    NULL,
+    NULL,
+    scheduler_source_dispatch,
+    NULL
+};
+
+Scheduler *scheduler_new(gint64 interval, SchedulerCatchupPolicy policy)
+{
+    g_return_val_if_fail(interval > 0, NULL);
+
+    Scheduler *scheduler = g_malloc0(sizeof(Scheduler));
+    scheduler->interval = interval;
+    scheduler->policy = policy;
+
+    return scheduler;
+}
+
+void scheduler_start(Scheduler *scheduler, GMainContext *context, gint64 first_deadline,
+        SCHEDULER_TICK_CALLBACK cb, gpointer userdata)
+{
+    g_return_if_fail(scheduler != NULL);
+    g_return_if_fail(cb != NULL);
+
+    scheduler_stop(scheduler);
+
+    scheduler->callback = cb;
+    scheduler->userdata = userdata;
+    scheduler->next_deadline = first_deadline;
+    scheduler->missed = 0;
+    memset(scheduler->jitter, 0, sizeof(scheduler->jitter));
+
+    scheduler->source = g_source_new(&scheduler_source_funcs, sizeof(SchedulerSource));
+    ((SchedulerSource *)scheduler->source)->scheduler = scheduler;
+    g_source_set_priority(scheduler->source, G_PRIORITY_HIGH);
+    g_source_set_ready_time(scheduler->source, first_deadline);
+    g_source_attach(scheduler->source, context);
+}
+
+void scheduler_stop(Scheduler *scheduler)
+{
+    g_return_if_fail(scheduler != NULL);
+
+    if (scheduler->source) {
+        g_source_destroy(scheduler->source);
+        g_source_unref(scheduler->source);
+        scheduler->source = NULL;
+    }
+}
+
+void scheduler_destroy(Scheduler *scheduler)
+{
+    if (scheduler == NULL)
+        return;
+
+    scheduler_stop(scheduler);
+    g_free(scheduler);
+}
+
+gint64 scheduler_get_next_deadline(Scheduler *scheduler)
+{
+    g_return_val_if_fail(scheduler != NULL, 0);
+
+    return scheduler->next_deadline;
+}
+
+guint64 scheduler_get_missed(Scheduler *scheduler)
+{
+    g_return_val_if_fail(scheduler != NULL, 0);
+
+    return scheduler->missed;
+}
+
+void scheduler_get_jitter_histogram(Scheduler *scheduler, guint64 *buckets)
+{
+    g_return_if_fail(scheduler != NULL);
+    g_return_if_fail(buckets != NULL);
+
+    memcpy(buckets, scheduler->jitter, sizeof(scheduler->jitter));
+}
+
+gchar *scheduler_format_jitter_histogram(Scheduler *scheduler)
+{
+    g_return_val_if_fail(scheduler != NULL, NULL);
+
+    GString *str = g_string_new(NULL);
+    guint j;
+
+    for (j = 0; j < SCHEDULER_JITTER_BUCKETS; ++j) {
+        if (scheduler->jitter[j] == 0)
+            continue;
+        if (j == SCHEDULER_JITTER_BUCKETS - 1)
+            g_string_append_printf(str, ">=%ums: %" G_GUINT64_FORMAT "\n",
+                    1u << (j - 1), scheduler->jitter[j]);
+        else
+            g_string_append_printf(str, "<%ums: %" G_GUINT64_FORMAT "\n",
+                    1u << j, scheduler->jitter[j]);
+    }
+    g_string_append_printf(str, "missed: %" G_GUINT64_FORMAT "\n", scheduler->missed);
+
+    return g_string_free(str, FALSE);
+}
+
+SchedulerCatchupPolicy scheduler_catchup_policy_from_string(const gchar *str)
+{
+    if (g_strcmp0(str, "burst") == 0)
+        return SCHEDULER_CATCHUP_BURST;
+    if (g_strcmp0(str, "shift") == 0)
+        return SCHEDULER_CATCHUP_SHIFT;
+    return SCHEDULER_CATCHUP_SKIP;
+}
+
+const gchar *scheduler_catchup_policy_to_string(SchedulerCatchupPolicy policy)
+{
+    switch (policy) {
+        case SCHEDULER_CATCHUP_BURST:
+            return "burst";
+        case SCHEDULER_CATCHUP_SHIFT:
+            return "shift";
+        case SCHEDULER_CATCHUP_SKIP:
+        default:
+            return "skip";
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <glib.h>
+
+/* what to do when a deadline has already passed on wakeup */
+typedef enum {
+    SCHEDULER_CATCHUP_SKIP = 0, /* drop missed deadlines, stay on the original grid */
+    SCHEDULER_CATCHUP_BURST,    /* fire once for every missed deadline */
+    SCHEDULER_CATCHUP_SHIFT     /* restart the grid at the late wakeup */
+} SchedulerCatchupPolicy;
+
+/* bucket i counts wakeups later than the deadline by less than 2^i ms,
+ * the last bucket takes everything above */
+#define SCHEDULER_JITTER_BUCKETS 12
+
+typedef struct _Scheduler Scheduler;
+
+/* deadline (monotonic time in µs), userdata; return FALSE to stop */
+typedef gboolean (*SCHEDULER_TICK_CALLBACK)(gint64, gpointer);
+
+Scheduler *scheduler_new(gint64 interval, SchedulerCatchupPolicy policy);
+void scheduler_start(Scheduler *scheduler, GMainContext *context, gint64 first_deadline,
+        SCHEDULER_TICK_CALLBACK cb, gpointer userdata);
+void scheduler_stop(Scheduler *scheduler);
+void scheduler_destroy(Scheduler *scheduler);
+
+gint64 scheduler_get_next_deadline(Scheduler *scheduler);
+guint64 scheduler_get_missed(Scheduler *scheduler);
+void scheduler_get_jitter_histogram(Scheduler *scheduler, guint64 *buckets);
+gchar *scheduler_format_jitter_histogram(Scheduler *scheduler);
+
+SchedulerCatchupPolicy scheduler_catchup_policy_from_string(const gchar *str);
+const gchar *scheduler_catchup_policy_to_string(SchedulerCatchupPolicy policy);
@@ -0,0 +1,191 @@
+#include "sequence.h"
+#include "filename.h"
+
+#include <string.h>
+
+/* with the index this many files beyond it may exist before we read the directory */
+#define SEQUENCE_PROBE_MAX (1 << 20)
+
+static gchar *sequence_index_path(const gchar *pattern)
+{
+    gchar *dir = g_path_get_dirname(pattern);
+    gchar *base = g_path_get_basename(pattern);
+    gchar *name = g_strdup_printf(".%s.seq", base);
+    gchar *path = g_build_filename(dir, name, NULL);
+
+    g_free(dir);
+    g_free(base);
+    g_free(name);
+
+    return path;
+}
+
+static gboolean sequence_exists(const gchar *pattern, guint64 offset)
+{
+    gchar *filename = filename_generate(pattern, offset);
+    gboolean result = g_file_test(filename, G_FILE_TEST_EXISTS);
+
+    g_free(filename);
+
+    return result;
+}
+
+/* name is prefix, at least width digits, suffix; returns the digits */
+static gboolean sequence_parse(const gchar *name, const gchar *prefix, gsize width,
+        const gchar *suffix, guint64 *number)
+{
+    gsize len = strlen(name);
+    gsize prefix_len = strlen(prefix);
+    gsize suffix_len = strlen(suffix);
+    gsize j;
+
+    if (len < prefix_len + width + suffix_len)
+        return FALSE;
+    if (strncmp(name, prefix, prefix_len) != 0 ||
+            strcmp(name + len - suffix_len, suffix) != 0)
+        return FALSE;
+    for (j = prefix_len; j < len - suffix_len; ++j) {
+        if (!g_ascii_isdigit(name[j]))
+            return FALSE;
+    }
+
+    *number = g_ascii_strtoull(name + prefix_len, NULL, 10);
+
+    return TRUE;
+}
+
+/* the slow way, every name in the directory */
+static guint64 sequence_scan(const gchar *pattern)
+{
+    gchar *dirname = g_path_get_dirname(pattern);
+    gchar *base = g_path_get_basename(pattern);
+    GError *err = NULL;
+    GDir *dir;
+    const gchar *name;
+    gchar *digits, *suffix, *prefix;
+    gsize width;
+    guint64 first, number, next = 0;
+
+    /* the same number filename_generate replaces */
+    suffix = strrchr(base, '.');
+    if (suffix == NULL || suffix == base)
+        suffix = base + strlen(base);
+    digits = suffix;
+    while (digits > base && g_ascii_isdigit(digits[-1]))
+        --digits;
+    width = suffix - digits;
+
+    if (width == 0 || (dir = g_dir_open(dirname, 0, &err)) == NULL) {
+        if (err) {
+            g_printerr("Could not read %s: %s\n", dirname, err->message);
+            g_clear_error(&err);
+        }
+        g_free(dirname);
+        g_free(base);
+        return 0;
+    }
+
+    prefix = g_strndup(base, digits - base);
+    first = g_ascii_strtoull(digits, NULL, 10);
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (sequence_parse(name, prefix, width, suffix, &number) &&
+                number >= first && number - first >= next)
+            next = number - first + 1;
+    }
+
+    g_dir_close(dir);
+    g_free(prefix);
+    g_free(dirname);
+    g_free(base);
+
+    return next;
+}
+
+guint64 sequence_find_next(const gchar *pattern)
+{
+    g_return_val_if_fail(pattern != NULL, 0);
+
+    gchar *path = sequence_index_path(pattern);
+    gchar *contents = NULL;
+    gchar *endptr;
+    gchar *first, *second;
+    guint64 next = 0, step, low, high, mid, floor;
+    gboolean indexed = FALSE;
+
+    /* without a number every offset is the same file */
+    first = filename_generate(pattern, 0);
+    second = filename_generate(pattern, 1);
+    if (g_strcmp0(first, second) == 0)
+        indexed = TRUE;
+    g_free(first);
+    g_free(second);
+    if (indexed)
+        return 0;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        next = g_ascii_strtoull(contents, &endptr, 10);
+        indexed = endptr != contents;
+    }
+    g_free(contents);
+    g_free(path);
+
+    if (!indexed)
+        return sequence_scan(pattern);
+
+    /* usually the index is ahead (see SEQUENCE_RESERVE), there may be gaps
+     * from dropped frames, so walk back to the last file that exists */
+    if (!sequence_exists(pattern, next)) {
+        floor = next > SEQUENCE_RESERVE ? next - SEQUENCE_RESERVE : 0;
+        while (next > floor && !sequence_exists(pattern, next - 1))
+            --next;
+        /* nothing within the reserve, the index does not fit the files
+         * (removed or moved), so it cannot tell where they end */
+        if (next == floor && floor > 0)
+            return sequence_scan(pattern);
+        return next;
+    }
+
+    /* files the index does not know about, e.g. from an older version;
+     * gallop past them and bisect the end */
+    low = next;
+    step = 1;
+    while (sequence_exists(pattern, low + step)) {
+        low += step;
+        if (low - next > SEQUENCE_PROBE_MAX)
+            return sequence_scan(pattern);
+        step <<= 1;
+    }
+    high = low + step;
+    /* low exists, high does not */
+    while (high - low > 1) {
+        mid = low + (high - low) / 2;
+        if (sequence_exists(pattern, mid))
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return high;
+}
+
+gboolean sequence_save(const gchar *pattern, guint64 next)
+{
+    g_return_val_if_fail(pattern != NULL, FALSE);
+
+    gchar *path = sequence_index_path(pattern);
+    gchar *contents = g_strdup_printf("%" G_GUINT64_FORMAT "\n", next);
+    GError *err = NULL;
+    gboolean result;
+
+    /* written to a temporary file and renamed, never half an index */
+    result = g_file_set_contents(path, contents, -1, &err);
+    if (!result) {
+        g_printerr("Error writing %s: %s\n", path, err->message);
+        g_clear_error(&err);
+    }
+
+    g_free(contents);
+    g_free(path);
+
+    return result;
+}
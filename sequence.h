@@ -0,0 +1,15 @@
+#pragma once
+
+#include <glib.h>
+
+/* the index may be ahead of the last file by this much: while capturing it
+ * is saved that far ahead, so it never falls behind the files on disk */
+#define SEQUENCE_RESERVE 1000
+
+/* offset (as for filename_generate) after the highest existing file of pattern,
+ * 0 if there is none; with an index only the files around it are checked,
+ * otherwise the whole directory is read */
+guint64 sequence_find_next(const gchar *pattern);
+/* no file of pattern has an offset of next or above, kept in a hidden
+ * file next to them (.frame0000.jpeg.seq) */
+gboolean sequence_save(const gchar *pattern, guint64 next);
@@ -0,0 +1,321 @@
+#include "stack.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#define STACK_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define STACK_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* smaller frames are not worth waking up other threads for */
+#define STACK_PARALLEL_MIN (1 << 20)
+#define STACK_MAX_THREADS 16
+
+typedef enum {
+    STACK_OP_ADD,
+    STACK_OP_FINISH
+} StackOp;
+
+typedef struct {
+    Stack *stack;
+    StackOp op;
+    const guchar *data;
+    guchar *dst;
+    gsize start;
+    gsize end;
+} StackChunk;
+
+struct _Stack {
+    StackMode mode;
+    guint depth;
+    gsize size;
+    guint count;
+
+    guint16 *sum;   /* mean */
+    guchar *frames; /* median, depth frames one after the other */
+
+    /* large frames are split into n_chunks parts, one is done by the caller */
+    GThreadPool *pool;
+    guint n_chunks;
+    GMutex lock;
+    GCond cond;
+    guint pending;
+};
+
+static void stack_add_range(guint16 *sum, const guchar *data, gsize n)
+{
+    gsize j = 0;
+
+#if defined(STACK_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v;
+
+    for ( ; j + 16 <= n; j += 16) {
+        v = _mm_loadu_si128((const __m128i *)(data + j));
+        _mm_storeu_si128((__m128i *)(sum + j),
+                _mm_add_epi16(_mm_loadu_si128((const __m128i *)(sum + j)),
+                    _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128((__m128i *)(sum + j + 8),
+                _mm_add_epi16(_mm_loadu_si128((const __m128i *)(sum + j + 8)),
+                    _mm_unpackhi_epi8(v, zero)));
+    }
+#elif defined(STACK_NEON)
+    uint8x16_t v;
+
+    for ( ; j + 16 <= n; j += 16) {
+        v = vld1q_u8(data + j);
+        vst1q_u16(sum + j, vaddw_u8(vld1q_u16(sum + j), vget_low_u8(v)));
+        vst1q_u16(sum + j + 8, vaddw_u8(vld1q_u16(sum + j + 8), vget_high_u8(v)));
+    }
+#endif
+
+    for ( ; j < n; ++j)
+        sum[j] += data[j];
+}
+
+static void stack_mean_range(guchar *dst, const guint16 *sum, gsize n, guint count)
+{
+    /* dividing by multiplying with the rounded up reciprocal is exact for 16 bit sums */
+    guint64 r = ((G_GUINT64_CONSTANT(1) << 32) + count - 1) / count;
+    guint32 half = count / 2;
+    gsize j;
+
+    for (j = 0; j < n; ++j)
+        dst[j] = ((sum[j] + half) * r) >> 32;
+}
+
+/* upper median of count bytes at each position, by an odd-even transposition sort */
+static void stack_median_range(guchar *dst, const guchar *frames, gsize size, guint count,
+        gsize start, gsize end)
+{
+    gsize j = start;
+    guint k, pass;
+
+#if defined(STACK_SSE2)
+    __m128i v[STACK_MAX_MEDIAN_FRAMES], lo;
+
+    for ( ; j + 16 <= end; j += 16) {
+        for (k = 0; k < count; ++k)
+            v[k] = _mm_loadu_si128((const __m128i *)(frames + k * size + j));
+        for (pass = 0; pass < count; ++pass) {
+            for (k = pass & 1; k + 1 < count; k += 2) {
+                lo = _mm_min_epu8(v[k], v[k + 1]);
+                v[k + 1] = _mm_max_epu8(v[k], v[k + 1]);
+                v[k] = lo;
+            }
+        }
+        _mm_storeu_si128((__m128i *)(dst + j), v[count / 2]);
+    }
+#elif defined(STACK_NEON)
+    uint8x16_t v[STACK_MAX_MEDIAN_FRAMES], lo;
+
+    for ( ; j + 16 <= end; j += 16) {
+        for (k = 0; k < count; ++k)
+            v[k] = vld1q_u8(frames + k * size + j);
+        for (pass = 0; pass < count; ++pass) {
+            for (k = pass & 1; k + 1 < count; k += 2) {
+                lo = vminq_u8(v[k], v[k + 1]);
+                v[k + 1] = vmaxq_u8(v[k], v[k + 1]);
+                v[k] = lo;
+            }
+        }
+        vst1q_u8(dst + j, v[count / 2]);
+    }
+#endif
+
+    guchar t[STACK_MAX_MEDIAN_FRAMES], tmp;
+    guint m;
+
+    for ( ; j < end; ++j) {
+        for (k = 0; k < count; ++k) {
+            tmp = frames[k * size + j];
+            for (m = k; m > 0 && t[m - 1] > tmp; --m)
+                t[m] = t[m - 1];
+            t[m] = tmp;
+        }
+        dst[j] = t[count / 2];
+    }
+}
+
+static void stack_process(StackChunk *chunk)
+{
+    Stack *stack = chunk->stack;
+    gsize n = chunk->end - chunk->start;
+
+    if (n == 0)
+        return;
+
+    if (chunk->op == STACK_OP_ADD) {
+        if (stack->mode == STACK_MEAN)
+            stack_add_range(stack->sum + chunk->start, chunk->data + chunk->start, n);
+        else
+            memcpy(stack->frames + stack->count * stack->size + chunk->start,
+                    chunk->data + chunk->start, n);
+    }
+    else {
+        if (stack->mode == STACK_MEAN)
+            stack_mean_range(chunk->dst + chunk->start, stack->sum + chunk->start, n,
+                    stack->count);
+        else
+            stack_median_range(chunk->dst, stack->frames, stack->size, stack->count,
+                    chunk->start, chunk->end);
+    }
+}
+
+static void stack_worker(StackChunk *chunk, Stack *stack)
+{
+    stack_process(chunk);
+
+    g_mutex_lock(&stack->lock);
+    if (--stack->pending == 0)
+        g_cond_signal(&stack->cond);
+    g_mutex_unlock(&stack->lock);
+}
+
+static void stack_run(Stack *stack, StackOp op, const guchar *data, guchar *dst)
+{
+    StackChunk chunks[STACK_MAX_THREADS];
+    guint n = stack->pool ? stack->n_chunks : 1;
+    /* whole cache lines for every thread */
+    gsize step = (stack->size / n + 63) & ~(gsize)63;
+    guint j;
+
+    for (j = 0; j < n; ++j) {
+        chunks[j].stack = stack;
+        chunks[j].op = op;
+        chunks[j].data = data;
+        chunks[j].dst = dst;
+        chunks[j].start = MIN(j * step, stack->size);
+        chunks[j].end = j + 1 == n ? stack->size : MIN((j + 1) * step, stack->size);
+    }
+
+    stack->pending = n - 1;
+    for (j = 1; j < n; ++j)
+        g_thread_pool_push(stack->pool, &chunks[j], NULL);
+
+    stack_process(&chunks[0]);
+
+    g_mutex_lock(&stack->lock);
+    while (stack->pending)
+        g_cond_wait(&stack->cond, &stack->lock);
+    g_mutex_unlock(&stack->lock);
+}
+
+Stack *stack_new(StackMode mode, guint depth, gsize size)
+{
+    g_return_val_if_fail(size > 0, NULL);
+
+    Stack *stack = g_malloc0(sizeof(Stack));
+    guint max_depth = mode == STACK_MEDIAN ? STACK_MAX_MEDIAN_FRAMES : STACK_MAX_FRAMES;
+
+    stack->mode = mode;
+    stack->depth = CLAMP(depth, 1, max_depth);
+    stack->size = size;
+
+    if (mode == STACK_MEDIAN)
+        stack->frames = g_malloc(stack->depth * size);
+    else
+        stack->sum = g_malloc0(sizeof(guint16) * size);
+
+    g_mutex_init(&stack->lock);
+    g_cond_init(&stack->cond);
+
+    stack->n_chunks = MIN(g_get_num_processors(), STACK_MAX_THREADS);
+    if (size >= STACK_PARALLEL_MIN && stack->n_chunks > 1)
+        stack->pool = g_thread_pool_new((GFunc)stack_worker, stack, stack->n_chunks - 1,
+                FALSE, NULL);
+
+    return stack;
+}
+
+void stack_destroy(Stack *stack)
+{
+    if (stack == NULL)
+        return;
+
+    if (stack->pool)
+        g_thread_pool_free(stack->pool, FALSE, TRUE);
+    g_mutex_clear(&stack->lock);
+    g_cond_clear(&stack->cond);
+    g_free(stack->sum);
+    g_free(stack->frames);
+    g_free(stack);
+}
+
+StackMode stack_get_mode(Stack *stack)
+{
+    g_return_val_if_fail(stack != NULL, STACK_MEAN);
+
+    return stack->mode;
+}
+
+guint stack_get_depth(Stack *stack)
+{
+    g_return_val_if_fail(stack != NULL, 0);
+
+    return stack->depth;
+}
+
+gsize stack_get_size(Stack *stack)
+{
+    g_return_val_if_fail(stack != NULL, 0);
+
+    return stack->size;
+}
+
+guint stack_add(Stack *stack, const guchar *data)
+{
+    g_return_val_if_fail(stack != NULL, 0);
+    g_return_val_if_fail(data != NULL, 0);
+
+    /* full, the caller should have finished it */
+    if (stack->count >= stack->depth)
+        return stack->count;
+
+    stack_run(stack, STACK_OP_ADD, data, NULL);
+
+    return ++stack->count;
+}
+
+void stack_finish(Stack *stack, guchar *dst)
+{
+    g_return_if_fail(stack != NULL);
+    g_return_if_fail(dst != NULL);
+
+    if (stack->count)
+        stack_run(stack, STACK_OP_FINISH, NULL, dst);
+
+    stack_reset(stack);
+}
+
+void stack_reset(Stack *stack)
+{
+    g_return_if_fail(stack != NULL);
+
+    if (stack->sum && stack->count)
+        memset(stack->sum, 0, sizeof(guint16) * stack->size);
+    stack->count = 0;
+}
+
+StackMode stack_mode_from_string(const gchar *str)
+{
+    if (g_strcmp0(str, "median") == 0)
+        return STACK_MEDIAN;
+    return STACK_MEAN;
+}
+
+const gchar *stack_mode_to_string(StackMode mode)
+{
+    switch (mode) {
+        case STACK_MEDIAN:
+            return "median";
+        case STACK_MEAN:
+        default:
+            return "mean";
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <glib.h>
+
+/* how the frames of a stack are combined, byte by byte */
+typedef enum {
+    STACK_MEAN = 0,
+    STACK_MEDIAN   /* removes outliers (sensor noise, insects) but keeps every frame */
+} StackMode;
+
+/* the mean sums into 16 bit, the median sorts all frames in registers */
+#define STACK_MAX_FRAMES 256
+#define STACK_MAX_MEDIAN_FRAMES 15
+
+typedef struct _Stack Stack;
+
+/* combines depth frames of size bytes each; the data is treated as bytes,
+ * so any 8 bit format works (RGBA, planar YUV) */
+Stack *stack_new(StackMode mode, guint depth, gsize size);
+void stack_destroy(Stack *stack);
+
+StackMode stack_get_mode(Stack *stack);
+guint stack_get_depth(Stack *stack);
+gsize stack_get_size(Stack *stack);
+
+/* returns the number of frames collected so far */
+guint stack_add(Stack *stack, const guchar *data);
+/* writes the combination of the frames collected so far to dst and starts over */
+void stack_finish(Stack *stack, guchar *dst);
+void stack_reset(Stack *stack);
+
+StackMode stack_mode_from_string(const gchar *str);
+const gchar *stack_mode_to_string(StackMode mode);
@@ -0,0 +1,189 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+typedef struct {
+    gint64 *samples;
+    guint next;
+    guint n;
+    guint64 count;
+} StatsRing;
+
+struct _Stats {
+    GMutex lock;
+    guint window;
+    StatsRing stages[STATS_N_STAGES];
+};
+
+static const gchar *stats_stage_names[STATS_N_STAGES] = {
+    "grab",
+    "queue",
+    "swizzle",
+    "convert",
+    "encode",
+    "write",
+    "sync",
+    "preview",
+    "ui",
+    "total"
+};
+
+Stats *stats_new(guint window)
+{
+    Stats *stats = g_malloc0(sizeof(Stats));
+    guint j;
+
+    if (window == 0)
+        window = 1;
+
+    stats->window = window;
+    g_mutex_init(&stats->lock);
+    for (j = 0; j < STATS_N_STAGES; ++j)
+        stats->stages[j].samples = g_malloc(sizeof(gint64) * window);
+
+    return stats;
+}
+
+void stats_destroy(Stats *stats)
+{
+    guint j;
+
+    if (stats == NULL)
+        return;
+
+    for (j = 0; j < STATS_N_STAGES; ++j)
+        g_free(stats->stages[j].samples);
+    g_mutex_clear(&stats->lock);
+    g_free(stats);
+}
+
+void stats_record(Stats *stats, StatsStage stage, gint64 usec)
+{
+    StatsRing *ring;
+
+    if (stats == NULL)
+        return;
+    g_return_if_fail(stage < STATS_N_STAGES);
+
+    ring = &stats->stages[stage];
+
+    g_mutex_lock(&stats->lock);
+    ring->samples[ring->next] = usec;
+    ring->next = (ring->next + 1) % stats->window;
+    if (ring->n < stats->window)
+        ++ring->n;
+    ++ring->count;
+    g_mutex_unlock(&stats->lock);
+}
+
+static gint stats_compare(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void stats_get_summary(Stats *stats, StatsStage stage, StatsSummary *summary)
+{
+    g_return_if_fail(stats != NULL);
+    g_return_if_fail(stage < STATS_N_STAGES);
+    g_return_if_fail(summary != NULL);
+
+    StatsRing *ring = &stats->stages[stage];
+    gint64 *samples = g_malloc(sizeof(gint64) * stats->window);
+    gint64 sum = 0;
+    guint j;
+
+    memset(summary, 0, sizeof(StatsSummary));
+
+    /* sort a copy, the encoder threads should not wait for us */
+    g_mutex_lock(&stats->lock);
+    summary->count = ring->count;
+    summary->samples = ring->n;
+    memcpy(samples, ring->samples, sizeof(gint64) * ring->n);
+    g_mutex_unlock(&stats->lock);
+
+    if (summary->samples) {
+        qsort(samples, summary->samples, sizeof(gint64), stats_compare);
+        for (j = 0; j < summary->samples; ++j)
+            sum += samples[j];
+
+        summary->min = samples[0];
+        summary->max = samples[summary->samples - 1];
+        summary->mean = sum / summary->samples;
+        summary->p99 = samples[(summary->samples * 99) / 100];
+    }
+
+    g_free(samples);
+}
+
+const gchar *stats_stage_to_string(StatsStage stage)
+{
+    g_return_val_if_fail(stage < STATS_N_STAGES, NULL);
+
+    return stats_stage_names[stage];
+}
+
+gchar *stats_format(Stats *stats)
+{
+    g_return_val_if_fail(stats != NULL, NULL);
+
+    GString *str = g_string_new(NULL);
+    StatsSummary summary;
+    guint j;
+
+    for (j = 0; j < STATS_N_STAGES; ++j) {
+        stats_get_summary(stats, j, &summary);
+        if (summary.samples == 0)
+            continue;
+        if (str->len)
+            g_string_append_c(str, '\n');
+        g_string_append_printf(str, "%-8s %8.2f %8.2f %8.2f",
+                stats_stage_names[j], summary.min / 1e3, summary.mean / 1e3, summary.p99 / 1e3);
+    }
+
+    return g_string_free(str, FALSE);
+}
+
+gboolean stats_append_to_file(Stats *stats, const gchar *filename)
+{
+    g_return_val_if_fail(stats != NULL, FALSE);
+    g_return_val_if_fail(filename != NULL, FALSE);
+
+    StatsSummary summary;
+    gchar tbuf[64];
+    time_t now = time(NULL);
+    FILE *f;
+    guint j;
+
+    if ((f = fopen(filename, "a")) == NULL) {
+        g_printerr("Error opening %s: %s\n", filename, strerror(errno));
+        return FALSE;
+    }
+
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) == 0)
+        fprintf(f, "# time\tstage\tcount\tmin_ms\tmean_ms\tp99_ms\tmax_ms\n");
+
+    for (j = 0; j < STATS_N_STAGES; ++j) {
+        stats_get_summary(stats, j, &summary);
+        if (summary.samples == 0)
+            continue;
+        fprintf(f, "%s\t%s\t%" G_GUINT64_FORMAT "\t%.3f\t%.3f\t%.3f\t%.3f\n",
+                tbuf, stats_stage_names[j], summary.count,
+                summary.min / 1e3, summary.mean / 1e3, summary.p99 / 1e3, summary.max / 1e3);
+    }
+
+    if (fclose(f) != 0) {
+        g_printerr("Error writing %s: %s\n", filename, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glib.h>
+
+typedef enum {
+    STATS_STAGE_GRAB = 0, /* taking the frame from the tap and queueing it */
+    STATS_STAGE_QUEUE,    /* waiting for an encoder thread */
+    STATS_STAGE_SWIZZLE,  /* rgba -> argb while copying out of the shared buffer */
+    STATS_STAGE_CONVERT,  /* full size conversion for Imlib2 */
+    STATS_STAGE_ENCODE,   /* compression; with Imlib2 this includes writing */
+    STATS_STAGE_WRITE,
+    STATS_STAGE_SYNC,     /* written until on disk under its name, with a sync policy */
+    STATS_STAGE_PREVIEW,  /* preview for the last image view */
+    STATS_STAGE_UI,       /* updating the main window after a frame was saved */
+    STATS_STAGE_TOTAL,    /* snapshot until the frame is on disk */
+    STATS_N_STAGES
+} StatsStage;
+
+typedef struct {
+    guint64 count;  /* all samples so far */
+    guint samples;  /* samples in the window the values below are taken from */
+    gint64 min;     /* microseconds */
+    gint64 mean;
+    gint64 p99;
+    gint64 max;
+} StatsSummary;
+
+typedef struct _Stats Stats;
+
+/* keeps the last window samples of each stage */
+Stats *stats_new(guint window);
+void stats_destroy(Stats *stats);
+
+/* thread safe, does nothing if stats is NULL */
+void stats_record(Stats *stats, StatsStage stage, gint64 usec);
+void stats_get_summary(Stats *stats, StatsStage stage, StatsSummary *summary);
+
+const gchar *stats_stage_to_string(StatsStage stage);
+/* one line per stage that has samples: name, min/mean/p99 in ms */
+gchar *stats_format(Stats *stats);
+/* appends one tab separated line per stage with the local time in front */
+gboolean stats_append_to_file(Stats *stats, const gchar *filename);
@@ -0,0 +1,128 @@
+#include "swizzle.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SWIZZLE_X86 1
+#include <immintrin.h>
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWIZZLE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define SWAP_BYTES24(c) (((c) & 0xff00ff00) | (((c) >> 16)&0xff) | (((c) <<16)&0xff0000))
+
+static void swizzle_scalar(guint32 *dst, const guint32 *src, gsize n)
+{
+    gsize j;
+    for (j = 0; j < n; ++j)
+        dst[j] = SWAP_BYTES24(src[j]);
+}
+
+#ifdef SWIZZLE_X86
+__attribute__((target("ssse3")))
+static void swizzle_ssse3(guint32 *dst, const guint32 *src, gsize n)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                       10, 9, 8, 11, 14, 13, 12, 15);
+    __m128i a, b;
+    gsize j = 0;
+
+    for ( ; j + 8 <= n; j += 8) {
+        a = _mm_loadu_si128((const __m128i *)(src + j));
+        b = _mm_loadu_si128((const __m128i *)(src + j + 4));
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128((__m128i *)(dst + j + 4), _mm_shuffle_epi8(b, mask));
+    }
+
+    swizzle_scalar(dst + j, src + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void swizzle_avx2(guint32 *dst, const guint32 *src, gsize n)
+{
+    const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15,
+                                          2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15);
+    __m256i a, b;
+    gsize j = 0;
+
+    for ( ; j + 16 <= n; j += 16) {
+        a = _mm256_loadu_si256((const __m256i *)(src + j));
+        b = _mm256_loadu_si256((const __m256i *)(src + j + 8));
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i *)(dst + j + 8), _mm256_shuffle_epi8(b, mask));
+    }
+
+    swizzle_scalar(dst + j, src + j, n - j);
+}
+#endif
+
+#ifdef SWIZZLE_NEON
+static void swizzle_neon(guint32 *dst, const guint32 *src, gsize n)
+{
+    uint8x16x4_t v;
+    uint8x16_t tmp;
+    gsize j = 0;
+
+    for ( ; j + 16 <= n; j += 16) {
+        v = vld4q_u8((const uint8_t *)(src + j));
+        tmp = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = tmp;
+        vst4q_u8((uint8_t *)(dst + j), v);
+    }
+
+    swizzle_scalar(dst + j, src + j, n - j);
+}
+#endif
+
+static SwizzleImpl swizzle_impls[4];
+static guint swizzle_n_impls;
+
+static void swizzle_init(void)
+{
+    static gsize initialized = 0;
+
+    if (!g_once_init_enter(&initialized))
+        return;
+
+    swizzle_impls[swizzle_n_impls].name = "scalar";
+    swizzle_impls[swizzle_n_impls++].func = swizzle_scalar;
+
+#ifdef SWIZZLE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        swizzle_impls[swizzle_n_impls].name = "ssse3";
+        swizzle_impls[swizzle_n_impls++].func = swizzle_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        swizzle_impls[swizzle_n_impls].name = "avx2";
+        swizzle_impls[swizzle_n_impls++].func = swizzle_avx2;
+    }
+#endif
+
+#ifdef SWIZZLE_NEON
+    swizzle_impls[swizzle_n_impls].name = "neon";
+    swizzle_impls[swizzle_n_impls++].func = swizzle_neon;
+#endif
+
+    g_once_init_leave(&initialized, 1);
+}
+
+void swizzle_rb(guint32 *dst, const guint32 *src, gsize n)
+{
+    swizzle_init();
+    swizzle_impls[swizzle_n_impls - 1].func(dst, src, n);
+}
+
+guint swizzle_get_implementations(const SwizzleImpl **impls)
+{
+    swizzle_init();
+
+    if (impls)
+        *impls = swizzle_impls;
+    return swizzle_n_impls;
+}
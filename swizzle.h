@@ -0,0 +1,20 @@
+#pragma once
+
+#include <glib.h>
+
+/* dst, src, number of pixels */
+typedef void (*SWIZZLE_FUNC)(guint32 *, const guint32 *, gsize);
+
+typedef struct {
+    const gchar *name;
+    SWIZZLE_FUNC func;
+} SwizzleImpl;
+
+/* swap the red and blue channel of n 32 bit pixels, i.e. turn the frames
+ * delivered by the camera into native ARGB32 as used by cairo and Imlib2;
+ * dst may be equal to src, copying and converting is done in one pass */
+void swizzle_rb(guint32 *dst, const guint32 *src, gsize n);
+
+/* all implementations usable on this machine, the one picked by
+ * swizzle_rb() is last; for tests and benchmarks */
+guint swizzle_get_implementations(const SwizzleImpl **impls);
@@ -0,0 +1,1202 @@
+/* pthread_setaffinity_np, CPU_SET */
+#define _GNU_SOURCE
+
+#include "timelapse.h"
+#include "filename.h"
+#include "sequence.h"
+#include "trace.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* number of samples the rolling timings are computed from */
+#define TIMELAPSE_TIMINGS_WINDOW 256
+/* shorter pauses are not worth stopping the camera for */
+#define TIMELAPSE_STANDBY_MIN (2 * G_USEC_PER_SEC)
+/* ms between pushing pre-trigger frames while the encoder queue is full */
+#define TIMELAPSE_FLUSH_INTERVAL 20
+/* ms between checks whether the camera has a frame for the first capture */
+#define TIMELAPSE_FIRST_FRAME_POLL 20
+/* after this the captures start anyway, and fail until there is a frame */
+#define TIMELAPSE_FIRST_FRAME_TIMEOUT (10 * G_USEC_PER_SEC)
+
+/* pre-trigger frames and the sequence of their own they are written to */
+typedef struct {
+    GPtrArray *frames;
+    guint next;
+    gchar *pattern;
+} TimelapseFlush;
+
+struct _Timelapse {
+    Camera *camera;
+    Scheduler *scheduler;
+    TimelapseConfig config;
+    TimelapseStatus status;
+    Stats *timings;
+    guint stats_timer_id;
+    gboolean trace_owned;
+    GSource *standby_source;
+    GSource *first_frame_source;
+    guint skipped_in_row;
+    gchar *jitter; /* histogram of the last run, see timelapse_format_jitter */
+    guint64 index_limit; /* saved with sequence_save, only used in the main loop */
+
+    /* the scheduler runs in a thread of its own, the main loop is only told
+     * about the results; status is shared under status_lock */
+    GThread *capture_thread;
+    GMainContext *capture_context;
+    GMainLoop *capture_loop;
+    GMutex status_lock;
+    gboolean bursting;
+    guint notify_id;
+    /* the pipeline belongs to the main loop, the capture thread only asks
+     * for standby; camera_asleep under status_lock, camera_stopped in the
+     * main loop */
+    guint standby_id;
+    gboolean camera_asleep;
+    gboolean camera_stopped;
+    gboolean notify_queued;
+    guint64 notify_number;
+    gboolean notify_finished;
+
+    /* pre-trigger frames still to be written, see timelapse_trigger */
+    GQueue flushes;
+    guint flush_timer_id;
+
+    /* group of the current source in the pipeline cache */
+    gchar *pipeline_group;
+    gboolean pipeline_cached;
+
+    TimelapseCallbacks callbacks;
+    gpointer userdata;
+};
+
+gchar *timelapse_config_get_default_path(void)
+{
+    return g_build_filename(g_get_user_config_dir(), "timelapse-status.conf", NULL);
+}
+
+gchar *timelapse_get_pipeline_cache_path(void)
+{
+    return g_build_filename(g_get_user_config_dir(), "timelapse-pipeline.cache", NULL);
+}
+
+void timelapse_config_init(TimelapseConfig *config)
+{
+    g_return_if_fail(config != NULL);
+
+    memset(config, 0, sizeof(TimelapseConfig));
+    config->filename = g_strdup("frame0000.jpeg");
+    config->width = 640;
+    config->height = 480;
+    config->count = 100;
+    config->interval = 2000;
+    config->catchup = SCHEDULER_CATCHUP_SKIP;
+    config->encoder_threads = 2;
+    config->encoder_queue = 8;
+    jpegenc_options_init(&config->jpeg);
+    writer_options_init(&config->writer);
+    config->capture_mode = CAMERA_CAPTURE_RGB;
+    config->resume = TRUE;
+    config->stats_interval = 60;
+    config->standby_warmup = 5;
+    config->stack_frames = 1;
+    config->stack_mode = STACK_MEAN;
+    config->capture_cpu = -1;
+    config->pretrigger_fps = 5;
+    config->pretrigger_memory = 64;
+    render_options_init(&config->render);
+}
+
+static gint timelapse_config_get_integer(GKeyFile *kf, const gchar *group, const gchar *key,
+        gint default_value)
+{
+    GError *err = NULL;
+    gint value = g_key_file_get_integer(kf, group, key, &err);
+
+    if (err) {
+        g_clear_error(&err);
+        return default_value;
+    }
+
+    return value;
+}
+
+static gdouble timelapse_config_get_double(GKeyFile *kf, const gchar *group, const gchar *key,
+        gdouble default_value)
+{
+    GError *err = NULL;
+    gdouble value = g_key_file_get_double(kf, group, key, &err);
+
+    if (err) {
+        g_clear_error(&err);
+        return default_value;
+    }
+
+    return value;
+}
+
+static gboolean timelapse_config_get_boolean(GKeyFile *kf, const gchar *group, const gchar *key,
+        gboolean default_value)
+{
+    GError *err = NULL;
+    gboolean value = g_key_file_get_boolean(kf, group, key, &err);
+
+    if (err) {
+        g_clear_error(&err);
+        return default_value;
+    }
+
+    return value;
+}
+
+void timelapse_config_load(TimelapseConfig *config, GKeyFile *kf, const gchar *group)
+{
+    g_return_if_fail(config != NULL);
+    g_return_if_fail(kf != NULL);
+    g_return_if_fail(group != NULL);
+
+    gchar *str;
+
+    if ((str = g_key_file_get_string(kf, group, "filename", NULL)) != NULL) {
+        g_free(config->filename);
+        config->filename = str;
+    }
+    config->width = timelapse_config_get_integer(kf, group, "width", config->width);
+    config->height = timelapse_config_get_integer(kf, group, "height", config->height);
+    config->count = timelapse_config_get_integer(kf, group, "count", config->count);
+    /* seconds, with a fraction for sub-second intervals */
+    config->interval = (guint)(timelapse_config_get_double(kf, group, "interval",
+                config->interval / 1e3) * 1e3 + 0.5);
+    config->burst = timelapse_config_get_boolean(kf, group, "burst", config->burst);
+
+    if ((str = g_key_file_get_string(kf, group, "catchup", NULL)) != NULL)
+        config->catchup = scheduler_catchup_policy_from_string(str);
+    g_free(str);
+
+    config->encoder_threads = timelapse_config_get_integer(kf, group, "encoder-threads",
+            config->encoder_threads);
+    config->encoder_queue = timelapse_config_get_integer(kf, group, "encoder-queue",
+            config->encoder_queue);
+
+    config->jpeg.quality = timelapse_config_get_integer(kf, group, "jpeg-quality",
+            config->jpeg.quality);
+    if ((str = g_key_file_get_string(kf, group, "jpeg-subsampling", NULL)) != NULL)
+        config->jpeg.subsampling = jpegenc_subsampling_from_string(str);
+    g_free(str);
+    config->jpeg.fast_dct = timelapse_config_get_boolean(kf, group, "jpeg-fast-dct",
+            config->jpeg.fast_dct);
+
+    if ((str = g_key_file_get_string(kf, group, "sync", NULL)) != NULL)
+        config->writer.sync = writer_sync_policy_from_string(str);
+    g_free(str);
+    config->writer.sync_frames = timelapse_config_get_integer(kf, group, "sync-frames",
+            config->writer.sync_frames);
+    config->writer.sync_interval = (guint)(timelapse_config_get_double(kf, group, "sync-interval",
+                config->writer.sync_interval / 1e3) * 1e3 + 0.5);
+    config->writer.preallocate = timelapse_config_get_boolean(kf, group, "preallocate",
+            config->writer.preallocate);
+    config->writer.drop_cache = timelapse_config_get_boolean(kf, group, "drop-cache",
+            config->writer.drop_cache);
+    config->writer.io_uring = timelapse_config_get_boolean(kf, group, "io-uring",
+            config->writer.io_uring);
+    config->writer.io_depth = timelapse_config_get_integer(kf, group, "io-depth",
+            config->writer.io_depth);
+
+    if ((str = g_key_file_get_string(kf, group, "capture-mode", NULL)) != NULL)
+        config->capture_mode = camera_capture_mode_from_string(str);
+    g_free(str);
+
+    if ((str = g_key_file_get_string(kf, group, "source", NULL)) != NULL) {
+        g_free(config->source);
+        config->source = str;
+    }
+
+    if ((str = g_key_file_get_string(kf, group, "device", NULL)) != NULL) {
+        g_free(config->device);
+        config->device = str;
+    }
+
+    if ((str = g_key_file_get_string(kf, group, "output", NULL)) != NULL)
+        config->archive = g_strcmp0(str, "archive") == 0;
+    g_free(str);
+    config->resume = timelapse_config_get_boolean(kf, group, "resume", config->resume);
+
+    if ((str = g_key_file_get_string(kf, group, "stats-file", NULL)) != NULL) {
+        g_free(config->stats_file);
+        config->stats_file = NULL;
+        if (str[0])
+            config->stats_file = str;
+        else
+            g_free(str);
+    }
+    config->stats_interval = timelapse_config_get_integer(kf, group, "stats-interval",
+            config->stats_interval);
+
+    if ((str = g_key_file_get_string(kf, group, "trace-file", NULL)) != NULL) {
+        g_free(config->trace_file);
+        config->trace_file = NULL;
+        if (str[0])
+            config->trace_file = str;
+        else
+            g_free(str);
+    }
+
+    config->preview_fps = timelapse_config_get_double(kf, group, "preview-fps",
+            config->preview_fps);
+    config->standby = timelapse_config_get_boolean(kf, group, "standby", config->standby);
+    config->standby_warmup = timelapse_config_get_integer(kf, group, "standby-warmup",
+            config->standby_warmup);
+
+    config->stack_frames = timelapse_config_get_integer(kf, group, "stack-frames",
+            config->stack_frames);
+    if ((str = g_key_file_get_string(kf, group, "stack-mode", NULL)) != NULL)
+        config->stack_mode = stack_mode_from_string(str);
+    g_free(str);
+
+    config->change_threshold = timelapse_config_get_double(kf, group, "change-threshold",
+            config->change_threshold);
+    config->change_max_gap = timelapse_config_get_integer(kf, group, "change-max-gap",
+            config->change_max_gap);
+
+    config->capture_priority = timelapse_config_get_integer(kf, group, "capture-priority",
+            config->capture_priority);
+    config->capture_cpu = timelapse_config_get_integer(kf, group, "capture-cpu",
+            config->capture_cpu);
+
+    config->pretrigger = timelapse_config_get_double(kf, group, "pretrigger",
+            config->pretrigger);
+    config->pretrigger_fps = timelapse_config_get_double(kf, group, "pretrigger-fps",
+            config->pretrigger_fps);
+    config->pretrigger_memory = timelapse_config_get_integer(kf, group, "pretrigger-memory",
+            config->pretrigger_memory);
+
+    config->render.fps = timelapse_config_get_double(kf, group, "render-fps", config->render.fps);
+    if ((str = g_key_file_get_string(kf, group, "render-encoder", NULL)) != NULL) {
+        g_free(config->render.encoder);
+        config->render.encoder = NULL;
+        if (str[0])
+            config->render.encoder = str;
+        else
+            g_free(str);
+    }
+    config->render.threads = timelapse_config_get_integer(kf, group, "render-threads",
+            config->render.threads);
+}
+
+void timelapse_config_save(const TimelapseConfig *config, GKeyFile *kf, const gchar *group)
+{
+    g_return_if_fail(config != NULL);
+    g_return_if_fail(kf != NULL);
+    g_return_if_fail(group != NULL);
+
+    if (config->filename)
+        g_key_file_set_string(kf, group, "filename", config->filename);
+    g_key_file_set_integer(kf, group, "width", config->width);
+    g_key_file_set_integer(kf, group, "height", config->height);
+    g_key_file_set_integer(kf, group, "count", config->count);
+    g_key_file_set_double(kf, group, "interval", config->interval / 1e3);
+    g_key_file_set_boolean(kf, group, "burst", config->burst);
+    g_key_file_set_string(kf, group, "catchup",
+            scheduler_catchup_policy_to_string(config->catchup));
+    g_key_file_set_integer(kf, group, "encoder-threads", config->encoder_threads);
+    g_key_file_set_integer(kf, group, "encoder-queue", config->encoder_queue);
+    g_key_file_set_integer(kf, group, "jpeg-quality", config->jpeg.quality);
+    g_key_file_set_string(kf, group, "jpeg-subsampling",
+            jpegenc_subsampling_to_string(config->jpeg.subsampling));
+    g_key_file_set_boolean(kf, group, "jpeg-fast-dct", config->jpeg.fast_dct);
+    g_key_file_set_string(kf, group, "sync", writer_sync_policy_to_string(config->writer.sync));
+    g_key_file_set_integer(kf, group, "sync-frames", config->writer.sync_frames);
+    g_key_file_set_double(kf, group, "sync-interval", config->writer.sync_interval / 1e3);
+    g_key_file_set_boolean(kf, group, "preallocate", config->writer.preallocate);
+    g_key_file_set_boolean(kf, group, "drop-cache", config->writer.drop_cache);
+    g_key_file_set_boolean(kf, group, "io-uring", config->writer.io_uring);
+    g_key_file_set_integer(kf, group, "io-depth", config->writer.io_depth);
+    g_key_file_set_string(kf, group, "capture-mode",
+            camera_capture_mode_to_string(config->capture_mode));
+    if (config->source)
+        g_key_file_set_string(kf, group, "source", config->source);
+    if (config->device)
+        g_key_file_set_string(kf, group, "device", config->device);
+    g_key_file_set_string(kf, group, "output", config->archive ? "archive" : "files");
+    g_key_file_set_boolean(kf, group, "resume", config->resume);
+    if (config->stats_file)
+        g_key_file_set_string(kf, group, "stats-file", config->stats_file);
+    g_key_file_set_integer(kf, group, "stats-interval", config->stats_interval);
+    if (config->trace_file)
+        g_key_file_set_string(kf, group, "trace-file", config->trace_file);
+    g_key_file_set_double(kf, group, "preview-fps", config->preview_fps);
+    g_key_file_set_boolean(kf, group, "standby", config->standby);
+    g_key_file_set_integer(kf, group, "standby-warmup", config->standby_warmup);
+    g_key_file_set_integer(kf, group, "stack-frames", config->stack_frames);
+    g_key_file_set_string(kf, group, "stack-mode", stack_mode_to_string(config->stack_mode));
+    g_key_file_set_double(kf, group, "change-threshold", config->change_threshold);
+    g_key_file_set_integer(kf, group, "change-max-gap", config->change_max_gap);
+    g_key_file_set_integer(kf, group, "capture-priority", config->capture_priority);
+    g_key_file_set_integer(kf, group, "capture-cpu", config->capture_cpu);
+    g_key_file_set_double(kf, group, "pretrigger", config->pretrigger);
+    g_key_file_set_double(kf, group, "pretrigger-fps", config->pretrigger_fps);
+    g_key_file_set_integer(kf, group, "pretrigger-memory", config->pretrigger_memory);
+    g_key_file_set_double(kf, group, "render-fps", config->render.fps);
+    if (config->render.encoder)
+        g_key_file_set_string(kf, group, "render-encoder", config->render.encoder);
+    g_key_file_set_integer(kf, group, "render-threads", config->render.threads);
+}
+
+void timelapse_config_copy(TimelapseConfig *dst, const TimelapseConfig *src)
+{
+    g_return_if_fail(dst != NULL);
+    g_return_if_fail(src != NULL);
+
+    if (dst == src)
+        return;
+
+    g_free(dst->filename);
+    g_free(dst->source);
+    g_free(dst->device);
+    g_free(dst->stats_file);
+    g_free(dst->trace_file);
+    g_free(dst->render.encoder);
+    *dst = *src;
+    dst->filename = g_strdup(src->filename);
+    dst->source = g_strdup(src->source);
+    dst->device = g_strdup(src->device);
+    dst->stats_file = g_strdup(src->stats_file);
+    dst->trace_file = g_strdup(src->trace_file);
+    dst->render.encoder = g_strdup(src->render.encoder);
+}
+
+void timelapse_config_clear(TimelapseConfig *config)
+{
+    g_return_if_fail(config != NULL);
+
+    g_free(config->filename);
+    config->filename = NULL;
+    g_free(config->source);
+    config->source = NULL;
+    g_free(config->device);
+    config->device = NULL;
+    g_free(config->stats_file);
+    config->stats_file = NULL;
+    g_free(config->trace_file);
+    config->trace_file = NULL;
+    g_free(config->render.encoder);
+    config->render.encoder = NULL;
+}
+
+gchar **timelapse_config_get_camera_groups(GKeyFile *kf)
+{
+    g_return_val_if_fail(kf != NULL, NULL);
+
+    gchar **groups = g_key_file_get_groups(kf, NULL);
+    GPtrArray *names = g_ptr_array_new();
+    gsize prefix = strlen(TIMELAPSE_CAMERA_GROUP);
+    guint j;
+
+    for (j = 0; groups[j]; ++j) {
+        if (g_str_has_prefix(groups[j], TIMELAPSE_CAMERA_GROUP) && groups[j][prefix])
+            g_ptr_array_add(names, g_strdup(groups[j] + prefix));
+    }
+    g_ptr_array_add(names, NULL);
+    g_strfreev(groups);
+
+    return (gchar **)g_ptr_array_free(names, FALSE);
+}
+
+Timelapse *timelapse_new(Camera *camera)
+{
+    g_return_val_if_fail(camera != NULL, NULL);
+
+    Timelapse *timelapse = g_malloc0(sizeof(Timelapse));
+    timelapse->camera = camera;
+    timelapse_config_init(&timelapse->config);
+    timelapse->status.last_change = -1.0;
+    g_mutex_init(&timelapse->status_lock);
+    timelapse->timings = stats_new(TIMELAPSE_TIMINGS_WINDOW);
+    camera_set_timings(camera, timelapse->timings);
+
+    return timelapse;
+}
+
+static void timelapse_flush_free(TimelapseFlush *flush)
+{
+    g_ptr_array_unref(flush->frames);
+    g_free(flush->pattern);
+    g_slice_free(TimelapseFlush, flush);
+}
+
+static void timelapse_cancel_flushes(Timelapse *timelapse)
+{
+    TimelapseFlush *flush;
+    guint lost = 0;
+
+    if (timelapse->flush_timer_id) {
+        g_source_remove(timelapse->flush_timer_id);
+        timelapse->flush_timer_id = 0;
+    }
+    while ((flush = g_queue_pop_head(&timelapse->flushes)) != NULL) {
+        lost += flush->frames->len - flush->next;
+        timelapse_flush_free(flush);
+    }
+    if (lost)
+        g_printerr("%u pre-trigger frames were not written\n", lost);
+}
+
+void timelapse_destroy(Timelapse *timelapse)
+{
+    if (timelapse == NULL)
+        return;
+
+    timelapse_stop(timelapse);
+    timelapse_cancel_flushes(timelapse);
+    camera_destroy(timelapse->camera);
+    stats_destroy(timelapse->timings);
+    g_free(timelapse->pipeline_group);
+    g_free(timelapse->jitter);
+    if (timelapse->trace_owned)
+        trace_close();
+    timelapse_config_clear(&timelapse->config);
+    g_mutex_clear(&timelapse->status_lock);
+
+    g_free(timelapse);
+}
+
+Camera *timelapse_get_camera(Timelapse *timelapse)
+{
+    g_return_val_if_fail(timelapse != NULL, NULL);
+
+    return timelapse->camera;
+}
+
+void timelapse_set_callbacks(Timelapse *timelapse, const TimelapseCallbacks *callbacks,
+        gpointer userdata)
+{
+    g_return_if_fail(timelapse != NULL);
+
+    if (callbacks)
+        timelapse->callbacks = *callbacks;
+    else
+        memset(&timelapse->callbacks, 0, sizeof(TimelapseCallbacks));
+    timelapse->userdata = userdata;
+}
+
+/* caps and decoder that worked for this source and mode before */
+static void timelapse_load_pipeline_cache(Timelapse *timelapse)
+{
+    gchar *path = timelapse_get_pipeline_cache_path();
+    GKeyFile *kf = g_key_file_new();
+    gchar *caps = NULL;
+    gchar *decoder = NULL;
+
+    if (g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, NULL)) {
+        caps = g_key_file_get_string(kf, timelapse->pipeline_group, "caps", NULL);
+        decoder = g_key_file_get_string(kf, timelapse->pipeline_group, "decoder", NULL);
+    }
+    camera_set_pipeline_hint(timelapse->camera, caps, decoder);
+
+    g_free(caps);
+    g_free(decoder);
+    g_key_file_free(kf);
+    g_free(path);
+}
+
+static void timelapse_save_pipeline_cache(Timelapse *timelapse)
+{
+    gchar *path, *data;
+    gchar *caps, *decoder;
+    GKeyFile *kf;
+    GError *err = NULL;
+    gsize length;
+
+    if (!camera_get_pipeline_hint(timelapse->camera, &caps, &decoder))
+        return;
+    timelapse->pipeline_cached = TRUE;
+
+    path = timelapse_get_pipeline_cache_path();
+    kf = g_key_file_new();
+    g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, NULL);
+    g_key_file_set_string(kf, timelapse->pipeline_group, "caps", caps);
+    g_key_file_set_string(kf, timelapse->pipeline_group, "decoder", decoder);
+
+    data = g_key_file_to_data(kf, &length, NULL);
+    if (!g_file_set_contents(path, data, length, &err)) {
+        g_printerr("Error writing %s: %s\n", path, err->message);
+        g_clear_error(&err);
+    }
+
+    g_free(data);
+    g_key_file_free(kf);
+    g_free(path);
+    g_free(caps);
+    g_free(decoder);
+}
+
+void timelapse_apply_config(Timelapse *timelapse, const TimelapseConfig *config)
+{
+    g_return_if_fail(timelapse != NULL);
+    g_return_if_fail(config != NULL);
+
+    /* before the setters below, they may rebuild the pipeline */
+    g_free(timelapse->pipeline_group);
+    timelapse->pipeline_group = g_strdup_printf("%s %s",
+            camera_capture_mode_to_string(config->capture_mode),
+            config->source ? config->source : (config->device ? config->device : "v4l2src"));
+    timelapse->pipeline_cached = FALSE;
+    timelapse_load_pipeline_cache(timelapse);
+
+    camera_set_encoder_threads(timelapse->camera, config->encoder_threads, config->encoder_queue);
+    camera_set_jpeg_options(timelapse->camera, &config->jpeg);
+    camera_set_writer_options(timelapse->camera, &config->writer);
+    camera_set_capture_mode(timelapse->camera, config->capture_mode);
+    camera_set_source(timelapse->camera, config->source);
+    camera_set_device(timelapse->camera, config->device);
+    camera_set_preview_rate(timelapse->camera, config->preview_fps);
+    camera_set_stacking(timelapse->camera, config->stack_frames, config->stack_mode);
+    camera_set_pretrigger(timelapse->camera, config->pretrigger, config->pretrigger_memory,
+            config->pretrigger_fps);
+}
+
+/* frame0000.jpeg -> frame.tlpack in the same directory */
+static gchar *timelapse_archive_filename(const gchar *pattern)
+{
+    gchar *dir = g_path_get_dirname(pattern);
+    gchar *base = g_path_get_basename(pattern);
+    gchar *suff = strrchr(base, '.');
+    gchar *filename;
+
+    if (suff && suff != base)
+        *suff = '\0';
+    else
+        suff = base + strlen(base);
+    while (suff > base && g_ascii_isdigit(suff[-1]))
+        *--suff = '\0';
+
+    filename = g_strdup_printf("%s/%s.tlpack", dir, base[0] ? base : "frames");
+
+    g_free(dir);
+    g_free(base);
+
+    return filename;
+}
+
+static void timelapse_snapshot_saved(const gchar *filename, Frame *frame, Timelapse *timelapse)
+{
+    if (!timelapse->pipeline_cached && timelapse->pipeline_group)
+        timelapse_save_pipeline_cache(timelapse);
+
+    if (timelapse->callbacks.frame_saved)
+        timelapse->callbacks.frame_saved(timelapse, filename, frame, timelapse->userdata);
+}
+
+static gboolean timelapse_make_snapshot(Timelapse *timelapse, guint64 number)
+{
+    gchar *filename = filename_generate(timelapse->config.filename, number);
+    gboolean taken = FALSE;
+
+    if (filename && !(taken = camera_save_snapshot_to_file(timelapse->camera, filename,
+                    timelapse->config.width, timelapse->config.height,
+                    (CAMERA_SNAPSHOT_TAKEN_CALLBACK)timelapse_snapshot_saved, timelapse)))
+        g_printerr("Snapshot %s was not taken\n", filename);
+    g_free(filename);
+
+    return taken;
+}
+
+static gboolean timelapse_is_indexed(Timelapse *timelapse)
+{
+    return timelapse->config.resume && !timelapse->config.archive && timelapse->config.filename;
+}
+
+/* in the main loop; the index is moved on long before the captures reach it,
+ * so after a crash at most SEQUENCE_RESERVE numbers have to be checked */
+static void timelapse_update_index(Timelapse *timelapse)
+{
+    guint64 number;
+
+    if (!timelapse_is_indexed(timelapse))
+        return;
+
+    g_mutex_lock(&timelapse->status_lock);
+    number = timelapse->status.image_number;
+    g_mutex_unlock(&timelapse->status_lock);
+
+    if (number + SEQUENCE_RESERVE / 2 < timelapse->index_limit)
+        return;
+
+    timelapse->index_limit = number + SEQUENCE_RESERVE;
+    sequence_save(timelapse->config.filename, timelapse->index_limit);
+}
+
+/* in the main loop, with what the capture thread did since the last time */
+static gboolean timelapse_notify(Timelapse *timelapse)
+{
+    gboolean queued, finished;
+    guint64 number;
+
+    g_mutex_lock(&timelapse->status_lock);
+    timelapse->notify_id = 0;
+    queued = timelapse->notify_queued;
+    number = timelapse->notify_number;
+    finished = timelapse->notify_finished;
+    timelapse->notify_queued = FALSE;
+    timelapse->notify_finished = FALSE;
+    g_mutex_unlock(&timelapse->status_lock);
+
+    if (queued)
+        timelapse_update_index(timelapse);
+
+    if (queued && timelapse->callbacks.frame_queued)
+        timelapse->callbacks.frame_queued(timelapse, number, timelapse->userdata);
+
+    if (finished) {
+        timelapse_stop(timelapse);
+        if (timelapse->callbacks.finished)
+            timelapse->callbacks.finished(timelapse, timelapse->userdata);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* called with status_lock held */
+static void timelapse_queue_notify(Timelapse *timelapse)
+{
+    if (timelapse->notify_id == 0)
+        timelapse->notify_id = g_idle_add((GSourceFunc)timelapse_notify, timelapse);
+}
+
+/* in the main loop, which may also rebuild the pipeline after a bus error */
+static gboolean timelapse_apply_standby(Timelapse *timelapse)
+{
+    gboolean asleep;
+
+    g_mutex_lock(&timelapse->status_lock);
+    timelapse->standby_id = 0;
+    asleep = timelapse->camera_asleep;
+    g_mutex_unlock(&timelapse->status_lock);
+
+    if (asleep != timelapse->camera_stopped) {
+        timelapse->camera_stopped = asleep;
+        if (asleep)
+            camera_stop(timelapse->camera);
+        else
+            camera_start(timelapse->camera);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* in the capture thread */
+static void timelapse_set_standby(Timelapse *timelapse, gboolean asleep)
+{
+    g_mutex_lock(&timelapse->status_lock);
+    timelapse->camera_asleep = asleep;
+    if (timelapse->standby_id == 0)
+        timelapse->standby_id = g_idle_add((GSourceFunc)timelapse_apply_standby, timelapse);
+    g_mutex_unlock(&timelapse->status_lock);
+}
+
+static gboolean timelapse_wake(Timelapse *timelapse)
+{
+    g_source_unref(timelapse->standby_source);
+    timelapse->standby_source = NULL;
+    timelapse_set_standby(timelapse, FALSE);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* the frame has been grabbed, let the camera rest until shortly before the next one */
+static void timelapse_standby(Timelapse *timelapse)
+{
+    gint64 wake = timelapse->status.next_event -
+        (gint64)timelapse->config.standby_warmup * G_USEC_PER_SEC;
+    gint64 now = g_get_monotonic_time();
+
+    if (wake - now < TIMELAPSE_STANDBY_MIN)
+        return;
+
+    timelapse_set_standby(timelapse, TRUE);
+    timelapse->standby_source = g_timeout_source_new((wake - now) / 1000);
+    g_source_set_callback(timelapse->standby_source, (GSourceFunc)timelapse_wake, timelapse, NULL);
+    g_source_attach(timelapse->standby_source, timelapse->capture_context);
+}
+
+/* near duplicates of the last frame are skipped, but never change_max_gap in a row */
+static gboolean timelapse_scene_unchanged(Timelapse *timelapse)
+{
+    const TimelapseConfig *config = &timelapse->config;
+    gdouble change;
+
+    if (config->change_threshold <= 0)
+        return FALSE;
+
+    change = camera_get_scene_change(timelapse->camera);
+    g_mutex_lock(&timelapse->status_lock);
+    timelapse->status.last_change = change;
+    g_mutex_unlock(&timelapse->status_lock);
+
+    if (change < 0 || change >= config->change_threshold)
+        return FALSE;
+    if (config->change_max_gap && timelapse->skipped_in_row + 1 >= config->change_max_gap)
+        return FALSE;
+
+    return TRUE;
+}
+
+/* in the capture thread */
+static gboolean timelapse_tick(gint64 deadline, Timelapse *timelapse)
+{
+    TimelapseStatus *status = &timelapse->status;
+    gint64 start = TRACE_BEGIN();
+    gint64 lag = start - deadline;
+    gboolean unchanged, finished;
+    gboolean taken = FALSE;
+    guint64 number = 0;
+
+    /* the numbers stay contiguous, skipped and failed snapshots get none; kept
+     * under the lock until the snapshot is queued, timelapse_trigger reserves
+     * numbers from the main loop */
+    unchanged = timelapse_scene_unchanged(timelapse);
+    if (unchanged)
+        ++timelapse->skipped_in_row;
+    else {
+        timelapse->skipped_in_row = 0;
+        g_mutex_lock(&timelapse->status_lock);
+        number = status->image_number;
+        if ((taken = timelapse_make_snapshot(timelapse, number)))
+            ++status->image_number;
+        g_mutex_unlock(&timelapse->status_lock);
+    }
+
+    g_mutex_lock(&timelapse->status_lock);
+    status->next_event = scheduler_get_next_deadline(timelapse->scheduler);
+    status->lag = lag;
+    if (lag > status->max_lag)
+        status->max_lag = lag;
+    if (unchanged)
+        ++status->frames_skipped;
+    if (taken) {
+        timelapse->notify_queued = TRUE;
+        timelapse->notify_number = number;
+    }
+    ++status->frames_done;
+    finished = status->count && status->frames_done >= status->count;
+    timelapse->notify_finished = finished;
+    if (taken || finished)
+        timelapse_queue_notify(timelapse);
+    g_mutex_unlock(&timelapse->status_lock);
+
+    TRACE_END("scheduler", "tick", start);
+
+    /* the main loop stops us */
+    if (finished)
+        return FALSE;
+
+    /* a stacked snapshot still needs the next frames */
+    if (timelapse->config.standby && timelapse->config.stack_frames <= 1)
+        timelapse_standby(timelapse);
+
+    return TRUE;
+}
+
+/* in the streaming thread for every frame in burst mode, NULL once count is
+ * reached; otherwise status_lock stays held until timelapse_burst_queued, so
+ * timelapse_trigger cannot take the number meanwhile */
+static gchar *timelapse_burst_filename(Timelapse *timelapse)
+{
+    TimelapseStatus *status = &timelapse->status;
+    gchar *filename;
+
+    g_mutex_lock(&timelapse->status_lock);
+    if (status->count && status->frames_done >= status->count) {
+        g_mutex_unlock(&timelapse->status_lock);
+        return NULL;
+    }
+
+    filename = filename_generate(timelapse->config.filename, status->image_number);
+    if (filename == NULL)
+        g_mutex_unlock(&timelapse->status_lock);
+
+    return filename;
+}
+
+/* a dropped frame gets no number and does not count */
+static void timelapse_burst_queued(gboolean queued, Timelapse *timelapse)
+{
+    TimelapseStatus *status = &timelapse->status;
+
+    if (queued) {
+        timelapse->notify_queued = TRUE;
+        timelapse->notify_number = status->image_number++;
+        ++status->frames_done;
+        timelapse->notify_finished = status->count && status->frames_done >= status->count;
+        timelapse_queue_notify(timelapse);
+    }
+    g_mutex_unlock(&timelapse->status_lock);
+}
+
+/* in the capture thread; a new snapshot size drops the last frame of the
+ * camera, so the schedule only starts once there is one in that size */
+static gboolean timelapse_wait_first_frame(Timelapse *timelapse)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (!camera_has_frame(timelapse->camera) &&
+            now - timelapse->status.started < TIMELAPSE_FIRST_FRAME_TIMEOUT)
+        return G_SOURCE_CONTINUE;
+
+    g_source_unref(timelapse->first_frame_source);
+    timelapse->first_frame_source = NULL;
+
+    g_mutex_lock(&timelapse->status_lock);
+    timelapse->status.next_event = now;
+    g_mutex_unlock(&timelapse->status_lock);
+    scheduler_start(timelapse->scheduler, timelapse->capture_context, now,
+            (SCHEDULER_TICK_CALLBACK)timelapse_tick, timelapse);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* SCHED_FIFO and the cpu are best effort, without the rights we still capture */
+static void timelapse_set_realtime(gint priority, gint cpu)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
+
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0)
+            g_printerr("Could not bind the capture thread to cpu %d: %s\n", cpu, strerror(err));
+    }
+
+    if (priority > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = CLAMP(priority, sched_get_priority_min(SCHED_FIFO),
+                sched_get_priority_max(SCHED_FIFO));
+        if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+            g_printerr("Could not set SCHED_FIFO priority %d: %s\n",
+                    param.sched_priority, strerror(err));
+    }
+}
+
+static gpointer timelapse_capture_thread(Timelapse *timelapse)
+{
+    g_main_context_push_thread_default(timelapse->capture_context);
+    timelapse_set_realtime(timelapse->config.capture_priority, timelapse->config.capture_cpu);
+
+    g_main_loop_run(timelapse->capture_loop);
+
+    g_main_context_pop_thread_default(timelapse->capture_context);
+
+    return NULL;
+}
+
+static gboolean timelapse_write_stats(Timelapse *timelapse)
+{
+    stats_append_to_file(timelapse->timings, timelapse->config.stats_file);
+
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean timelapse_start(Timelapse *timelapse, const TimelapseConfig *config)
+{
+    g_return_val_if_fail(timelapse != NULL, FALSE);
+    g_return_val_if_fail(config != NULL, FALSE);
+
+    if (config->interval == 0 && !config->burst)
+        return FALSE;
+
+    timelapse_stop(timelapse);
+    timelapse_config_copy(&timelapse->config, config);
+
+    gchar *archive = config->archive ? timelapse_archive_filename(config->filename) : NULL;
+    gboolean archive_ok = camera_set_archive(timelapse->camera, archive);
+    g_free(archive);
+    if (!archive_ok)
+        return FALSE;
+    /* here, so the saved frames are reported to the main loop */
+    if (!camera_prepare_encoder(timelapse->camera))
+        return FALSE;
+
+    camera_set_snapshot_size(timelapse->camera, config->width, config->height);
+    timelapse->status.interval = (gint64)config->interval * 1000;
+    timelapse->status.image_number = 0;
+    /* the archive keeps its own numbering */
+    if (timelapse_is_indexed(timelapse)) {
+        timelapse->status.image_number = sequence_find_next(config->filename);
+        if (timelapse->status.image_number) {
+            gchar *next = filename_generate(config->filename, timelapse->status.image_number);
+            g_print("Continuing with %s\n", next);
+            g_free(next);
+        }
+        timelapse->index_limit = 0;
+        timelapse_update_index(timelapse);
+    }
+    timelapse->status.next_event = g_get_monotonic_time();
+    timelapse->status.started = timelapse->status.next_event;
+    timelapse->status.lag = 0;
+    timelapse->status.max_lag = 0;
+    timelapse->status.frames_done = 0;
+    timelapse->status.frames_skipped = 0;
+    timelapse->status.last_change = -1.0;
+    timelapse->skipped_in_row = 0;
+    timelapse->status.count = config->count;
+
+    if (config->burst) {
+        /* every frame of the camera, no scheduler involved */
+        timelapse->bursting = TRUE;
+        camera_set_burst(timelapse->camera, (CAMERA_BURST_FILENAME_CALLBACK)timelapse_burst_filename,
+                (CAMERA_BURST_QUEUED_CALLBACK)timelapse_burst_queued,
+                (CAMERA_SNAPSHOT_TAKEN_CALLBACK)timelapse_snapshot_saved, timelapse);
+    }
+    else {
+        timelapse->capture_context = g_main_context_new();
+        timelapse->capture_loop = g_main_loop_new(timelapse->capture_context, FALSE);
+        timelapse->scheduler = scheduler_new(timelapse->status.interval, config->catchup);
+        timelapse->first_frame_source = g_timeout_source_new(TIMELAPSE_FIRST_FRAME_POLL);
+        g_source_set_callback(timelapse->first_frame_source,
+                (GSourceFunc)timelapse_wait_first_frame, timelapse, NULL);
+        g_source_attach(timelapse->first_frame_source, timelapse->capture_context);
+        timelapse->capture_thread = g_thread_new("capture",
+                (GThreadFunc)timelapse_capture_thread, timelapse);
+    }
+
+    /* kept open until the encoder has finished, see timelapse_destroy */
+    if (config->trace_file && !trace_enabled())
+        timelapse->trace_owned = trace_open(config->trace_file);
+
+    if (config->stats_file && config->stats_interval)
+        timelapse->stats_timer_id = g_timeout_add_seconds(config->stats_interval,
+                (GSourceFunc)timelapse_write_stats, timelapse);
+
+    return TRUE;
+}
+
+static void timelapse_stop_capture_thread(Timelapse *timelapse)
+{
+    /* after this nothing but us touches the scheduler and the status */
+    g_main_loop_quit(timelapse->capture_loop);
+    g_thread_join(timelapse->capture_thread);
+    timelapse->capture_thread = NULL;
+
+    scheduler_stop(timelapse->scheduler);
+
+    g_free(timelapse->jitter);
+    timelapse->jitter = scheduler_format_jitter_histogram(timelapse->scheduler);
+
+    scheduler_destroy(timelapse->scheduler);
+    timelapse->scheduler = NULL;
+
+    if (timelapse->first_frame_source) {
+        g_source_destroy(timelapse->first_frame_source);
+        g_source_unref(timelapse->first_frame_source);
+        timelapse->first_frame_source = NULL;
+    }
+    /* back to the live view */
+    if (timelapse->standby_source) {
+        g_source_destroy(timelapse->standby_source);
+        g_source_unref(timelapse->standby_source);
+        timelapse->standby_source = NULL;
+    }
+    if (timelapse->standby_id) {
+        g_source_remove(timelapse->standby_id);
+        timelapse->standby_id = 0;
+    }
+    timelapse->camera_asleep = FALSE;
+    if (timelapse->camera_stopped) {
+        timelapse->camera_stopped = FALSE;
+        camera_start(timelapse->camera);
+    }
+    g_main_loop_unref(timelapse->capture_loop);
+    timelapse->capture_loop = NULL;
+    g_main_context_unref(timelapse->capture_context);
+    timelapse->capture_context = NULL;
+}
+
+void timelapse_stop(Timelapse *timelapse)
+{
+    g_return_if_fail(timelapse != NULL);
+
+    if (!timelapse_is_running(timelapse))
+        return;
+
+    /* waits for a frame that is being pushed */
+    if (timelapse->bursting) {
+        camera_set_burst(timelapse->camera, NULL, NULL, NULL, NULL);
+        timelapse->bursting = FALSE;
+    }
+    if (timelapse->scheduler)
+        timelapse_stop_capture_thread(timelapse);
+
+    if (timelapse->stats_timer_id) {
+        g_source_remove(timelapse->stats_timer_id);
+        timelapse->stats_timer_id = 0;
+    }
+    if (timelapse->notify_id) {
+        g_source_remove(timelapse->notify_id);
+        timelapse->notify_id = 0;
+    }
+    if (timelapse->config.stats_file)
+        stats_append_to_file(timelapse->timings, timelapse->config.stats_file);
+
+    /* the captures have ended, the exact value spares the next start the search */
+    if (timelapse_is_indexed(timelapse)) {
+        timelapse->index_limit = timelapse->status.image_number;
+        sequence_save(timelapse->config.filename, timelapse->index_limit);
+    }
+}
+
+/* in the main loop; leaves one place in the encoder queue for the live captures */
+static gboolean timelapse_flush_step(Timelapse *timelapse)
+{
+    TimelapseFlush *flush;
+    EncoderStats stats;
+    CAMERA_SNAPSHOT_TAKEN_CALLBACK cb;
+    gchar *filename;
+    Frame *frame;
+    guint room;
+
+    camera_get_encoder_stats(timelapse->camera, &stats);
+    room = stats.queue_size > 1 ? stats.queue_size - 1 : 1;
+
+    while (stats.pending < room && (flush = g_queue_peek_head(&timelapse->flushes)) != NULL) {
+        frame = frame_ref(g_ptr_array_index(flush->frames, flush->next));
+        filename = filename_generate(flush->pattern, flush->next);
+        ++flush->next;
+
+        /* a preview of the last one is enough */
+        cb = flush->next == flush->frames->len ?
+            (CAMERA_SNAPSHOT_TAKEN_CALLBACK)timelapse_snapshot_saved : NULL;
+        if (filename && !camera_save_frame_to_file(timelapse->camera, filename, frame,
+                    cb, timelapse))
+            g_printerr("Pre-trigger frame %s was not written\n", filename);
+        g_free(filename);
+        ++stats.pending;
+
+        if (flush->next == flush->frames->len)
+            timelapse_flush_free(g_queue_pop_head(&timelapse->flushes));
+    }
+
+    if (g_queue_is_empty(&timelapse->flushes)) {
+        timelapse->flush_timer_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* frame0123.jpeg, the next live capture, gives frame0123-pre0000.jpeg: the block
+ * sorts right before it and is not part of the sequence for sequence_find_next */
+static gchar *timelapse_trigger_pattern(const gchar *filename, guint64 number)
+{
+    gchar *live = filename_generate(filename, number);
+    gchar *base, *suffix, *pattern;
+
+    if (live == NULL)
+        return NULL;
+
+    base = strrchr(live, '/');
+    base = base ? base + 1 : live;
+    suffix = strrchr(base, '.');
+    if (suffix == NULL || suffix == base)
+        suffix = base + strlen(base);
+    pattern = g_strdup_printf("%.*s-pre0000%s", (int)(suffix - live), live, suffix);
+    g_free(live);
+
+    return pattern;
+}
+
+gboolean timelapse_trigger(Timelapse *timelapse)
+{
+    g_return_val_if_fail(timelapse != NULL, FALSE);
+
+    TimelapseFlush *flush;
+    GPtrArray *frames;
+
+    if (!timelapse_is_running(timelapse))
+        return FALSE;
+
+    frames = camera_take_pretrigger(timelapse->camera);
+    if (frames == NULL || frames->len == 0) {
+        if (frames)
+            g_ptr_array_unref(frames);
+        return FALSE;
+    }
+
+    flush = g_slice_new(TimelapseFlush);
+    flush->frames = frames;
+    flush->next = 0;
+
+    /* the live captures keep their numbers, some of them may be older than
+     * the end of the block already */
+    g_mutex_lock(&timelapse->status_lock);
+    flush->pattern = timelapse_trigger_pattern(timelapse->config.filename,
+            timelapse->status.image_number);
+    g_mutex_unlock(&timelapse->status_lock);
+
+    g_queue_push_tail(&timelapse->flushes, flush);
+    if (timelapse->flush_timer_id == 0 && timelapse_flush_step(timelapse))
+        timelapse->flush_timer_id = g_timeout_add(TIMELAPSE_FLUSH_INTERVAL,
+                (GSourceFunc)timelapse_flush_step, timelapse);
+
+    return TRUE;
+}
+
+gboolean timelapse_is_running(Timelapse *timelapse)
+{
+    g_return_val_if_fail(timelapse != NULL, FALSE);
+
+    return timelapse->scheduler != NULL || timelapse->bursting;
+}
+
+Stats *timelapse_get_timings(Timelapse *timelapse)
+{
+    g_return_val_if_fail(timelapse != NULL, NULL);
+
+    return timelapse->timings;
+}
+
+void timelapse_get_status(Timelapse *timelapse, TimelapseStatus *status)
+{
+    g_return_if_fail(timelapse != NULL);
+    g_return_if_fail(status != NULL);
+
+    g_mutex_lock(&timelapse->status_lock);
+    *status = timelapse->status;
+    g_mutex_unlock(&timelapse->status_lock);
+}
+
+gchar *timelapse_format_jitter(Timelapse *timelapse)
+{
+    g_return_val_if_fail(timelapse != NULL, NULL);
+
+    return g_strdup(timelapse->jitter);
+}
+
+gchar *timelapse_format_status(Timelapse *timelapse)
+{
+    g_return_val_if_fail(timelapse != NULL, NULL);
+
+    TimelapseStatus status;
+    EncoderStats stats;
+    gdouble minutes;
+
+    timelapse_get_status(timelapse, &status);
+    minutes = (g_get_monotonic_time() - status.started) / (60.0 * G_USEC_PER_SEC);
+    camera_get_encoder_stats(timelapse->camera, &stats);
+    if (!status.started)
+        minutes = 0;
+
+    return g_strdup_printf("%" G_GUINT64_FORMAT " written (%.1f/min, %.2f MB/s), "
+                "%u/%u pending, %u writing (max. %u), "
+                "%" G_GUINT64_FORMAT " dropped, %" G_GUINT64_FORMAT " failed, "
+                "lag %.1f ms (max. %.1f ms)",
+            stats.written, minutes > 0 ? stats.written / minutes : 0.0,
+            minutes > 0 ? stats.writer.bytes / (minutes * 60.0) / 1e6 : 0.0,
+            stats.pending, stats.queue_size, stats.writer.in_flight, stats.writer.max_in_flight,
+            stats.dropped, stats.failed + stats.writer.failed,
+            status.lag / 1e3, status.max_lag / 1e3);
+}
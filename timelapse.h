@@ -0,0 +1,115 @@
+#pragma once
+
+#include <glib.h>
+#include "camera.h"
+#include "scheduler.h"
+#include "render.h"
+
+typedef struct {
+    gchar *filename;
+    guint width;
+    guint height;
+    guint count;
+    guint interval;      /* milliseconds, the config file has seconds */
+    gboolean burst;      /* save every frame of the camera, interval is ignored */
+    SchedulerCatchupPolicy catchup;
+    guint encoder_threads;
+    guint encoder_queue;
+    JpegencOptions jpeg;
+    WriterOptions writer; /* sync_interval in ms, the config file has seconds */
+    CameraCaptureMode capture_mode;
+    gchar *source; /* NULL: v4l2src */
+    gchar *device; /* device of the v4l2src, NULL: first camera */
+    gboolean archive;
+    gboolean resume;     /* continue after the highest existing file of filename */
+    gchar *stats_file;   /* NULL: none */
+    guint stats_interval; /* seconds between appending to stats_file */
+    gchar *trace_file;   /* NULL: none, see trace.h */
+    gdouble preview_fps; /* 0: rate of the camera */
+    gboolean standby;    /* stop the camera between captures */
+    guint standby_warmup; /* seconds the camera is started before a capture */
+    guint stack_frames;  /* frames combined into each snapshot, 1: off */
+    StackMode stack_mode;
+    gdouble change_threshold; /* skip frames that differ less from the last one, 0: off */
+    guint change_max_gap; /* keep at least every change_max_gap-th frame, 0: no limit */
+    guint capture_priority; /* SCHED_FIFO priority of the capture thread, 0: normal */
+    gint capture_cpu;     /* cpu the capture thread is bound to, -1: any */
+    gdouble pretrigger;   /* seconds of frames kept for timelapse_trigger, 0: off */
+    gdouble pretrigger_fps; /* frames per second kept, 0: all */
+    guint pretrigger_memory; /* MiB */
+    RenderOptions render; /* for render_start, from the sequence of filename */
+    gboolean valid;
+} TimelapseConfig;
+
+typedef struct {
+    gint64 next_event;
+    gint64 interval;
+    guint64 image_number;
+    guint64 count;
+    guint64 frames_done;
+    guint64 frames_skipped; /* unchanged scene, included in frames_done */
+    gdouble last_change;    /* difference measured at the last tick, -1: none */
+    gint64 started;         /* monotonic time in µs */
+    gint64 lag;             /* last tick after its deadline, µs */
+    gint64 max_lag;
+} TimelapseStatus;
+
+typedef struct _Timelapse Timelapse;
+
+/* timelapse, number of the frame, userdata; the frame has been queued for saving */
+typedef void (*TIMELAPSE_FRAME_QUEUED_CALLBACK)(Timelapse *, guint64, gpointer);
+/* timelapse, filename, preview (ARGB32), userdata; take a reference to keep the frame */
+typedef void (*TIMELAPSE_FRAME_SAVED_CALLBACK)(Timelapse *, const gchar *, Frame *, gpointer);
+/* timelapse, userdata; all frames have been taken, not called by timelapse_stop */
+typedef void (*TIMELAPSE_FINISHED_CALLBACK)(Timelapse *, gpointer);
+
+typedef struct {
+    TIMELAPSE_FRAME_QUEUED_CALLBACK frame_queued;
+    TIMELAPSE_FRAME_SAVED_CALLBACK frame_saved;
+    TIMELAPSE_FINISHED_CALLBACK finished;
+} TimelapseCallbacks;
+
+/* [Camera <name>] groups of the config file, each one runs a camera of its own
+ * with the keys of [Status] as defaults */
+#define TIMELAPSE_CAMERA_GROUP "Camera "
+
+/* ~/.config/timelapse-status.conf */
+gchar *timelapse_config_get_default_path(void);
+/* ~/.config/timelapse-pipeline.cache, caps and decoder per source to skip autoplugging */
+gchar *timelapse_get_pipeline_cache_path(void);
+void timelapse_config_init(TimelapseConfig *config);
+/* keys missing from group keep their current value */
+void timelapse_config_load(TimelapseConfig *config, GKeyFile *kf, const gchar *group);
+void timelapse_config_save(const TimelapseConfig *config, GKeyFile *kf, const gchar *group);
+void timelapse_config_copy(TimelapseConfig *dst, const TimelapseConfig *src);
+void timelapse_config_clear(TimelapseConfig *config);
+/* names of the camera groups in kf (without the prefix), free with g_strfreev */
+gchar **timelapse_config_get_camera_groups(GKeyFile *kf);
+
+/* takes ownership of camera */
+Timelapse *timelapse_new(Camera *camera);
+void timelapse_destroy(Timelapse *timelapse);
+Camera *timelapse_get_camera(Timelapse *timelapse);
+void timelapse_set_callbacks(Timelapse *timelapse, const TimelapseCallbacks *callbacks,
+        gpointer userdata);
+
+/* encoder and capture settings of config, may rebuild the pipeline */
+void timelapse_apply_config(Timelapse *timelapse, const TimelapseConfig *config);
+/* the camera has to be started separately; the frames are grabbed in a thread
+ * of its own, the callbacks are still called from the main loop */
+gboolean timelapse_start(Timelapse *timelapse, const TimelapseConfig *config);
+void timelapse_stop(Timelapse *timelapse);
+gboolean timelapse_is_running(Timelapse *timelapse);
+/* write the frames kept from before now, in the background, as a sequence of
+ * their own named after the next capture (frame0123-pre0000.jpeg, ...); the
+ * captures keep their numbers, as the last frames kept may be newer than the
+ * captures already queued; FALSE if there are none or nothing is running */
+gboolean timelapse_trigger(Timelapse *timelapse);
+void timelapse_get_status(Timelapse *timelapse, TimelapseStatus *status);
+/* stage timings of the snapshots, callers record STATS_STAGE_UI themselves */
+Stats *timelapse_get_timings(Timelapse *timelapse);
+/* one line with throughput, encoder queue, writes in flight and lag of the ticks */
+gchar *timelapse_format_status(Timelapse *timelapse);
+/* histogram of how late the captures of the last run were, NULL before
+ * the first one has ended */
+gchar *timelapse_format_jitter(Timelapse *timelapse);
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "swizzle.h"
+
+/* reference: the loop formerly used in camera_save_snapshot_to_file */
+#define SWAP_BYTES24(c) (c)=(((c) & 0xff00ff00) | (((c) >> 16)&0xff) | (((c) <<16)&0xff0000))
+
+static gboolean swizzle_bench_check(const SwizzleImpl *impl, const guint32 *src, gsize n)
+{
+    guint32 *expected = g_malloc(n * sizeof(guint32));
+    guint32 *result = g_malloc(n * sizeof(guint32));
+    gboolean ok = TRUE;
+    gsize j, len, offset;
+
+    memcpy(expected, src, n * sizeof(guint32));
+    for (j = 0; j < n; ++j)
+        SWAP_BYTES24(expected[j]);
+
+    /* odd lengths and offsets to cover the scalar tails and unaligned access,
+     * as far as the frame is large enough */
+    for (offset = 0; offset < 4 && offset < n && ok; ++offset) {
+        for (len = 0; len < 67 && len <= n - offset && ok; ++len) {
+            impl->func(result, src + offset, len);
+            ok = memcmp(result, expected + offset, len * sizeof(guint32)) == 0;
+        }
+    }
+
+    /* full frame, copying and in place */
+    if (ok) {
+        impl->func(result, src, n);
+        ok = memcmp(result, expected, n * sizeof(guint32)) == 0;
+    }
+    if (ok) {
+        memcpy(result, src, n * sizeof(guint32));
+        impl->func(result, result, n);
+        ok = memcmp(result, expected, n * sizeof(guint32)) == 0;
+    }
+
+    g_free(expected);
+    g_free(result);
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    guint width = argc > 1 ? strtoul(argv[1], NULL, 10) : 3840;
+    guint height = argc > 2 ? strtoul(argv[2], NULL, 10) : 2160;
+    guint iterations = argc > 3 ? strtoul(argv[3], NULL, 10) : 50;
+    gsize n = (gsize)width * height;
+    const SwizzleImpl *impls;
+    guint n_impls, j, k;
+    gint64 start, elapsed;
+    gboolean failed = FALSE;
+
+    if (n == 0 || iterations == 0) {
+        fprintf(stderr, "usage: %s [width] [height] [iterations]\n", argv[0]);
+        return 2;
+    }
+
+    guint32 *src = g_malloc(n * sizeof(guint32));
+    guint32 *dst = g_malloc(n * sizeof(guint32));
+    for (j = 0; j < n; ++j)
+        src[j] = g_random_int();
+
+    n_impls = swizzle_get_implementations(&impls);
+    for (j = 0; j < n_impls; ++j) {
+        if (!swizzle_bench_check(&impls[j], src, n)) {
+            printf("%-8s FAILED\n", impls[j].name);
+            failed = TRUE;
+            continue;
+        }
+
+        /* warm up caches and page tables */
+        impls[j].func(dst, src, n);
+
+        start = g_get_monotonic_time();
+        for (k = 0; k < iterations; ++k)
+            impls[j].func(dst, src, n);
+        elapsed = g_get_monotonic_time() - start;
+
+        printf("%-8s %8.3f ms/frame %10.1f Mpx/s%s\n", impls[j].name,
+                elapsed / 1000.0 / iterations,
+                (double)n * iterations / (elapsed ? elapsed : 1),
+                j == n_impls - 1 ? " (selected)" : "");
+    }
+
+    g_free(src);
+    g_free(dst);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "camera.h"
+#include "scheduler.h"
+#include "filename.h"
+#include "archive.h"
+#include "trace.h"
+
+/* capture to disk through the real pipeline, with a synthetic source;
+ * all results go to stdout as json, progress and errors to stderr */
+
+typedef struct {
+    gint64 queued;
+    gint64 saved;
+    gboolean taken;
+} TimelapseBenchFrame;
+
+typedef struct {
+    Camera *camera;
+    Scheduler *scheduler;
+    GMainLoop *loop;
+    gchar *pattern;
+
+    guint count;
+    guint next;
+    guint taken;
+    guint saved;
+    guint64 bytes;
+    TimelapseBenchFrame *frames;
+    gint64 *jitter;
+
+    gint64 start_time;
+    gint64 end_time;
+    struct rusage start_usage;
+    gint64 timeout;
+} TimelapseBench;
+
+static gchar *bench_source = "videotestsrc is-live=true";
+static gint bench_width = 1280;
+static gint bench_height = 720;
+static gint bench_interval = 200;
+static gint bench_count = 50;
+static gchar *bench_mode = "rgb";
+static gchar *bench_output = NULL;
+static gchar *bench_name = "frame0000.jpeg";
+static gint bench_threads = 2;
+static gint bench_queue = 8;
+static gint bench_quality = 75;
+static gboolean bench_archive = FALSE;
+static gboolean bench_keep = FALSE;
+static gint bench_io_depth = 8;
+
+static GOptionEntry bench_options[] = {
+    { "source", 's', 0, G_OPTION_ARG_STRING, &bench_source, "Source pipeline", "DESC" },
+    { "width", 0, 0, G_OPTION_ARG_INT, &bench_width, "Snapshot width", "N" },
+    { "height", 0, 0, G_OPTION_ARG_INT, &bench_height, "Snapshot height", "N" },
+    { "interval", 'i', 0, G_OPTION_ARG_INT, &bench_interval, "Interval in milliseconds", "MS" },
+    { "count", 'n', 0, G_OPTION_ARG_INT, &bench_count, "Number of frames", "N" },
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &bench_mode, "Capture mode (rgb, yuv, mjpeg)", "MODE" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &bench_output, "Output directory (default: temporary)", "DIR" },
+    { "name", 0, 0, G_OPTION_ARG_STRING, &bench_name, "Filename pattern", "NAME" },
+    { "threads", 't', 0, G_OPTION_ARG_INT, &bench_threads, "Encoder threads", "N" },
+    { "queue", 'q', 0, G_OPTION_ARG_INT, &bench_queue, "Encoder queue size", "N" },
+    { "quality", 0, 0, G_OPTION_ARG_INT, &bench_quality, "JPEG quality", "N" },
+    { "archive", 'a', 0, G_OPTION_ARG_NONE, &bench_archive, "Write into a frame archive", NULL },
+    { "keep", 'k', 0, G_OPTION_ARG_NONE, &bench_keep, "Keep the written files", NULL },
+    { "io-depth", 0, 0, G_OPTION_ARG_INT, &bench_io_depth,
+        "Files written at the same time with io_uring (0: plain writes)", "N" },
+    { NULL }
+};
+
+static gint bench_compare(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* values in microseconds, printed in milliseconds */
+static void bench_print_distribution(const gchar *name, gint64 *values, guint n, gboolean last)
+{
+    gint64 sum = 0;
+    guint j;
+
+    printf("  \"%s\": {", name);
+    if (n == 0) {
+        printf(" \"samples\": 0 }%s\n", last ? "" : ",");
+        return;
+    }
+
+    qsort(values, n, sizeof(gint64), bench_compare);
+    for (j = 0; j < n; ++j)
+        sum += values[j];
+
+    printf(" \"samples\": %u, \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, "
+            "\"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f }%s\n",
+            n, values[0] / 1e3, (gdouble)sum / n / 1e3,
+            values[n / 2] / 1e3, values[(n * 9) / 10] / 1e3, values[(n * 99) / 100] / 1e3,
+            values[n - 1] / 1e3, last ? "" : ",");
+}
+
+static void bench_saved(const gchar *filename, Frame *frame, TimelapseBenchFrame *bench_frame)
+{
+    bench_frame->saved = g_get_monotonic_time();
+}
+
+static gboolean bench_tick(gint64 deadline, TimelapseBench *bench)
+{
+    TimelapseBenchFrame *frame = &bench->frames[bench->next];
+    gchar *filename = filename_generate(bench->pattern, bench->next);
+    gint64 start = TRACE_BEGIN();
+
+    bench->jitter[bench->next] = g_get_monotonic_time() - deadline;
+    frame->queued = g_get_monotonic_time();
+    frame->taken = camera_save_snapshot_to_file(bench->camera, filename,
+            bench_width, bench_height, (CAMERA_SNAPSHOT_TAKEN_CALLBACK)bench_saved, frame);
+    if (frame->taken)
+        ++bench->taken;
+    g_free(filename);
+    TRACE_END("scheduler", "tick", start);
+
+    return ++bench->next < bench->count;
+}
+
+/* waits for the first frame, then for the encoder to finish */
+static gboolean bench_poll(TimelapseBench *bench)
+{
+    EncoderStats stats;
+    gint64 now = g_get_monotonic_time();
+
+    if (bench->scheduler == NULL) {
+        if (camera_has_frame(bench->camera)) {
+            bench->scheduler = scheduler_new(bench_interval * 1000, SCHEDULER_CATCHUP_SKIP);
+            bench->start_time = now;
+            getrusage(RUSAGE_SELF, &bench->start_usage);
+            scheduler_start(bench->scheduler, NULL, now,
+                    (SCHEDULER_TICK_CALLBACK)bench_tick, bench);
+        }
+        else if (now > bench->timeout) {
+            fprintf(stderr, "No frames from the source\n");
+            g_main_loop_quit(bench->loop);
+            return G_SOURCE_REMOVE;
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (bench->next < bench->count)
+        return G_SOURCE_CONTINUE;
+
+    camera_get_encoder_stats(bench->camera, &stats);
+    if (stats.pending == 0 && stats.writer.in_flight == 0) {
+        bench->end_time = now;
+        g_main_loop_quit(bench->loop);
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static guint64 bench_file_size(const gchar *path)
+{
+    struct stat st;
+    guint64 size = stat(path, &st) == 0 ? st.st_size : 0;
+
+    if (!bench_keep)
+        g_unlink(path);
+
+    return size;
+}
+
+/* size of everything we wrote, removed unless it should be kept */
+static guint64 bench_count_bytes(TimelapseBench *bench, const gchar *archive)
+{
+    guint64 bytes = 0;
+    gchar *path;
+    guint j;
+
+    if (archive) {
+        bytes += bench_file_size(archive);
+        path = g_strconcat(archive, ARCHIVE_INDEX_SUFFIX, NULL);
+        bytes += bench_file_size(path);
+        g_free(path);
+        return bytes;
+    }
+
+    for (j = 0; j < bench->count; ++j) {
+        path = filename_generate(bench->pattern, j);
+        bytes += bench_file_size(path);
+        g_free(path);
+    }
+
+    return bytes;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context = g_option_context_new("- capture benchmark");
+    GError *err = NULL;
+    TimelapseBench bench;
+    JpegencOptions jpeg;
+    WriterOptions writer;
+    EncoderStats stats;
+    struct rusage usage;
+    gint64 *latency;
+    gdouble wall, cpu_user, cpu_system;
+    gchar *dir, *escaped, *archive = NULL;
+    guint j, n;
+
+    g_option_context_add_main_entries(context, bench_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        g_clear_error(&err);
+        return 2;
+    }
+    g_option_context_free(context);
+
+    if (bench_count <= 0 || bench_interval <= 0) {
+        fprintf(stderr, "count and interval must be positive\n");
+        return 2;
+    }
+
+    if (bench_output) {
+        dir = g_strdup(bench_output);
+    }
+    else if ((dir = g_dir_make_tmp("timelapse-bench-XXXXXX", &err)) == NULL) {
+        fprintf(stderr, "%s\n", err->message);
+        g_clear_error(&err);
+        return 1;
+    }
+
+    trace_init();
+
+    memset(&bench, 0, sizeof(bench));
+    bench.count = bench_count;
+    bench.frames = g_malloc0(sizeof(TimelapseBenchFrame) * bench.count);
+    bench.jitter = g_malloc0(sizeof(gint64) * bench.count);
+    bench.pattern = g_build_filename(dir, bench_name, NULL);
+    bench.loop = g_main_loop_new(NULL, FALSE);
+
+    bench.camera = camera_new();
+    camera_set_preview(bench.camera, FALSE);
+    camera_set_source(bench.camera, bench_source);
+    camera_set_capture_mode(bench.camera, camera_capture_mode_from_string(bench_mode));
+    camera_set_snapshot_size(bench.camera, bench_width, bench_height);
+    camera_set_encoder_threads(bench.camera, bench_threads, bench_queue);
+    jpegenc_options_init(&jpeg);
+    jpeg.quality = bench_quality;
+    camera_set_jpeg_options(bench.camera, &jpeg);
+    writer_options_init(&writer);
+    writer.io_uring = bench_io_depth > 0;
+    writer.io_depth = bench_io_depth;
+    camera_set_writer_options(bench.camera, &writer);
+    if (bench_archive) {
+        archive = g_build_filename(dir, "frames.tlpack", NULL);
+        camera_set_archive(bench.camera, archive);
+    }
+
+    camera_start(bench.camera);
+    bench.timeout = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+    g_timeout_add(10, (GSourceFunc)bench_poll, &bench);
+    g_main_loop_run(bench.loop);
+
+    /* the encoder may still deliver callbacks */
+    while (g_main_context_iteration(NULL, FALSE));
+
+    camera_stop(bench.camera);
+    camera_get_encoder_stats(bench.camera, &stats);
+    getrusage(RUSAGE_SELF, &usage);
+    camera_destroy(bench.camera);
+    trace_close();
+
+    bench.bytes = bench_count_bytes(&bench, archive);
+    if (!bench_keep && !bench_output)
+        g_rmdir(dir);
+
+    latency = g_malloc(sizeof(gint64) * bench.count);
+    for (j = 0, n = 0; j < bench.count; ++j) {
+        if (bench.frames[j].taken && bench.frames[j].saved)
+            latency[n++] = bench.frames[j].saved - bench.frames[j].queued;
+    }
+    bench.saved = n;
+
+    wall = bench.end_time > bench.start_time ? (bench.end_time - bench.start_time) / 1e6 : 0.0;
+    /* only the time spent capturing, not the pipeline setup */
+    cpu_user = (usage.ru_utime.tv_sec - bench.start_usage.ru_utime.tv_sec) +
+        (usage.ru_utime.tv_usec - bench.start_usage.ru_utime.tv_usec) / 1e6;
+    cpu_system = (usage.ru_stime.tv_sec - bench.start_usage.ru_stime.tv_sec) +
+        (usage.ru_stime.tv_usec - bench.start_usage.ru_stime.tv_usec) / 1e6;
+    escaped = g_strescape(bench_source, NULL);
+
+    printf("{\n");
+    printf("  \"source\": \"%s\",\n", escaped);
+    printf("  \"mode\": \"%s\",\n", bench_mode);
+    printf("  \"width\": %d,\n  \"height\": %d,\n", bench_width, bench_height);
+    printf("  \"interval_ms\": %d,\n", bench_interval);
+    printf("  \"encoder_threads\": %d,\n  \"encoder_queue\": %d,\n", bench_threads, bench_queue);
+    printf("  \"archive\": %s,\n", bench_archive ? "true" : "false");
+    printf("  \"frames\": { \"requested\": %u, \"taken\": %u, \"saved\": %u, "
+            "\"written\": %" G_GUINT64_FORMAT ", \"dropped\": %" G_GUINT64_FORMAT ", "
+            "\"failed\": %" G_GUINT64_FORMAT ", \"max_pending\": %u },\n",
+            bench.count, bench.taken, bench.saved,
+            stats.written, stats.dropped, stats.failed, stats.max_pending);
+    printf("  \"wall_s\": %.3f,\n", wall);
+    printf("  \"throughput_fps\": %.3f,\n", wall > 0 ? stats.written / wall : 0.0);
+    printf("  \"bytes_written\": %" G_GUINT64_FORMAT ",\n", bench.bytes);
+    printf("  \"throughput_mb_s\": %.3f,\n", wall > 0 ? bench.bytes / wall / 1e6 : 0.0);
+    printf("  \"writer\": { \"io_depth\": %d, \"max_in_flight\": %u, "
+            "\"failed\": %" G_GUINT64_FORMAT " },\n",
+            bench_io_depth, stats.writer.max_in_flight, stats.writer.failed);
+    printf("  \"cpu\": { \"user_s\": %.3f, \"system_s\": %.3f, \"percent\": %.1f },\n",
+            cpu_user, cpu_system, wall > 0 ? 100.0 * (cpu_user + cpu_system) / wall : 0.0);
+    bench_print_distribution("latency_ms", latency, n, FALSE);
+    bench_print_distribution("jitter_ms", bench.jitter, bench.next, TRUE);
+    printf("}\n");
+
+    g_free(escaped);
+    g_free(latency);
+    g_free(bench.frames);
+    g_free(bench.jitter);
+    g_free(bench.pattern);
+    g_free(archive);
+    g_free(dir);
+    g_main_loop_unref(bench.loop);
+    scheduler_destroy(bench.scheduler);
+
+    return bench.taken > 0 && stats.failed + stats.writer.failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "archive.h"
+#include "filename.h"
+
+static void timelapse_extract_usage(const gchar *name)
+{
+    fprintf(stderr, "usage: %s ARCHIVE [PATTERN]\n"
+            "       %s -l ARCHIVE\n"
+            "Writes every frame to PATTERN (default frame0000.jpeg) with its\n"
+            "number added to the last number in the name, or lists the frames.\n",
+            name, name);
+}
+
+static void timelapse_extract_list(ArchiveReader *reader)
+{
+    ArchiveEntry entry;
+    struct tm *tm;
+    time_t t;
+    gchar tbuf[64];
+    guint64 j, n = archive_reader_get_n_entries(reader);
+
+    for (j = 0; j < n; ++j) {
+        archive_reader_get_entry(reader, j, &entry);
+        t = entry.timestamp / G_USEC_PER_SEC;
+        tm = localtime(&t);
+        strftime(tbuf, sizeof(tbuf), "%F %T", tm);
+        printf("%8" G_GUINT64_FORMAT " %s.%06u %10" G_GUINT64_FORMAT " bytes\n",
+                entry.number, tbuf, (guint)(entry.timestamp % G_USEC_PER_SEC), entry.size);
+    }
+}
+
+static gboolean timelapse_extract_frames(ArchiveReader *reader, const gchar *pattern)
+{
+    ArchiveEntry entry;
+    GError *err = NULL;
+    gchar *filename;
+    guint64 j, n = archive_reader_get_n_entries(reader);
+
+    for (j = 0; j < n; ++j) {
+        archive_reader_get_entry(reader, j, &entry);
+        filename = filename_generate(pattern, entry.number);
+        if (!g_file_set_contents(filename,
+                    (const gchar *)archive_reader_get_data(reader, &entry), entry.size, &err)) {
+            fprintf(stderr, "%s\n", err->message);
+            g_clear_error(&err);
+            g_free(filename);
+            return FALSE;
+        }
+        g_free(filename);
+    }
+
+    printf("%" G_GUINT64_FORMAT " frames extracted\n", n);
+
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    ArchiveReader *reader;
+    gboolean list = FALSE;
+    gboolean result;
+    int arg = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+        list = TRUE;
+        ++arg;
+    }
+
+    if (arg >= argc || argc - arg > (list ? 1 : 2)) {
+        timelapse_extract_usage(argv[0]);
+        return 2;
+    }
+
+    reader = archive_reader_open(argv[arg]);
+    if (reader == NULL)
+        return 1;
+
+    if (list) {
+        timelapse_extract_list(reader);
+        result = TRUE;
+    }
+    else {
+        result = timelapse_extract_frames(reader, arg + 1 < argc ? argv[arg + 1] : "frame0000.jpeg");
+    }
+
+    archive_reader_close(reader);
+
+    return result ? 0 : 1;
+}
@@ -0,0 +1,130 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* events are collected in memory and written in blocks of this size */
+#define TRACE_FLUSH_SIZE 65536
+
+gint trace_active = 0;
+
+static GMutex trace_lock;
+static FILE *trace_file = NULL;
+static GString *trace_buffer = NULL;
+static gint64 trace_epoch = 0;
+static gboolean trace_first_event = TRUE;
+
+void trace_init(void)
+{
+    const gchar *filename = g_getenv("TIMELAPSE_TRACE");
+
+    if (filename && filename[0])
+        trace_open(filename);
+}
+
+gboolean trace_open(const gchar *filename)
+{
+    g_return_val_if_fail(filename != NULL, FALSE);
+
+    FILE *f;
+
+    g_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        g_mutex_unlock(&trace_lock);
+        g_printerr("Not tracing to %s, a trace is already open\n", filename);
+        return FALSE;
+    }
+
+    if ((f = fopen(filename, "w")) == NULL) {
+        g_mutex_unlock(&trace_lock);
+        g_printerr("Error opening %s: %s\n", filename, strerror(errno));
+        return FALSE;
+    }
+
+    trace_file = f;
+    trace_buffer = g_string_sized_new(TRACE_FLUSH_SIZE + 256);
+    trace_epoch = g_get_monotonic_time();
+    trace_first_event = TRUE;
+
+    /* the closing bracket is optional, a trace cut short by a crash still loads */
+    g_string_append_c(trace_buffer, '[');
+    g_atomic_int_set(&trace_active, 1);
+    g_mutex_unlock(&trace_lock);
+
+    return TRUE;
+}
+
+/* call with trace_lock held */
+static void trace_flush(void)
+{
+    if (fwrite(trace_buffer->str, 1, trace_buffer->len, trace_file) != trace_buffer->len
+            || fflush(trace_file) != 0)
+        g_printerr("Error writing trace: %s\n", strerror(errno));
+    g_string_truncate(trace_buffer, 0);
+}
+
+void trace_close(void)
+{
+    g_mutex_lock(&trace_lock);
+    if (trace_file == NULL) {
+        g_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    g_atomic_int_set(&trace_active, 0);
+    g_string_append(trace_buffer, "\n]\n");
+    trace_flush();
+    fclose(trace_file);
+    trace_file = NULL;
+    g_string_free(trace_buffer, TRUE);
+    trace_buffer = NULL;
+    g_mutex_unlock(&trace_lock);
+}
+
+static void trace_append(const gchar *category, const gchar *name, gchar phase,
+        gint64 start, gint64 end)
+{
+    gint tid = (gint)syscall(SYS_gettid);
+
+    g_mutex_lock(&trace_lock);
+    /* closed while we were on our way here */
+    if (trace_file == NULL) {
+        g_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    g_string_append_printf(trace_buffer,
+            "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%" G_GINT64_FORMAT,
+            trace_first_event ? "" : ",", category, name, phase, (gint)getpid(), tid,
+            start - trace_epoch);
+    if (phase == 'X')
+        g_string_append_printf(trace_buffer, ",\"dur\":%" G_GINT64_FORMAT "}", end - start);
+    else
+        g_string_append(trace_buffer, ",\"s\":\"t\"}");
+    trace_first_event = FALSE;
+
+    /* a slow disk stalls the traced threads here, which shows up in the trace */
+    if (trace_buffer->len >= TRACE_FLUSH_SIZE)
+        trace_flush();
+    g_mutex_unlock(&trace_lock);
+}
+
+void trace_span(const gchar *category, const gchar *name, gint64 start, gint64 end)
+{
+    g_return_if_fail(category != NULL);
+    g_return_if_fail(name != NULL);
+
+    trace_append(category, name, 'X', start, end);
+}
+
+void trace_instant(const gchar *category, const gchar *name)
+{
+    g_return_if_fail(category != NULL);
+    g_return_if_fail(name != NULL);
+
+    trace_append(category, name, 'i', g_get_monotonic_time(), 0);
+}
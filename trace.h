@@ -0,0 +1,31 @@
+#pragma once
+
+#include <glib.h>
+
+/* Spans in the Chrome trace event format (chrome://tracing, ui.perfetto.dev).
+ * While no trace file is open every trace point is a single predicted
+ * branch on trace_active, so they stay compiled in. */
+
+/* non-zero while a trace file is open, read without locking */
+extern gint trace_active;
+
+#define trace_enabled() G_UNLIKELY(trace_active)
+
+/* start of a span, 0 when tracing is off */
+#define TRACE_BEGIN() (trace_enabled() ? g_get_monotonic_time() : 0)
+/* spans begun before the trace was opened are dropped */
+#define TRACE_END(category, name, start) \
+    G_STMT_START { \
+        if (trace_enabled() && (start) != 0) \
+            trace_span((category), (name), (start), g_get_monotonic_time()); \
+    } G_STMT_END
+
+/* opens the file named in TIMELAPSE_TRACE, if any */
+void trace_init(void);
+gboolean trace_open(const gchar *filename);
+/* writes everything still buffered */
+void trace_close(void);
+
+/* category and name are written unescaped, times are g_get_monotonic_time() */
+void trace_span(const gchar *category, const gchar *name, gint64 start, gint64 end);
+void trace_instant(const gchar *category, const gchar *name);
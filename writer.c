@@ -0,0 +1,745 @@
+/* fallocate, sync_file_range */
+#define _GNU_SOURCE
+
+#include "writer.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/* files waiting for a batched sync keep their descriptor open, more than
+ * this many make the encoder threads wait for the writer thread */
+#define WRITER_MAX_PENDING 64
+/* size of the io_uring, io_depth is limited to this */
+#define WRITER_URING_ENTRIES 64
+
+typedef struct {
+    int fd;
+    gchar *tmpname;
+    gchar *filename;
+    Stats *timings;
+    WRITER_DONE_CALLBACK callback; /* NULL once called */
+    gpointer userdata;
+    gint64 start;   /* monotonic time the file was handed to us */
+    gint64 written; /* ... and its data was written */
+
+    /* owned until the data has been written */
+    const guchar *data;
+    gsize size;
+    gsize done;
+    GDestroyNotify free_func;
+    gpointer free_data;
+    gboolean syncing; /* io_uring: the fdatasync of WRITER_SYNC_FRAME was submitted */
+} WriterFile;
+
+struct _Writer {
+    GMutex lock;
+    GCond cond;
+    WriterOptions options;
+    WriterStats stats;
+    GPtrArray *pending; /* WriterFile waiting for the next batch */
+    gint64 first_pending;
+    GThread *thread;
+    gboolean quit;
+    int drop_fd; /* WRITER_SYNC_NEVER: last file, its pages are dropped with the next one */
+
+#ifdef HAVE_LIBURING
+    /* submitted under lock by the encoder threads, reaped by a thread of its own */
+    struct io_uring ring;
+    GThread *reaper;
+    gboolean ring_failed;
+    guint ring_in_flight; /* files with a write or fdatasync in the ring */
+#endif
+};
+
+static const gchar *writer_sync_policy_names[] = {
+    "never",
+    "frame",
+    "frames",
+    "interval"
+};
+
+void writer_options_init(WriterOptions *options)
+{
+    g_return_if_fail(options != NULL);
+
+    memset(options, 0, sizeof(WriterOptions));
+    options->sync = WRITER_SYNC_NEVER;
+    options->sync_frames = 10;
+    options->sync_interval = 5000;
+    options->io_uring = TRUE;
+    options->io_depth = 8;
+}
+
+WriterSyncPolicy writer_sync_policy_from_string(const gchar *str)
+{
+    guint j;
+
+    for (j = 0; j < G_N_ELEMENTS(writer_sync_policy_names); ++j) {
+        if (g_strcmp0(str, writer_sync_policy_names[j]) == 0)
+            return (WriterSyncPolicy)j;
+    }
+
+    return WRITER_SYNC_NEVER;
+}
+
+const gchar *writer_sync_policy_to_string(WriterSyncPolicy policy)
+{
+    if (policy >= G_N_ELEMENTS(writer_sync_policy_names))
+        return writer_sync_policy_names[WRITER_SYNC_NEVER];
+
+    return writer_sync_policy_names[policy];
+}
+
+gchar *writer_get_temp_filename(const gchar *filename)
+{
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    gchar *dir = g_path_get_dirname(filename);
+    gchar *base = g_path_get_basename(filename);
+    gchar *hidden = g_strdup_printf(".%s.tmp", base);
+    gchar *tmpname = g_build_filename(dir, hidden, NULL);
+
+    g_free(hidden);
+    g_free(base);
+    g_free(dir);
+
+    return tmpname;
+}
+
+static WriterFile *writer_file_new(const gchar *tmpname, const gchar *filename, Stats *timings,
+        WRITER_DONE_CALLBACK callback, gpointer userdata)
+{
+    WriterFile *file = g_malloc0(sizeof(WriterFile));
+
+    file->fd = -1;
+    file->tmpname = g_strdup(tmpname);
+    file->filename = g_strdup(filename);
+    file->timings = timings;
+    file->callback = callback;
+    file->userdata = userdata;
+    file->start = g_get_monotonic_time();
+
+    return file;
+}
+
+static void writer_file_release_data(WriterFile *file)
+{
+    if (file->free_func)
+        file->free_func(file->free_data);
+    file->free_func = NULL;
+    file->data = NULL;
+}
+
+/* tells the owner of file how it ended, only the first time */
+static void writer_file_report(WriterFile *file, gboolean success)
+{
+    WRITER_DONE_CALLBACK callback = file->callback;
+
+    file->callback = NULL;
+    if (callback)
+        callback(file->filename, success, file->userdata);
+}
+
+/* a file that was not reported before has failed */
+static void writer_file_free(WriterFile *file)
+{
+    if (file == NULL)
+        return;
+
+    writer_file_release_data(file);
+    writer_file_report(file, FALSE);
+    if (file->fd != -1)
+        close(file->fd);
+    g_free(file->tmpname);
+    g_free(file->filename);
+    g_free(file);
+}
+
+/* a rename only lasts once the directory entry is on disk as well */
+static void writer_sync_directory(const gchar *dir)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if (fd == -1 || fsync(fd) != 0)
+        g_printerr("Error syncing %s: %s\n", dir, strerror(errno));
+    if (fd != -1)
+        close(fd);
+}
+
+/* only pages that are clean are dropped: the write-back of fd is started now,
+ * but its pages are dropped when the next file gets here, by then it is
+ * usually done; waiting for it would hold up the encoder threads */
+static void writer_drop_behind(Writer *writer, int fd)
+{
+    int behind = dup(fd);
+
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+    g_mutex_lock(&writer->lock);
+    fd = writer->drop_fd;
+    writer->drop_fd = behind;
+    g_mutex_unlock(&writer->lock);
+
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/* closes the file and gives it its name, with sync after fdatasync; the directory
+ * is left to the caller; drop_cache only once the file is on disk */
+static gboolean writer_finish_file(WriterFile *file, gboolean sync, gboolean drop_cache)
+{
+    gboolean result = TRUE;
+
+    if (sync && fdatasync(file->fd) != 0) {
+        g_printerr("Error syncing %s: %s\n", file->filename, strerror(errno));
+        result = FALSE;
+    }
+    if (drop_cache)
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    if (close(file->fd) != 0 && result) {
+        g_printerr("Error writing %s: %s\n", file->filename, strerror(errno));
+        result = FALSE;
+    }
+    file->fd = -1;
+
+    if (result && rename(file->tmpname, file->filename) != 0) {
+        g_printerr("Error renaming %s: %s\n", file->tmpname, strerror(errno));
+        result = FALSE;
+    }
+    if (!result)
+        unlink(file->tmpname);
+
+    return result;
+}
+
+/* WRITER_SYNC_FRAME: data, name and directory entry are on disk when this returns */
+static gboolean writer_finish_durable(WriterFile *file, gboolean sync, gboolean drop_cache)
+{
+    gchar *dir;
+
+    if (!writer_finish_file(file, sync, drop_cache))
+        return FALSE;
+
+    dir = g_path_get_dirname(file->filename);
+    writer_sync_directory(dir);
+    g_free(dir);
+    stats_record(file->timings, STATS_STAGE_SYNC, g_get_monotonic_time() - file->written);
+
+    return TRUE;
+}
+
+/* in the writer thread: one fdatasync per file, then all renames, then the
+ * directories, which usually is a single one */
+static void writer_sync_batch(GPtrArray *batch, gboolean drop_cache)
+{
+    GPtrArray *dirs = g_ptr_array_new_with_free_func(g_free);
+    WriterFile *file;
+    gchar *dir;
+    gint64 now;
+    guint j, k;
+
+    for (j = 0; j < batch->len; ++j) {
+        file = g_ptr_array_index(batch, j);
+        if (!writer_finish_file(file, TRUE, drop_cache)) {
+            writer_file_report(file, FALSE);
+            continue;
+        }
+        dir = g_path_get_dirname(file->filename);
+        for (k = 0; k < dirs->len; ++k) {
+            if (strcmp(dir, g_ptr_array_index(dirs, k)) == 0)
+                break;
+        }
+        if (k == dirs->len)
+            g_ptr_array_add(dirs, dir);
+        else
+            g_free(dir);
+    }
+
+    for (k = 0; k < dirs->len; ++k)
+        writer_sync_directory(g_ptr_array_index(dirs, k));
+    g_ptr_array_unref(dirs);
+
+    /* only the failed ones have been reported yet */
+    now = g_get_monotonic_time();
+    for (j = 0; j < batch->len; ++j) {
+        file = g_ptr_array_index(batch, j);
+        if (file->callback == NULL)
+            continue;
+        stats_record(file->timings, STATS_STAGE_SYNC, now - file->written);
+        writer_file_report(file, TRUE);
+    }
+}
+
+static gboolean writer_is_batched(WriterSyncPolicy policy)
+{
+    return policy == WRITER_SYNC_FRAMES || policy == WRITER_SYNC_INTERVAL;
+}
+
+/* called with the lock held */
+static gboolean writer_batch_due(Writer *writer, gint64 now)
+{
+    const WriterOptions *options = &writer->options;
+
+    if (writer->pending->len == 0)
+        return FALSE;
+    if (writer->quit || writer->pending->len >= WRITER_MAX_PENDING)
+        return TRUE;
+
+    switch (options->sync) {
+        case WRITER_SYNC_FRAMES:
+            return writer->pending->len >= options->sync_frames;
+        case WRITER_SYNC_INTERVAL:
+            return now >= writer->first_pending + (gint64)options->sync_interval * 1000;
+        default:
+            /* the policy has been changed, do not keep them any longer */
+            return TRUE;
+    }
+}
+
+static gpointer writer_thread(Writer *writer)
+{
+    GPtrArray *batch;
+    gboolean drop_cache;
+    gint64 now;
+
+    g_mutex_lock(&writer->lock);
+    while (!writer->quit || writer->pending->len) {
+        now = g_get_monotonic_time();
+        if (!writer_batch_due(writer, now)) {
+            if (writer->pending->len && writer->options.sync == WRITER_SYNC_INTERVAL)
+                g_cond_wait_until(&writer->cond, &writer->lock,
+                        writer->first_pending + (gint64)writer->options.sync_interval * 1000);
+            else
+                g_cond_wait(&writer->cond, &writer->lock);
+            continue;
+        }
+
+        batch = writer->pending;
+        writer->pending = g_ptr_array_new_with_free_func((GDestroyNotify)writer_file_free);
+        drop_cache = writer->options.drop_cache;
+        /* there is room again */
+        g_cond_broadcast(&writer->cond);
+        g_mutex_unlock(&writer->lock);
+
+        writer_sync_batch(batch, drop_cache);
+        g_ptr_array_unref(batch);
+
+        g_mutex_lock(&writer->lock);
+    }
+    g_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+/* takes ownership of file; the file is written, what is left is up to the policy,
+ * it is reported once it has its name */
+static void writer_hand_over(Writer *writer, WriterFile *file)
+{
+    WriterSyncPolicy sync;
+    gboolean drop_cache;
+    gboolean result;
+
+    g_mutex_lock(&writer->lock);
+    sync = writer->options.sync;
+    drop_cache = writer->options.drop_cache;
+    if (writer_is_batched(sync)) {
+        if (writer->pending->len == 0)
+            writer->first_pending = file->written;
+        g_ptr_array_add(writer->pending, file);
+        g_cond_broadcast(&writer->cond);
+        g_mutex_unlock(&writer->lock);
+        return;
+    }
+    g_mutex_unlock(&writer->lock);
+
+    if (sync == WRITER_SYNC_FRAME) {
+        result = writer_finish_durable(file, TRUE, drop_cache);
+    }
+    else {
+        if (drop_cache)
+            writer_drop_behind(writer, file->fd);
+        result = writer_finish_file(file, FALSE, FALSE);
+    }
+    writer_file_report(file, result);
+    writer_file_free(file);
+}
+
+/* the data of file is out of our hands, successfully or not */
+static void writer_written(Writer *writer, WriterFile *file, gboolean success)
+{
+    file->written = g_get_monotonic_time();
+    stats_record(file->timings, STATS_STAGE_WRITE, file->written - file->start);
+    if (trace_enabled())
+        trace_span("writer", "write", file->start, file->written);
+    writer_file_release_data(file);
+
+    g_mutex_lock(&writer->lock);
+    --writer->stats.in_flight;
+    if (success) {
+        ++writer->stats.files;
+        writer->stats.bytes += file->size;
+    }
+    else {
+        ++writer->stats.failed;
+    }
+    g_cond_broadcast(&writer->cond);
+    g_mutex_unlock(&writer->lock);
+}
+
+static gboolean writer_write_blocking(WriterFile *file)
+{
+    gssize written;
+
+    while (file->done < file->size) {
+        written = write(file->fd, file->data + file->done, file->size - file->done);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            g_printerr("Error writing %s: %s\n", file->tmpname, strerror(errno));
+            return FALSE;
+        }
+        file->done += written;
+    }
+
+    return TRUE;
+}
+
+#ifdef HAVE_LIBURING
+/* called with the lock held, file already counts in ring_in_flight; FALSE if
+ * nothing was submitted */
+static gboolean writer_submit(Writer *writer, WriterFile *file)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&writer->ring);
+    int err;
+
+    /* ring_in_flight never exceeds the entries, this is only for safety */
+    if (sqe == NULL)
+        return FALSE;
+
+    if (file->syncing)
+        io_uring_prep_fsync(sqe, file->fd, IORING_FSYNC_DATASYNC);
+    else
+        io_uring_prep_write(sqe, file->fd, file->data + file->done, file->size - file->done,
+                file->done);
+    io_uring_sqe_set_data(sqe, file);
+
+    if ((err = io_uring_submit(&writer->ring)) < 0) {
+        g_printerr("Error submitting %s: %s\n", file->tmpname, strerror(-err));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* in the reaper thread, res as from write() or fdatasync() but -errno */
+static void writer_complete(Writer *writer, WriterFile *file, int res)
+{
+    gboolean success, drop_cache;
+    gboolean submitted = FALSE;
+
+    if (file->syncing) {
+        g_mutex_lock(&writer->lock);
+        drop_cache = writer->options.drop_cache;
+        --writer->ring_in_flight;
+        g_cond_broadcast(&writer->cond);
+        g_mutex_unlock(&writer->lock);
+
+        if (res < 0) {
+            g_printerr("Error syncing %s: %s\n", file->filename, strerror(-res));
+            unlink(file->tmpname);
+        }
+        else {
+            writer_file_report(file, writer_finish_durable(file, FALSE, drop_cache));
+        }
+        writer_file_free(file);
+        return;
+    }
+
+    if (res > 0)
+        file->done += res;
+    success = res >= 0 && file->done == file->size;
+
+    /* the rest of a short write keeps its place in the ring */
+    if (res > 0 && !success) {
+        g_mutex_lock(&writer->lock);
+        submitted = writer_submit(writer, file);
+        g_mutex_unlock(&writer->lock);
+        if (submitted)
+            return;
+        success = writer_write_blocking(file);
+    }
+    else if (res < 0) {
+        g_printerr("Error writing %s: %s\n", file->tmpname, strerror(-res));
+    }
+    else if (!success) {
+        g_printerr("Error writing %s: no space left\n", file->tmpname);
+    }
+    writer_written(writer, file, success);
+
+    g_mutex_lock(&writer->lock);
+    if (success && writer->options.sync == WRITER_SYNC_FRAME) {
+        file->syncing = TRUE;
+        submitted = writer_submit(writer, file);
+    }
+    if (!submitted) {
+        --writer->ring_in_flight;
+        g_cond_broadcast(&writer->cond);
+    }
+    g_mutex_unlock(&writer->lock);
+
+    if (submitted)
+        return;
+    if (!success) {
+        unlink(file->tmpname);
+        writer_file_free(file);
+        return;
+    }
+    /* the fdatasync could not be submitted, the policy still applies */
+    file->syncing = FALSE;
+    writer_hand_over(writer, file);
+}
+
+static gpointer writer_reaper(Writer *writer)
+{
+    struct io_uring_cqe *cqe;
+    WriterFile *file;
+    int res, err;
+
+    for (;;) {
+        if ((err = io_uring_wait_cqe(&writer->ring, &cqe)) < 0) {
+            if (err == -EINTR || err == -EAGAIN)
+                continue;
+            g_printerr("Error waiting for io_uring: %s\n", strerror(-err));
+            break;
+        }
+        file = io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&writer->ring, cqe);
+
+        /* the nop from writer_destroy */
+        if (file == NULL)
+            break;
+        writer_complete(writer, file, res);
+    }
+
+    return NULL;
+}
+
+/* called with the lock held; the ring is set up on first use, if that fails
+ * everything is written directly */
+static gboolean writer_use_ring(Writer *writer)
+{
+    int err;
+
+    if (!writer->options.io_uring || writer->ring_failed)
+        return FALSE;
+    if (writer->reaper)
+        return TRUE;
+
+    if ((err = io_uring_queue_init(WRITER_URING_ENTRIES, &writer->ring, 0)) < 0) {
+        g_printerr("io_uring is not available (%s), writing files directly\n", strerror(-err));
+        writer->ring_failed = TRUE;
+        return FALSE;
+    }
+    writer->reaper = g_thread_new("writer-uring", (GThreadFunc)writer_reaper, writer);
+
+    return TRUE;
+}
+
+/* after everything was written */
+static void writer_close_ring(Writer *writer)
+{
+    struct io_uring_sqe *sqe;
+
+    if (writer->reaper == NULL)
+        return;
+
+    g_mutex_lock(&writer->lock);
+    while (writer->ring_in_flight)
+        g_cond_wait(&writer->cond, &writer->lock);
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+    io_uring_submit(&writer->ring);
+    g_mutex_unlock(&writer->lock);
+
+    g_thread_join(writer->reaper);
+    writer->reaper = NULL;
+    io_uring_queue_exit(&writer->ring);
+}
+#endif
+
+Writer *writer_new(const WriterOptions *options)
+{
+    Writer *writer = g_malloc0(sizeof(Writer));
+
+    if (options)
+        writer->options = *options;
+    else
+        writer_options_init(&writer->options);
+
+    g_mutex_init(&writer->lock);
+    g_cond_init(&writer->cond);
+    writer->pending = g_ptr_array_new_with_free_func((GDestroyNotify)writer_file_free);
+    writer->drop_fd = -1;
+    writer->thread = g_thread_new("writer", (GThreadFunc)writer_thread, writer);
+
+    return writer;
+}
+
+void writer_destroy(Writer *writer)
+{
+    if (writer == NULL)
+        return;
+
+#ifdef HAVE_LIBURING
+    /* its files may still end up in a batch */
+    writer_close_ring(writer);
+#endif
+
+    g_mutex_lock(&writer->lock);
+    writer->quit = TRUE;
+    g_cond_broadcast(&writer->cond);
+    g_mutex_unlock(&writer->lock);
+    g_thread_join(writer->thread);
+
+    /* whatever of it is on disk by now */
+    if (writer->drop_fd != -1) {
+        posix_fadvise(writer->drop_fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(writer->drop_fd);
+    }
+    g_ptr_array_unref(writer->pending);
+    g_cond_clear(&writer->cond);
+    g_mutex_clear(&writer->lock);
+    g_free(writer);
+}
+
+void writer_set_options(Writer *writer, const WriterOptions *options)
+{
+    g_return_if_fail(writer != NULL);
+    g_return_if_fail(options != NULL);
+
+    g_mutex_lock(&writer->lock);
+    writer->options = *options;
+    g_cond_broadcast(&writer->cond);
+    g_mutex_unlock(&writer->lock);
+}
+
+void writer_get_stats(Writer *writer, WriterStats *stats)
+{
+    g_return_if_fail(writer != NULL);
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(&writer->lock);
+    *stats = writer->stats;
+    g_mutex_unlock(&writer->lock);
+}
+
+void writer_write_file(Writer *writer, const gchar *filename, const guchar *data, gsize size,
+        GDestroyNotify free_func, gpointer free_data, Stats *timings,
+        WRITER_DONE_CALLBACK callback, gpointer userdata)
+{
+    g_return_if_fail(writer != NULL);
+    g_return_if_fail(filename != NULL);
+
+    gchar *tmpname = writer_get_temp_filename(filename);
+    WriterFile *file = writer_file_new(tmpname, filename, timings, callback, userdata);
+    gboolean preallocate;
+#ifdef HAVE_LIBURING
+    gboolean async;
+#endif
+
+    g_free(tmpname);
+    file->data = data;
+    file->size = size;
+    file->free_func = free_func;
+    file->free_data = free_data;
+
+    g_mutex_lock(&writer->lock);
+    while (writer->pending->len >= WRITER_MAX_PENDING)
+        g_cond_wait(&writer->cond, &writer->lock);
+    preallocate = writer->options.preallocate;
+#ifdef HAVE_LIBURING
+    if ((async = writer_use_ring(writer))) {
+        guint depth = CLAMP(writer->options.io_depth, 1, WRITER_URING_ENTRIES);
+
+        while (writer->ring_in_flight >= depth)
+            g_cond_wait(&writer->cond, &writer->lock);
+        ++writer->ring_in_flight;
+    }
+#endif
+    if (++writer->stats.in_flight > writer->stats.max_in_flight)
+        writer->stats.max_in_flight = writer->stats.in_flight;
+    g_mutex_unlock(&writer->lock);
+
+    /* opening stays synchronous, the writes need the descriptor */
+    file->fd = open(file->tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd == -1)
+        g_printerr("Error opening %s: %s\n", file->tmpname, strerror(errno));
+    /* best effort, not every file system can */
+    else if (preallocate && size > 0)
+        fallocate(file->fd, 0, 0, size);
+
+#ifdef HAVE_LIBURING
+    if (async) {
+        g_mutex_lock(&writer->lock);
+        if (file->fd != -1 && writer_submit(writer, file)) {
+            g_mutex_unlock(&writer->lock);
+            return;
+        }
+        --writer->ring_in_flight;
+        g_cond_broadcast(&writer->cond);
+        g_mutex_unlock(&writer->lock);
+    }
+#endif
+
+    if (file->fd == -1 || !writer_write_blocking(file)) {
+        writer_written(writer, file, FALSE);
+        if (file->fd != -1)
+            unlink(file->tmpname);
+        writer_file_free(file);
+        return;
+    }
+    writer_written(writer, file, TRUE);
+
+    writer_hand_over(writer, file);
+}
+
+void writer_commit_file(Writer *writer, const gchar *tmpname, const gchar *filename,
+        Stats *timings, WRITER_DONE_CALLBACK callback, gpointer userdata)
+{
+    g_return_if_fail(writer != NULL);
+    g_return_if_fail(tmpname != NULL);
+    g_return_if_fail(filename != NULL);
+
+    WriterFile *file;
+
+    g_mutex_lock(&writer->lock);
+    while (writer->pending->len >= WRITER_MAX_PENDING)
+        g_cond_wait(&writer->cond, &writer->lock);
+    g_mutex_unlock(&writer->lock);
+
+    file = writer_file_new(tmpname, filename, timings, callback, userdata);
+    file->written = file->start;
+    /* fdatasync does not need a writable descriptor */
+    file->fd = open(tmpname, O_RDONLY | O_CLOEXEC);
+
+    if (file->fd == -1) {
+        g_printerr("Error opening %s: %s\n", tmpname, strerror(errno));
+        unlink(tmpname);
+        writer_file_free(file);
+        return;
+    }
+
+    writer_hand_over(writer, file);
+}
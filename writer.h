@@ -0,0 +1,71 @@
+#pragma once
+
+#include <glib.h>
+#include "stats.h"
+
+/* Files are written under a hidden temporary name next to their final one
+ * (.frame0001.jpeg.tmp) and renamed when done, so a crash never leaves a
+ * truncated frame under its real name. How soon they reach the disk is up to
+ * the sync policy; with the batched ones the files keep their temporary name
+ * until their batch has been synced. */
+
+typedef enum {
+    WRITER_SYNC_NEVER = 0, /* left to the kernel */
+    WRITER_SYNC_FRAME,     /* every file before it is renamed */
+    WRITER_SYNC_FRAMES,    /* every sync_frames files, together */
+    WRITER_SYNC_INTERVAL   /* whatever was written in the last sync_interval ms */
+} WriterSyncPolicy;
+
+typedef struct {
+    WriterSyncPolicy sync;
+    guint sync_frames;
+    guint sync_interval;  /* ms */
+    gboolean preallocate; /* fallocate the whole file before writing it */
+    gboolean drop_cache;  /* posix_fadvise(DONTNEED), frames are not read again */
+    gboolean io_uring;    /* with HAVE_LIBURING, falls back to plain writes without it */
+    guint io_depth;       /* io_uring: files written at the same time */
+} WriterOptions;
+
+typedef struct {
+    guint64 files;      /* written, not necessarily synced yet */
+    guint64 bytes;
+    guint64 failed;
+    guint in_flight;    /* being written right now */
+    guint max_in_flight;
+} WriterStats;
+
+typedef struct _Writer Writer;
+
+/* filename, success, userdata; the file has its name and is synced as the
+ * policy asks, or it failed and has been removed; called once per file, from
+ * the thread that finished it, which may be the caller before
+ * writer_write_file returns */
+typedef void (*WRITER_DONE_CALLBACK)(const gchar *, gboolean, gpointer);
+
+void writer_options_init(WriterOptions *options);
+
+WriterSyncPolicy writer_sync_policy_from_string(const gchar *str);
+const gchar *writer_sync_policy_to_string(WriterSyncPolicy policy);
+
+/* the batched policies are synced by a thread of the writer; with io_uring
+ * the encoder threads only submit the writes, another thread finishes them */
+Writer *writer_new(const WriterOptions *options);
+/* syncs and renames everything that is still waiting */
+void writer_destroy(Writer *writer);
+void writer_set_options(Writer *writer, const WriterOptions *options);
+
+/* hidden name in the same directory as filename, free with g_free */
+gchar *writer_get_temp_filename(const gchar *filename);
+
+void writer_get_stats(Writer *writer, WriterStats *stats);
+
+/* thread safe; takes ownership of data, which is released with free_func(free_data)
+ * once it has been written (maybe before this returns); STATS_STAGE_WRITE and
+ * STATS_STAGE_SYNC are recorded in timings (may be NULL), which has to outlive
+ * the writer; callback (may be NULL) tells how it ended */
+void writer_write_file(Writer *writer, const gchar *filename, const guchar *data, gsize size,
+        GDestroyNotify free_func, gpointer free_data, Stats *timings,
+        WRITER_DONE_CALLBACK callback, gpointer userdata);
+/* tmpname has been written by somebody else, e.g. Imlib2 */
+void writer_commit_file(Writer *writer, const gchar *tmpname, const gchar *filename,
+        Stats *timings, WRITER_DONE_CALLBACK callback, gpointer userdata);